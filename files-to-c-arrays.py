@@ -13,56 +13,275 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+from __future__ import print_function
+
+import binascii
+import gzip
+import hashlib
+import io
 import os
 import sys
 
-if len(sys.argv) < 3:
-    print 'Usage: ' + sys.argv[0] + 'output_file input_file1 input_file2 ... input_fileN'
-    print
-    print 'Generates a .c file containing all of the input files as static'
-    print 'character arrays, along with a function to retrieve them.'
-    print
-    print 'const char *get_file(const char *path, size_t *out_size)'
+if len(sys.argv) < 5 or sys.argv[1] != '--root':
+    print('Usage: ' + sys.argv[0] + ' --root document_root output_file input_file1 input_file2 ... input_fileN')
+    print()
+    print('Generates a .c file containing the complete HTTP response that serves')
+    print('each input file under document_root, headers included, as static')
+    print('character arrays, along with a function to retrieve them by URI.')
+    print('Files that compress well also get a gzip-encoded response. Input')
+    print('files outside document_root are skipped.')
+    print()
+    print('const char *get_asset_response(const char *uri, int gzip,')
+    print('                               size_t *out_size, const char **out_etag)')
     exit(1)
 
+document_root = sys.argv[2].replace('\\', '/').strip('/') + '/'
+output_path = sys.argv[3]
+input_paths = sys.argv[4:]
+
+# The same types mongoose would serve the files from disk with.
+mime_types = {
+    '.css': 'text/css',
+    '.gif': 'image/gif',
+    '.htm': 'text/html',
+    '.html': 'text/html',
+    '.jpg': 'image/jpeg',
+    '.js': 'application/x-javascript',
+    '.json': 'application/json',
+    '.png': 'image/png',
+    '.svg': 'image/svg+xml',
+    '.txt': 'text/plain',
+}
+
+# Served with headers that make browsers revalidate on every use, like every
+# other response. The ETag lets the revalidation end in a 304.
+header_template = ('HTTP/1.1 200 OK\r\n'
+                   'Cache-Control: no-cache\r\n'
+                   'Content-Type: %s\r\n'
+                   '%s'
+                   'Content-Length: %d\r\n'
+                   'ETag: %s\r\n'
+                   'Vary: Accept-Encoding\r\n'
+                   'Connection: close\r\n\r\n')
+
+# A gzip variant is only kept if it's at least this much smaller, since
+# otherwise inflating it costs the browser more than the transfer saves.
+min_gzip_saving = 0.1
+
 
 def chunk(list, n):
     """Split a list into size n chunks (the last chunk may be shorter)."""
     return (list[i : i + n] for i in range(0, len(list), n))
 
-filesizes = []
-filepaths = []
-filearrays = []
-for filepath in sys.argv[2:]:
-    filepaths.append(filepath.replace('\\', '/').lstrip('./'))
-    file = open(filepath, 'rb').read()
-    filesizes.append(len(file))
-    escapedfile = '\\x' + '\\x'.join(chunk(file.encode('hex'), 2))
-    filearrays.append('"\n  "'.join(chunk(escapedfile, 76)))
-
-template = """#include <stdint.h>
+
+def c_string(data):
+    """Escape bytes as a C string literal, split over several lines."""
+    hex = binascii.hexlify(data).decode('ascii')
+    escaped = '\\x' + '\\x'.join(chunk(hex, 2))
+    return '"' + '"\n  "'.join(chunk(escaped, 76)) + '"'
+
+
+def c_literal(string):
+    """A C string literal, or NULL for None."""
+    if string is None:
+        return 'NULL'
+    return '"' + string.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def c_size(array):
+    """The length of a generated response array, or 0 for None."""
+    if array is None:
+        return '0'
+    return 'sizeof(%s) - 1' % array
+
+
+def gzip_bytes(data):
+    """Compress data with gzip, leaving out the time so that every build of the
+    same files is the same."""
+    buffer = io.BytesIO()
+    compressor = gzip.GzipFile(filename='', mode='wb', compresslevel=9,
+                               fileobj=buffer, mtime=0)
+    compressor.write(data)
+    compressor.close()
+    return buffer.getvalue()
+
+
+def hash_uri(seed, uri):
+    """32 bit FNV-1a of the URI, started from the given seed. Must match
+    hash_uri in the generated code."""
+    h = (2166136261 ^ seed) & 0xffffffff
+    for byte in bytearray(uri.encode('utf-8')):
+        h ^= byte
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+
+def build_perfect_hash(keys):
+    """Hash and displace: each key's bucket is picked by hash_uri(0, key), and
+    each bucket is given the seed that sends its keys to free slots. Returns
+    the bucket seeds and the key index in each slot, or -1 for none."""
+    num_buckets = max(1, (len(keys) + 1) // 2)
+    num_slots = len(keys)
+    buckets = [[] for i in range(num_buckets)]
+    for index, key in enumerate(keys):
+        buckets[hash_uri(0, key) % num_buckets].append(index)
+    while True:
+        seeds = [0] * num_buckets
+        slots = [-1] * num_slots
+        placed = True
+        for bucket in sorted(range(num_buckets), key=lambda b: -len(buckets[b])):
+            if not buckets[bucket]:
+                continue
+            for seed in range(1, 65536):
+                positions = [hash_uri(seed, keys[i]) % num_slots
+                             for i in buckets[bucket]]
+                if (len(set(positions)) == len(positions) and
+                        all(slots[p] == -1 for p in positions)):
+                    for index, position in zip(buckets[bucket], positions):
+                        slots[position] = index
+                    seeds[bucket] = seed
+                    break
+            else:
+                placed = False
+                break
+        if placed:
+            return seeds, slots
+        num_slots += 1
+
+
+uris = []
+responses = []
+etags = []
+gzip_responses = []
+gzip_etags = []
+arrays = []
+
+
+def add_response(header_type, encoding_header, data, etag):
+    """Add the array holding a response and return its name."""
+    name = 'asset_response_%d' % len(arrays)
+    header = header_template % (header_type, encoding_header, len(data), etag)
+    arrays.append('static const char %s[] =\n  %s;\n' %
+                  (name, c_string(header.encode('ascii') + data)))
+    return name
+
+
+for input_path in input_paths:
+    path = input_path.replace('\\', '/')
+    if path.startswith('./'):
+        path = path[2:]
+    if not path.startswith(document_root):
+        continue
+    uri = '/' + path[len(document_root):]
+    data = open(input_path, 'rb').read()
+    extension = os.path.splitext(path)[1].lower()
+    mime_type = mime_types.get(extension, 'text/plain')
+    # Each encoding is a different representation, so gets its own ETag.
+    content_hash = hashlib.sha1(data).hexdigest()[:16]
+    etag = '"%s"' % content_hash
+    response = add_response(mime_type, '', data, etag)
+    gzip_response = None
+    gzip_etag = None
+    compressed = gzip_bytes(data)
+    if len(compressed) <= len(data) * (1 - min_gzip_saving):
+        gzip_etag = '"%s-gzip"' % content_hash
+        gzip_response = add_response(mime_type, 'Content-Encoding: gzip\r\n',
+                                     compressed, gzip_etag)
+    # The root of the server shows the index.
+    for alias in [uri, '/'] if uri == '/index.html' else [uri]:
+        uris.append(alias)
+        responses.append(response)
+        etags.append(etag)
+        gzip_responses.append(gzip_response)
+        gzip_etags.append(gzip_etag)
+
+seeds, slots = build_perfect_hash(uris)
+
+
+template = """#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
-static const char *file_paths[] = {"%s"};
-static const size_t file_sizes[] = {%s};
-static const int num_files = %d;
-static const char *files[] = {
-  "%s"
+// Generated by files-to-c-arrays.py. Each embedded file is kept as the complete
+// HTTP response that serves it, and, if it compresses well, as the response
+// that serves it gzip-encoded. Files are found by their URI in a perfect hash
+// table: hash_uri(0, uri) picks a bucket, and hash_uri with the bucket's seed
+// picks the slot holding the URI's entry.
+
+%s
+static const char *asset_uris[] = {
+  %s,
+};
+static const char *asset_responses[] = {
+  %s,
+};
+static const size_t asset_response_sizes[] = {
+  %s,
+};
+static const char *asset_etags[] = {
+  %s,
+};
+// NULL for files that are only served as is.
+static const char *asset_gzip_responses[] = {
+  %s,
+};
+static const size_t asset_gzip_response_sizes[] = {
+  %s,
+};
+static const char *asset_gzip_etags[] = {
+  %s,
+};
+enum { num_asset_buckets = %d, num_asset_slots = %d };
+static const uint32_t asset_bucket_seeds[num_asset_buckets] = {
+  %s,
+};
+// The entry in each slot, or -1 for an empty slot.
+static const int asset_slots[num_asset_slots] = {
+  %s,
 };
 
-const char *get_file(const char *path, size_t *out_size) {
-  for (int i = 0; i < num_files; i++) {
-    if (strcmp(file_paths[i], path) == 0) {
-      *out_size = file_sizes[i];
-      return files[i];
-    }
+// 32 bit FNV-1a, started from the given seed.
+static uint32_t hash_uri(uint32_t seed, const char *uri) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (const unsigned char *c = (const unsigned char *)uri; *c; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Returns the response that serves the embedded file at uri, gzip-encoded if
+// gzip is nonzero and the file has a gzip variant, and its ETag. Returns NULL
+// if there is no such file.
+const char *get_asset_response(const char *uri, int gzip, size_t *out_size,
+                               const char **out_etag) {
+  uint32_t seed = asset_bucket_seeds[hash_uri(0, uri) %% num_asset_buckets];
+  int entry = asset_slots[hash_uri(seed, uri) %% num_asset_slots];
+  if (entry < 0 || strcmp(asset_uris[entry], uri) != 0) {
+    return NULL;
+  }
+  if (gzip && asset_gzip_responses[entry]) {
+    *out_size = asset_gzip_response_sizes[entry];
+    *out_etag = asset_gzip_etags[entry];
+    return asset_gzip_responses[entry];
   }
-  return NULL;
+  *out_size = asset_response_sizes[entry];
+  *out_etag = asset_etags[entry];
+  return asset_responses[entry];
 }
 """
 
-output = open(sys.argv[1], 'w')
-output.write(template % ('", "'.join(filepaths),
-                         ', '.join(str(x) for x in filesizes),
-                         len(filepaths),
-                         '",\n  "'.join(filearrays)))
+output = open(output_path, 'w')
+output.write(template % ('\n'.join(arrays),
+                         ',\n  '.join(c_literal(u) for u in uris),
+                         ',\n  '.join(responses),
+                         ',\n  '.join(c_size(r) for r in responses),
+                         ',\n  '.join(c_literal(e) for e in etags),
+                         ',\n  '.join(r or 'NULL' for r in gzip_responses),
+                         ',\n  '.join(c_size(r) for r in gzip_responses),
+                         ',\n  '.join(c_literal(e) for e in gzip_etags),
+                         len(seeds),
+                         len(slots),
+                         ', '.join(str(s) for s in seeds),
+                         ', '.join(str(s) for s in slots)))
+output.close()
@@ -14,9 +14,16 @@
  * limitations under the License.
  */
 
-// We draw a pattern on the screen, encoding information in the colors that can be read by the server in screenshots. We can encode three bytes per pixel, ignoring the alpha channel. The pattern starts with a "magic" identification number, then encodes information about the state of the page.
+// We draw a pattern on the screen, encoding information in the colors that can be read by the server in screenshots. We can encode three bytes per pixel, ignoring the alpha channel. The pattern starts with a "magic" identification number, then encodes information about the state of the page. The layout must match the *_pixel constants in src/screenscraper.h:
+//   0-3   magic
+//   4     JavaScript frames (24 bits)
+//   5     keydown events (24 bits)
+//   6     test mode (blue), identities of the last 4 keys handled, 2 bits each, newest lowest (green)
+//   7     scroll position in device pixels / 256 (24 bits)
+//   8     scroll position mod 256, from the page background
+//   9-11  CSS animation frames, low to high byte, from animated images
 
-// Make the page background a repeating gradient from rgb(0, 0, 0) to rgb(255, 255, 255). This allows the server to read the page's scroll position (mod 255). This background will be almost entirely covered by other content, leaving only one pixel visible for the server to read.
+// Make the page background a repeating gradient from rgb(0, 0, 0) to rgb(255, 255, 255). This allows the server to read the page's scroll position (mod 256) as drawn by the compositor. This background will be almost entirely covered by other content, leaving only one pixel visible for the server to read.
 document.body.style.backgroundImage = 'url("gradient.png")';
 document.body.style.backgroundSize = '1px ' + 256 / window.devicePixelRatio + 'px';
 document.body.style.height = '1000000px';
@@ -55,32 +62,42 @@ if (!gl) {
 testContainer.appendChild(canvasGL);
 
 
-var gradientImage = document.createElement('img');
-gradientImage.src = 'gradient.png';
-setPrefixed('position', 'absolute', gradientImage.style);
-setPrefixed('top', '0', gradientImage.style);
-setPrefixed('left', '0', gradientImage.style);
-setPrefixed('animationDuration', '4.26666667s', gradientImage.style);  // 1 pixel per second
-setPrefixed('animationName', 'gradientImage', gradientImage.style);
-setPrefixed('animationTimingFunction', 'linear', gradientImage.style);
-setPrefixed('animationIterationCount', 'infinite', gradientImage.style);
-setPrefixed('transformOrigin', '0px 0px 0px', gradientImage.style);
-
-var keyframesCss = '@{prefix}keyframes gradientImage {' +
-                   'from {{prefix}transform: translate(6px, 0px); }' +
-                   'to {{prefix}transform: translate(6px, -255px); }}';
+// The CSS animation frame counter is made of three gradient images, each moving up by one pixel per step. The first steps once per frame (at 60Hz), and each of the others steps once per full cycle of the previous one, so together they count frames with 24 bits.
+var cssCounterImages = [
+  { name: 'gradientImage', x: 9, duration: 256 / 60, timing: 'linear' },
+  { name: 'gradientImageMid', x: 10, duration: 256 * 256 / 60, timing: 'steps(256, end)' },
+  { name: 'gradientImageHigh', x: 11, duration: 256 * 256 * 256 / 60, timing: 'steps(256, end)' },
+];
 var keyframesCssWithPrefix = '';
-for (var i = 0; i < cssPrefixes.length; i++) {
-  keyframesCssWithPrefix += keyframesCss.replace(/{prefix}/g, cssPrefixes[i]);
+for (var i = 0; i < cssCounterImages.length; i++) {
+  var counter = cssCounterImages[i];
+  var gradientImage = document.createElement('img');
+  gradientImage.src = 'gradient.png';
+  setPrefixed('position', 'absolute', gradientImage.style);
+  setPrefixed('top', '0', gradientImage.style);
+  setPrefixed('left', '0', gradientImage.style);
+  setPrefixed('animationDuration', counter.duration + 's', gradientImage.style);
+  setPrefixed('animationName', counter.name, gradientImage.style);
+  setPrefixed('animationTimingFunction', counter.timing, gradientImage.style);
+  setPrefixed('animationIterationCount', 'infinite', gradientImage.style);
+  setPrefixed('transformOrigin', '0px 0px 0px', gradientImage.style);
+  // The stepped images move a whole 256 pixels per cycle so that each of their 256 steps lands on a pixel boundary.
+  var distance = counter.timing == 'linear' ? 255 : 256;
+  var keyframesCss = '@{prefix}keyframes ' + counter.name + ' {' +
+                     'from {{prefix}transform: translate(' + counter.x + 'px, 0px); }' +
+                     'to {{prefix}transform: translate(' + counter.x + 'px, -' + distance + 'px); }}';
+  for (var j = 0; j < cssPrefixes.length; j++) {
+    keyframesCssWithPrefix += keyframesCss.replace(/{prefix}/g, cssPrefixes[j]);
+  }
+  testContainer.appendChild(gradientImage);
 }
 var newStyleSheet = document.createElement('style');
 newStyleSheet.textContent = keyframesCssWithPrefix;
 document.head.appendChild(newStyleSheet);
-testContainer.appendChild(gradientImage);
 var rightBlocker = document.createElement('div');
 var bottomBlocker = document.createElement('div');
 rightBlocker.style.position = 'absolute';
-rightBlocker.style.left = '7px';
+rightBlocker.style.left = '12px';
 rightBlocker.style.top = '0px';
 rightBlocker.style.background = 'black';
 rightBlocker.style.width = '100%';
@@ -103,10 +120,26 @@ leftBlocker.style.width = '1px';
 leftBlocker.style.height = '10px';
 document.body.appendChild(leftBlocker);
 
-var zPresses = 0;
+// The server sends a random sequence of these keys so that it can tell which of its key down events we handled. The index is the identity echoed in the pattern, and must match key_identity_t in src/latency-benchmark.h.
+var IDENTIFIED_KEY_CODES = [ 90 /* Z */, 66 /* B */, 84 /* T */, 87 /* W */ ];
+var keyPresses = 0;
+var keyIdentities = 0;
+// While recordHandlerTimes is set, the time each identified key down handler ran is queued here for the server, which uses them to split key down latency into input dispatch and drawing. pendingHandlerTimesFirst is the value of keyPresses for the first one, wrapped to 24 bits like the pattern.
+var recordHandlerTimes = false;
+var pendingHandlerTimes = [];
+var pendingHandlerTimesFirst = 0;
 window.onkeydown = function(e) {
-  if (e.keyCode == 90) {
-    zPresses++;
+  var identity = IDENTIFIED_KEY_CODES.indexOf(e.keyCode);
+  if (identity >= 0) {
+    var handlerTime = getMs();
+    keyPresses++;
+    keyIdentities = ((keyIdentities << 2) | identity) & 0xff;
+    if (recordHandlerTimes) {
+      if (pendingHandlerTimes.length == 0) {
+        pendingHandlerTimesFirst = keyPresses % (1 << 24);
+      }
+      pendingHandlerTimes.push(handlerTime);
+    }
   }
   // If Esc is pressed, abort the current test.
   if (e.keyCode == 27) {
@@ -116,8 +149,28 @@ window.onkeydown = function(e) {
 
 
 var frames = 0;
-var patternPixels = 5;
+// The number of pattern pixels drawn by this script. The rest are drawn by the compositor.
+var patternPixels = 8;
 var patternBytes = patternPixels * 3;
+
+// With ?scanoutProbes=N in the page URL, up to 8 copies of the pixels drawn by this script are also drawn in probe strips spaced evenly down the window, so that the server can see how each frame's update travels down the screen. See probe_strip_pixels in src/screenscraper.h.
+var probeStripsMatch = /[?&]scanoutProbes=(\d+)/.exec(window.location.search);
+var probeStripCount = probeStripsMatch ? Math.min(parseInt(probeStripsMatch[1], 10), 8) : 0;
+var probeStrips = [];
+for (var i = 0; i < probeStripCount; i++) {
+  var probeStrip = document.createElement('canvas');
+  probeStrip.width = patternPixels;
+  probeStrip.height = 1;
+  setPrefixed('transformOrigin', 'top left', probeStrip.style);
+  setPrefixed('transform', 'scale(' + (1 / window.devicePixelRatio) + ')', probeStrip.style);
+  probeStrip.style.position = 'fixed';
+  probeStrip.style.left = '1px';
+  probeStrip.style.top = Math.round(window.innerHeight * (i + 1) / (probeStripCount + 1)) + 'px';
+  probeStrip.style.zIndex = '1000';
+  document.body.appendChild(probeStrip);
+  var probeContext = probeStrip.getContext('2d');
+  probeStrips.push({ context: probeContext, image: probeContext.createImageData(patternPixels, 1) });
+}
 var randomByte = function() {
   return (Math.random() * 256) | 0;
 }
@@ -143,13 +196,22 @@ var TEST_MODES = {
   PAUSE_TIME_TEST_FINISHED: 4,
   NATIVE_REFERENCE: 5,
   ABORT: 6,
+  INPUT_THROUGHPUT: 7,
+  SESSION: 8,
 }
+// Writes a 24-bit value into the given pixel of the pattern, least significant byte first (drawn as blue).
+var writePatternValue = function(pixel, value) {
+  patternByteArray[pixel * 3 + 0] = value & 0xff;
+  patternByteArray[pixel * 3 + 1] = (value >> 8) & 0xff;
+  patternByteArray[pixel * 3 + 2] = (value >> 16) & 0xff;
+};
 var callback = function() {
   raf(callback);
   frames++;
-  patternByteArray[magicPattern.length + 0] = frames;
-  patternByteArray[magicPattern.length + 1] = zPresses;
-  patternByteArray[magicPattern.length + 2] = testMode;
+  writePatternValue(4, frames);
+  writePatternValue(5, keyPresses);
+  writePatternValue(6, testMode | keyIdentities << 8);
+  writePatternValue(7, Math.floor(window.pageYOffset * window.devicePixelRatio / 256));
   if (gl) {
     gl.clearColor(0, 0, 0, 0);
     gl.disable(gl.SCISSOR_TEST);
@@ -167,5 +229,15 @@ var callback = function() {
         notgl.fillRect(i / 3, 0, 1, 1);
     }
   }
+  for (var i = 0; i < probeStrips.length; i++) {
+    var data = probeStrips[i].image.data;
+    for (var j = 0; j < patternPixels; j++) {
+      data[j * 4 + 0] = patternByteArray[j * 3 + 2];
+      data[j * 4 + 1] = patternByteArray[j * 3 + 1];
+      data[j * 4 + 2] = patternByteArray[j * 3 + 0];
+      data[j * 4 + 3] = 255;
+    }
+    probeStrips[i].context.putImageData(probeStrips[i].image, 0, 0);
+  }
 };
 callback();
@@ -241,13 +241,34 @@ var round = function(num, sigFigs) {
   return (Math.round(num / factor) * factor).toFixed(digitsAfterDecimal);
 };
 
-var requestServerTest = function(test, start, finish) {
+// Runs a test on the server. finish is called with the results, and cleanup, if given, is called instead if the test fails.
+var requestServerTest = function(test, start, finish, extraQuery, cleanup) {
   var request = new XMLHttpRequest();
-  request.open('GET', 'http://localhost:5578/test?magicPattern=' + magicPatternHex, true);
+  // A seed from the page URL, e.g. ?seed=1234, repeats the input event schedule of an earlier run.
+  var seedQuery = params.seed ? '&seed=' + encodeURIComponent(params.seed[0]) : '';
+  request.open('GET', 'http://localhost:5578/test?magicPattern=' + magicPatternHex + seedQuery + (extraQuery || ''), true);
   request.onreadystatechange = function() {
     if (request.readyState == 4) {
+      if (request.status != 200 && cleanup) {
+        cleanup();
+      }
       if (request.status == 200) {
-        finish(JSON.parse(request.response));
+        var response = JSON.parse(request.response);
+        // Whether the server could take screenshots often enough to trust its measurements.
+        if (response.quality)
+          results[test.name + ' Measurement Quality'] = response.quality;
+        if (response.seed)
+          results[test.name + ' Seed'] = response.seed;
+        // With ?scanoutProbes=N, how far behind the top of the window each probe strip updated, and how often screenshots caught the window mid-update.
+        if (response.probeStripRows) {
+          results[test.name + ' Probe Strips'] = {
+            rows: response.probeStripRows,
+            offsetMs: response.probeStripOffsetMs,
+            tearEvents: response.tearEvents,
+            screenshots: response.probeScreenshots
+          };
+        }
+        finish(response);
       } else if (request.status == 500) {
         error(test, request.response);
       } else {
@@ -262,13 +283,93 @@ var requestServerTest = function(test, start, finish) {
   }, 200);
 };
 
+// Estimates the offset from getMs() to the server's clock from a few round trips, keeping the one with the shortest round trip time. Calls callback with {offsetMs, uncertaintyMs}, or null if the server couldn't be reached.
+var syncServerClock = function(callback) {
+  var roundTrips = 8;
+  var best = null;
+  var sample = function() {
+    var request = new XMLHttpRequest();
+    var sent = getMs();
+    request.open('GET', 'http://localhost:5578/clockSync', true);
+    request.onreadystatechange = function() {
+      if (request.readyState != 4)
+        return;
+      var received = getMs();
+      if (request.status != 200) {
+        callback(best);
+        return;
+      }
+      var roundTripMs = received - sent;
+      if (!best || roundTripMs / 2 < best.uncertaintyMs) {
+        best = { offsetMs: parseFloat(request.response) - (sent + received) / 2, uncertaintyMs: roundTripMs / 2 };
+      }
+      if (--roundTrips > 0) {
+        sample();
+      } else {
+        callback(best);
+      }
+    };
+    request.send();
+  };
+  sample();
+};
+
+// Sends the queued key down handler times to the server, converted to its clock.
+var uploadHandlerTimes = function(clockSync) {
+  if (pendingHandlerTimes.length == 0)
+    return;
+  var times = pendingHandlerTimes.map(function(time) {
+    return (time + clockSync.offsetMs).toFixed(3);
+  });
+  var request = new XMLHttpRequest();
+  request.open('GET', 'http://localhost:5578/handlerTimes?magicPattern=' + magicPatternHex + '&first=' + pendingHandlerTimesFirst + '&uncertainty=' + clockSync.uncertaintyMs.toFixed(3) + '&times=' + times.join(','), true);
+  request.send();
+  pendingHandlerTimes = [];
+};
+
 var inputLatency = function() {
   var test = this;
   testMode = TEST_MODES.JAVASCRIPT_LATENCY;
-  requestServerTest(test, function() {}, function(response) {
-    var frames = response.keyDownLatencyMs/(1000/60);
-    addScore(frames, 0.5, 3, 1, 'Keydown Latency');
-    pass(test, frames.toFixed(1) + ' frames latency (lower is better)');
+  // Equivalent-time sampling can be turned on from the page URL, e.g. ?equivalentTimePhases=16
+  var extraQuery = params.equivalentTimePhases ? '&equivalentTimePhases=' + encodeURIComponent(params.equivalentTimePhases[0]) : '';
+  syncServerClock(function(clockSync) {
+    var uploader = null;
+    if (clockSync) {
+      pendingHandlerTimes = [];
+      recordHandlerTimes = true;
+      uploader = setInterval(function() { uploadHandlerTimes(clockSync); }, 250);
+    }
+    var stopRecording = function() {
+      recordHandlerTimes = false;
+      pendingHandlerTimes = [];
+      if (uploader)
+        clearInterval(uploader);
+    };
+    requestServerTest(test, function() {}, function(response) {
+      stopRecording();
+      var frames = response.keyDownLatencyMs/(1000/60);
+      addScore(frames, 0.5, 3, 1, 'Keydown Latency');
+      // Latency for events injected at each phase of the refresh interval,
+      // starting at vblank. Shows whether input is latched early or late.
+      results['Keydown Latency by Refresh Phase (ms)'] =
+          response.keyDownLatencyByPhaseMs;
+      results['Keydown Latency Percentiles (ms)'] = response.keyDownLatencyPercentilesMs;
+      if (response.floorSamples > 0) {
+        // The latency of a native window on this machine, which no browser can beat.
+        results['Latency Floor (ms)'] = response.floorLatencyMs;
+        results['Keydown Latency Above Floor (ms)'] = response.keyDownLatencyAboveFloorMs;
+        results['Keydown Stddev Above Floor (ms)'] = response.keyDownStddevAboveFloorMs;
+      }
+      results['Capture Interval (ms)'] = response.meanCaptureIntervalMs;
+      results['Keydown Latency Resolution (ms)'] = response.keyDownEffectiveResolutionMs;
+      if (response.keyDownHandlerSamples > 0) {
+        // Whether latency is spent before our handler runs (input dispatch) or after it (rendering and compositing).
+        results['Keydown Input to Handler (ms)'] = response.keyDownInputToHandlerMs;
+        results['Keydown Handler to Pixels (ms)'] = response.keyDownHandlerToPixelsMs;
+        results['Clock Sync Uncertainty (ms)'] = response.clockSyncUncertaintyMs;
+      }
+      pass(test, frames.toFixed(1) + ' frames latency (lower is better)');
+    }, extraQuery, stopRecording);
   });
 };
 
@@ -278,10 +379,50 @@ var scrollLatency = function() {
   requestServerTest(test, function() {}, function(response) {
     var frames = response.scrollLatencyMs/(1000/60);
     addScore(frames, 0.5, 3, 1, 'Scroll Latency');
+    results['Scroll Latency Percentiles (ms)'] = response.scrollLatencyPercentilesMs;
+    results['Scroll Trajectory'] = response.scrollTrajectory;
     pass(test, frames.toFixed(1) + ' frames latency (lower is better)');
   });
 };
 
+// Measures keydown and scroll latency in one run, with keydown events sent while scrolls settle, in a fraction of the time the separate tests take.
+var latencySession = function() {
+  var test = this;
+  testMode = TEST_MODES.SESSION;
+  requestServerTest(test, function() {}, function(response) {
+    var keyDownFrames = response.keyDownLatencyMs/(1000/60);
+    var scrollFrames = response.scrollLatencyMs/(1000/60);
+    addScore(keyDownFrames, 0.5, 3, 1, 'Keydown Latency');
+    addScore(scrollFrames, 0.5, 3, 1, 'Scroll Latency');
+    results['Keydown Latency Percentiles (ms)'] = response.keyDownLatencyPercentilesMs;
+    results['Scroll Latency Percentiles (ms)'] = response.scrollLatencyPercentilesMs;
+    results['Scroll Trajectory'] = response.scrollTrajectory;
+    if (response.keyDownDuringScrollSamples > 0) {
+      // Kept apart from the keydown latency above, since a scroll may slow them.
+      results['Keydown Latency During Scrolls (ms)'] = response.keyDownDuringScrollLatencyMs;
+      results['Keydown Latency Percentiles During Scrolls (ms)'] = response.keyDownDuringScrollLatencyPercentilesMs;
+    }
+    pass(test, keyDownFrames.toFixed(1) + ' frames keydown, ' + scrollFrames.toFixed(1) + ' frames scroll latency (lower is better)');
+  });
+};
+
+var inputThroughput = function() {
+  var test = this;
+  testMode = TEST_MODES.INPUT_THROUGHPUT;
+  // The swept rates can be overridden from the page URL, e.g. ?inputRates=10,100,1000
+  var extraQuery = params.inputRates ? '&inputRates=' + encodeURIComponent(params.inputRates[0]) : '';
+  requestServerTest(test, function() {}, function(response) {
+    results['Input Throughput'] = response.throughput;
+    results['Input Saturation Rate'] = response.saturationRate;
+    var last = response.throughput[response.throughput.length - 1];
+    if (response.saturationRate) {
+      pass(test, 'Input backs up at ' + response.saturationRate + ' events/s');
+    } else {
+      pass(test, 'Kept up with ' + last.rate + ' events/s, ' + last.meanLatencyMs.toFixed(1) + ' ms latency');
+    }
+  }, extraQuery);
+};
+
 var testJank = function() {
   var test = this;
   var values = [];
@@ -313,17 +454,20 @@ var testJank = function() {
       case 'css':
         var jank = response.maxCssPauseTimeMs/(1000/60);
         addScore(jank, 1, 5, .3, test.name + ' - CSS');
-        reports.push('CSS: ' + jank.toFixed(1) + ' frames jank');
+        results[test.name + ' - CSS Frame Intervals'] = response.cssFrameIntervals;
+        reports.push('CSS: ' + jank.toFixed(1) + ' frames jank, ' + response.cssFrameIntervals.droppedFrames + ' dropped');
         break;
       case 'js':
         var jank = response.maxJSPauseTimeMs/(1000/60);
         addScore(jank, 1, 5, .3, test.name + ' - Javascript');
-        reports.push('JavaScript: ' + jank.toFixed(1) + ' frames jank');
+        results[test.name + ' - Javascript Frame Intervals'] = response.jsFrameIntervals;
+        reports.push('JavaScript: ' + jank.toFixed(1) + ' frames jank, ' + response.jsFrameIntervals.droppedFrames + ' dropped');
         break;
       case 'scroll':
         var jank = response.maxScrollPauseTimeMs/(1000/60);
         addScore(jank, 1, 5, .3, test.name + ' - Scrolling');
-        reports.push('Scrolling: ' + jank.toFixed(1) + ' frames jank');
+        results[test.name + ' - Scrolling Frame Intervals'] = response.scrollFrameIntervals;
+        reports.push('Scrolling: ' + jank.toFixed(1) + ' frames jank, ' + response.scrollFrameIntervals.droppedFrames + ' dropped');
         break;
       }
     }
@@ -464,6 +608,9 @@ var tests = [
   { name: 'Scroll latency',
     info: 'Tests the delay from mousewheel movement to on-screen response.',
     test: scrollLatency },
+  { name: 'Input throughput',
+    info: 'Tests how latency grows as keypresses arrive faster than frames.',
+    test: inputThroughput },
   { name: 'Native reference',
     info: 'Tests the input latency of a native app\'s window for comparison to the browser.',
     test: testNative },
@@ -524,6 +671,16 @@ var tests = [
   // { name: 'Worker GC doesn\'t affect main page', test: testJank, blocker: workerGCLoad },
   ];
 
+// With ?session=1, the keydown and scroll latency tests are replaced by one interleaved session. The session sends input throughout, so its pause times aren't baseline jank, and the jank tests still run on their own.
+if (params.session) {
+  tests = tests.filter(function(test) {
+    return test.test != inputLatency && test.test != scrollLatency;
+  });
+  tests.unshift({ name: 'Latency session',
+    info: 'Tests keydown and scroll latency together.',
+    test: latencySession });
+}
+
 for (var i = 0; i < tests.length; i++) {
   var test = tests[i];
   var row = document.createElement('tr');
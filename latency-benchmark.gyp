@@ -4,10 +4,11 @@
       'target_name': 'latency-benchmark',
       'type': 'executable',
       'sources': [
-        'src/latency-benchmark.c',
-        'src/latency-benchmark.h',
-        'src/screenscraper.h',
         'src/server.c',
+        'src/results-writer.c',
+        'src/results-writer.h',
+        'src/header-list.c',
+        'src/header-list.h',
         'src/oculus.cpp',
         'src/oculus.h',
         'src/clioptions.c',
@@ -15,6 +16,7 @@
         '<(INTERMEDIATE_DIR)/packaged-html-files.c',
       ],
       'dependencies': [
+        'latency-benchmark-engine',
         'mongoose',
         'libovr',
       ],
@@ -38,14 +40,13 @@
           'outputs': [
             '<(INTERMEDIATE_DIR)/packaged-html-files.c',
           ],
-          'action': ['python', 'files-to-c-arrays.py', '<@(_outputs)', '<@(_inputs)'],
+          'action': ['python', 'files-to-c-arrays.py', '--root', 'html', '<@(_outputs)', '<@(_inputs)'],
           'msvs_cygwin_shell': 0,
         },
       ],
       'conditions': [
         ['OS=="linux"', {
           'sources': [
-            'src/x11/screenscraper.c',
             'src/x11/main.c',
           ],
         }],
@@ -53,13 +54,55 @@
           'sources': [
             'src/win/getopt.c',
             'src/win/main.cpp',
-            'src/win/screenscraper.cpp',
             'src/win/stdafx.h',
           ],
         }],
         ['OS=="mac"', {
           'sources': [
             'src/mac/main.m',
+          ],
+        }],
+      ],
+      'msvs_settings': {
+        'VCCLCompilerTool': {
+          'CompileAs': 2, # Compile C as C++, since msvs doesn't support C99
+        },
+        'VCLinkerTool': {
+          'AdditionalDependencies': [
+            'winmm.lib',
+            'setupapi.lib',
+          ],
+        },
+      },
+    },
+    {
+      # The measurement engine and platform layer, without the server, so that
+      # other programs can run latency sessions.
+      'target_name': 'latency-benchmark-engine',
+      'type': 'static_library',
+      'sources': [
+        'src/latency-benchmark.c',
+        'src/latency-benchmark.h',
+        'src/screenscraper.h',
+        'src/interval-stats.c',
+        'src/interval-stats.h',
+        'src/trace.c',
+        'src/trace.h',
+      ],
+      'conditions': [
+        ['OS=="linux"', {
+          'sources': [
+            'src/x11/screenscraper.c',
+          ],
+        }],
+        ['OS=="win"', {
+          'sources': [
+            'src/win/screenscraper.cpp',
+            'src/win/stdafx.h',
+          ],
+        }],
+        ['OS=="mac"', {
+          'sources': [
             'src/mac/screenscraper.m',
           ],
           'link_settings': {
@@ -72,18 +115,69 @@
           },
         }],
       ],
+      'msvs_settings': {
+        'VCCLCompilerTool': {
+          'CompileAs': 2, # Compile C as C++, since msvs doesn't support C99
+        },
+      },
+    },
+    {
+      # Runs the measurement engine against a simulated display with a known
+      # latency distribution, and reports the bias and spread of its estimates.
+      'target_name': 'validate-estimators',
+      'type': 'executable',
+      'sources': [
+        'src/latency-benchmark.c',
+        'src/latency-benchmark.h',
+        'src/screenscraper.h',
+        'src/interval-stats.c',
+        'src/interval-stats.h',
+        'src/trace.c',
+        'src/trace.h',
+        'src/simulated/screenscraper.c',
+        'src/simulated/simulated-display.h',
+        'src/simulated/validate-estimators.c',
+      ],
+      'conditions': [
+        ['OS=="mac"', {
+          'link_settings': {
+            'libraries': [
+              '$(SDKROOT)/System/Library/Frameworks/OpenGL.framework',
+            ],
+          },
+        }],
+      ],
       'msvs_settings': {
         'VCCLCompilerTool': {
           'CompileAs': 2, # Compile C as C++, since msvs doesn't support C99
         },
         'VCLinkerTool': {
-          'AdditionalDependencies': [
-            'winmm.lib',
-            'setupapi.lib',
-          ],
+          'SubSystem': 1, # Console
         },
       },
     },
+    {
+      # Runs validate-estimators, failing the build if any estimate's bias
+      # exceeds its tolerance. It writes its stamp file only when all pass.
+      'target_name': 'run-validate-estimators',
+      'type': 'none',
+      'dependencies': [
+        'validate-estimators',
+      ],
+      'actions': [
+        {
+          'action_name': 'validate estimators',
+          'inputs': [
+            '<(PRODUCT_DIR)/validate-estimators<(EXECUTABLE_SUFFIX)',
+          ],
+          'outputs': [
+            '<(INTERMEDIATE_DIR)/validate-estimators.stamp',
+          ],
+          'action': ['<@(_inputs)', '-o', '<@(_outputs)'],
+          'msvs_cygwin_shell': 0,
+        },
+      ],
+    },
     {
       'target_name': 'mongoose',
       'type': 'static_library',
@@ -250,6 +344,7 @@
           '-lGL',
           '-ludev',
           '-lXinerama',
+          '-lm',
           ],
         },
       }],
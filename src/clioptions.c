@@ -1,4 +1,5 @@
 #include "clioptions.h"
+#include "latency-benchmark.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,9 +12,20 @@ int getopt(int, char **, char *);
 void print_usage_and_exit() {
   fprintf(stderr, "usage: latency-benchmark -a -b path_to_browser_executable\n");
   fprintf(stderr, "           [-r url_to_post_results_to] [-e arguments_for_browser]\n");
+  fprintf(stderr, "           [-t trace_file_prefix] [-f] [-s seed]\n");
+  fprintf(stderr, "       latency-benchmark -k\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "Measures input latency and jank in web browsers. Specify -a, -b,\n");
   fprintf(stderr, "and -r to automatically run the test and report results to a server.\n");
+  fprintf(stderr, "Specify -t to write a timeline of each test to a trace file that can\n");
+  fprintf(stderr, "be loaded in chrome://tracing or Perfetto. Specify -k to report the\n");
+  fprintf(stderr, "overhead and resolution of the clock used to measure latency.\n");
+  fprintf(stderr, "Specify -f to measure the latency floor of this machine against a\n");
+  fprintf(stderr, "native window before each key down test and also report the mean\n");
+  fprintf(stderr, "and deviation of key down latency with the floor taken out. Scroll\n");
+  fprintf(stderr, "latency has no floor. Specify -s to make every test's random\n");
+  fprintf(stderr, "choices from the given nonzero seed, to repeat the exact schedule\n");
+  fprintf(stderr, "of input events of an earlier run.\n");
   exit(1);
 }
 
@@ -24,7 +36,7 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
   int c;
 
   //TODO: use getopt_long for better looking cli args
-  while ((c = getopt(argc, (char **)argv, "ab:d:r:e:p:h:")) != -1) {
+  while ((c = getopt(argc, (char **)argv, "ab:d:r:e:p:h:t:kfs:")) != -1) {
     switch(c) {
     case 'a':
       options->automated = true;
@@ -44,6 +56,21 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
     case 'h':
       options->parent_handle = optarg;
       break;
+    case 't':
+      options->trace_file_prefix = optarg;
+      break;
+    case 'k':
+      options->benchmark_clock = true;
+      break;
+    case 'f':
+      options->calibrate_floor = true;
+      break;
+    case 's':
+      if (!parse_seed(optarg, &options->seed)) {
+        fprintf(stderr, "The seed must be a nonzero decimal number.\n");
+        print_usage_and_exit();
+      }
+      break;
     case ':':
       fprintf(stderr, "Option -%c requires an operand\n", optopt);
       print_usage_and_exit();
@@ -57,7 +84,9 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
   // Validate the options.
   if (options->magic_pattern) {
     if (options->automated || options->browser || options->results_url ||
-        options->browser_args) {
+        options->browser_args || options->trace_file_prefix ||
+        options->benchmark_clock || options->calibrate_floor ||
+        options->seed) {
       fprintf(stderr, "-p is incompatible with all other options except -h.\n");
       print_usage_and_exit();
     }
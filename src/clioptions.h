@@ -13,6 +13,16 @@ typedef struct {
                        // hexadecimal.
   char *parent_handle; // On Windows, this option is passed to child processes
                        // holding the HANDLE value of their parent.
+  bool benchmark_clock; // Measure the timer used for all latency measurements
+                        // and exit.
+  char *trace_file_prefix; // If set, a timeline of each test is written to
+                           // <prefix>-<test number>.json in the Trace Event
+                           // Format.
+  bool calibrate_floor; // Measure the latency of the native reference window
+                        // before each key down test and report results
+                        // relative to it.
+  uint64_t seed; // If not 0, every test makes its random choices from this
+                 // seed, so runs send identical schedules of input events.
 } clioptions;
 
 void parse_commandline(int argc, const char **argv, clioptions *options);
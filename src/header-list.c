@@ -0,0 +1,84 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "header-list.h"
+
+static bool is_header_space(char c) {
+  return c == ' ' || c == '\t';
+}
+
+static const char *skip_header_space(const char *text) {
+  while (is_header_space(*text)) {
+    text++;
+  }
+  return text;
+}
+
+// Returns true if the list element starting at the given position is the
+// given value, ignoring case and the space around it.
+static bool element_is(const char *element, const char *value) {
+  size_t length = strlen(value);
+  for (size_t i = 0; i < length; i++) {
+    if (tolower((unsigned char)element[i]) !=
+        tolower((unsigned char)value[i])) {
+      return false;
+    }
+  }
+  const char *end = skip_header_space(element + length);
+  return *end == '\0' || *end == ',' || *end == ';';
+}
+
+// Returns the q parameter among the parameters of a list element, which start
+// at the given position, or 1 if there is none.
+static double element_quality(const char *parameters) {
+  while (*parameters == ';') {
+    const char *name = skip_header_space(parameters + 1);
+    const char *after_name = skip_header_space(name + 1);
+    if (tolower((unsigned char)*name) == 'q' && *after_name == '=') {
+      double quality = strtod(skip_header_space(after_name + 1), NULL);
+      if (quality < 0) {
+        return 0;
+      }
+      return quality > 1 ? 1 : quality;
+    }
+    parameters += strcspn(parameters + 1, ";,") + 1;
+  }
+  return 1;
+}
+
+double header_list_quality(const char *header, const char *value) {
+  if (!header) {
+    return -1;
+  }
+  const char *element = header;
+  while (*element) {
+    element = skip_header_space(element);
+    if (element_is(element, value)) {
+      const char *parameters = element + strlen(value);
+      parameters += strcspn(parameters, ";,");
+      return element_quality(parameters);
+    }
+    element += strcspn(element, ",");
+    if (*element == ',') {
+      element++;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Parses the comma-separated lists of values that HTTP headers such as Accept
+// and Accept-Encoding carry, where each value may be followed by parameters
+// and a q parameter gives its relative quality, e.g.
+// "application/cbor;q=0.9, application/json;q=0.5, */*;q=0".
+
+#ifndef WLB_HEADER_LIST_H_
+#define WLB_HEADER_LIST_H_
+
+// Returns the quality, from 0 to 1, that the given header list gives the given
+// value, which is compared ignoring case. A value without a q parameter has
+// quality 1, and one with q=0 is refused. Returns -1 if the list doesn't name
+// the value. Accepts NULL.
+double header_list_quality(const char *header, const char *value);
+
+#endif  // WLB_HEADER_LIST_H_
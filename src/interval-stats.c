@@ -0,0 +1,184 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interval-stats.h"
+
+// EM stops once no interval's mass changes by more than this in an iteration,
+// or after the maximum number of iterations.
+static const double em_tolerance = 1e-8;
+static const int em_max_iterations = 10000;
+
+typedef struct {
+  double value;
+  bool is_upper;
+} endpoint;
+
+// Sorts endpoints by value. Sample intervals are closed, so at equal values
+// lower endpoints sort first, making intervals that touch overlap.
+static int compare_endpoints(const void *a, const void *b) {
+  const endpoint *x = (const endpoint *)a;
+  const endpoint *y = (const endpoint *)b;
+  if (x->value != y->value) {
+    return x->value < y->value ? -1 : 1;
+  }
+  return (int)x->is_upper - (int)y->is_upper;
+}
+
+bool fit_censored_distribution(const double lower[], const double upper[],
+                               int num_samples,
+                               censored_distribution_t *out_distribution) {
+  memset(out_distribution, 0, sizeof(censored_distribution_t));
+  if (num_samples > max_censored_samples) {
+    num_samples = max_censored_samples;
+  }
+  if (num_samples <= 0) {
+    return false;
+  }
+  // The maximum likelihood estimate only puts mass in the Turnbull intervals:
+  // those that run from a lower endpoint to the next upper endpoint with no
+  // other endpoint in between.
+  endpoint endpoints[2 * max_censored_samples];
+  for (int i = 0; i < num_samples; i++) {
+    assert(lower[i] <= upper[i]);
+    endpoints[2 * i].value = lower[i];
+    endpoints[2 * i].is_upper = false;
+    endpoints[2 * i + 1].value = upper[i];
+    endpoints[2 * i + 1].is_upper = true;
+  }
+  qsort(endpoints, 2 * num_samples, sizeof(endpoint), compare_endpoints);
+  int m = 0;
+  for (int i = 0; i + 1 < 2 * num_samples; i++) {
+    if (!endpoints[i].is_upper && endpoints[i + 1].is_upper) {
+      out_distribution->lower[m] = endpoints[i].value;
+      out_distribution->upper[m] = endpoints[i + 1].value;
+      m++;
+    }
+  }
+  assert(m > 0 && m <= num_samples);
+  out_distribution->num_intervals = m;
+  // Each sample's likelihood is the total mass of the Turnbull intervals it
+  // contains. Since the Turnbull intervals are sorted and disjoint, those are a
+  // contiguous range, [first[i], last[i]).
+  int first[max_censored_samples];
+  int last[max_censored_samples];
+  for (int i = 0; i < num_samples; i++) {
+    first[i] = 0;
+    while (first[i] < m && out_distribution->lower[first[i]] < lower[i]) {
+      first[i]++;
+    }
+    last[i] = first[i];
+    while (last[i] < m && out_distribution->upper[last[i]] <= upper[i]) {
+      last[i]++;
+    }
+    assert(last[i] > first[i]);
+  }
+  // EM: start from uniform mass, then repeatedly give each interval the
+  // expected fraction of samples that lie in it given the current estimate.
+  double *mass = out_distribution->mass;
+  double next_mass[max_censored_samples];
+  for (int j = 0; j < m; j++) {
+    mass[j] = 1.0 / m;
+  }
+  int iteration;
+  for (iteration = 1; iteration <= em_max_iterations; iteration++) {
+    memset(next_mass, 0, sizeof(double) * m);
+    for (int i = 0; i < num_samples; i++) {
+      double likelihood = 0;
+      for (int j = first[i]; j < last[i]; j++) {
+        likelihood += mass[j];
+      }
+      if (likelihood <= 0) {
+        continue;
+      }
+      for (int j = first[i]; j < last[i]; j++) {
+        next_mass[j] += mass[j] / likelihood / num_samples;
+      }
+    }
+    double max_change = 0;
+    for (int j = 0; j < m; j++) {
+      double change = next_mass[j] - mass[j];
+      if (change < 0) {
+        change = -change;
+      }
+      if (change > max_change) {
+        max_change = change;
+      }
+      mass[j] = next_mass[j];
+    }
+    if (max_change < em_tolerance) {
+      break;
+    }
+  }
+  out_distribution->iterations = iteration;
+  return true;
+}
+
+double censored_distribution_quantile(
+    const censored_distribution_t *distribution, double fraction) {
+  assert(distribution->num_intervals > 0);
+  double cumulative = 0;
+  for (int j = 0; j < distribution->num_intervals; j++) {
+    double mass = distribution->mass[j];
+    if (mass > 0 && cumulative + mass >= fraction) {
+      double within = (fraction - cumulative) / mass;
+      if (within < 0) {
+        within = 0;
+      }
+      return distribution->lower[j] +
+          within * (distribution->upper[j] - distribution->lower[j]);
+    }
+    cumulative += mass;
+  }
+  return distribution->upper[distribution->num_intervals - 1];
+}
+
+double censored_distribution_variance(
+    const censored_distribution_t *distribution) {
+  double mean = censored_distribution_mean(distribution);
+  double variance = 0;
+  for (int j = 0; j < distribution->num_intervals; j++) {
+    double width = distribution->upper[j] - distribution->lower[j];
+    double offset = (distribution->lower[j] + distribution->upper[j]) / 2 -
+        mean;
+    // The variance of a uniform distribution over the interval, plus that of
+    // the interval's midpoint about the mean.
+    variance += distribution->mass[j] * (width * width / 12 + offset * offset);
+  }
+  return variance;
+}
+
+double censored_distribution_resolution(
+    const censored_distribution_t *distribution) {
+  double resolution = 0;
+  for (int j = 0; j < distribution->num_intervals; j++) {
+    resolution += distribution->mass[j] *
+        (distribution->upper[j] - distribution->lower[j]);
+  }
+  return resolution;
+}
+
+double censored_distribution_mean(const censored_distribution_t *distribution) {
+  double mean = 0;
+  for (int j = 0; j < distribution->num_intervals; j++) {
+    mean += distribution->mass[j] *
+        (distribution->lower[j] + distribution->upper[j]) / 2;
+  }
+  return mean;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Estimates a latency distribution from interval-censored samples. We never
+// see exactly when the screen changed, only that it happened between two
+// screenshots, so each latency sample is an interval known to contain the true
+// latency. Averaging the interval bounds is biased whenever the intervals are
+// comparable to the latency itself. Instead we fit the nonparametric maximum
+// likelihood estimate of the distribution (Turnbull's estimator) with the EM
+// algorithm, which uses the overlap between samples to locate the latency
+// more precisely than any single interval does.
+
+#ifndef WLB_INTERVAL_STATS_H_
+#define WLB_INTERVAL_STATS_H_
+
+#include "screenscraper.h"
+
+// The most samples one distribution can be fitted to.
+enum { max_censored_samples = 256 };
+
+// The fitted distribution. Its probability mass lies in a set of disjoint
+// intervals (Turnbull intervals), in increasing order. The likelihood doesn't
+// depend on where mass lies within an interval, so it is treated as uniform.
+typedef struct {
+  int num_intervals;
+  double lower[max_censored_samples];
+  double upper[max_censored_samples];
+  double mass[max_censored_samples];  // Sums to 1.
+  int iterations;                     // EM iterations taken to converge.
+} censored_distribution_t;
+
+// Fits a distribution to num_samples samples, the ith of which is known to lie
+// in the closed interval [lower[i], upper[i]]. Samples beyond
+// max_censored_samples are ignored. Returns false if there are no samples.
+bool fit_censored_distribution(const double lower[], const double upper[],
+                               int num_samples,
+                               censored_distribution_t *out_distribution);
+
+// Returns the value below which the given fraction (0 to 1) of the fitted
+// distribution lies.
+double censored_distribution_quantile(
+    const censored_distribution_t *distribution, double fraction);
+
+// Returns the mean of the fitted distribution.
+double censored_distribution_mean(const censored_distribution_t *distribution);
+
+// Returns the variance of the fitted distribution, treating the mass in each
+// interval as uniform.
+double censored_distribution_variance(
+    const censored_distribution_t *distribution);
+
+// Returns the mean width of the intervals the distribution's mass lies in,
+// weighted by their mass. This is the resolution at which the samples located
+// the distribution, which can be much finer than the width of any one sample
+// when the samples' bounds are staggered.
+double censored_distribution_resolution(
+    const censored_distribution_t *distribution);
+
+#endif  // WLB_INTERVAL_STATS_H_
@@ -26,47 +26,85 @@
 #include <stdlib.h>
 #include <time.h>
 #include <limits.h>
+#include <math.h>
 #include "screenscraper.h"
 #include "latency-benchmark.h"
+#include "trace.h"
+#include "interval-stats.h"
+
+// Writes a 24-bit value to the given pixel of a pattern, least significant
+// byte in the blue channel.
+static void write_pattern_value(uint8_t pattern[], int pixel, int value) {
+  pattern[pixel * 4 + 0] = value & 0xff;
+  pattern[pixel * 4 + 1] = (value >> 8) & 0xff;
+  pattern[pixel * 4 + 2] = (value >> 16) & 0xff;
+}
+
+// Reads a 24-bit value from the given pixel of a pattern or screenshot.
+static int read_pattern_value(const uint8_t pattern[], int pixel) {
+  return pattern[pixel * 4 + 0] | pattern[pixel * 4 + 1] << 8 |
+      pattern[pixel * 4 + 2] << 16;
+}
+
+// Writes an 8-bit value to the given pixel of a pattern as a grey level, the
+// way the browser's compositor draws the gradient pixels.
+static void write_pattern_grey(uint8_t pattern[], int pixel, int value) {
+  pattern[pixel * 4 + 0] = pattern[pixel * 4 + 1] = pattern[pixel * 4 + 2] =
+      value & 0xff;
+}
+
+// Returns the echo of key identities updated for a newly handled key.
+int push_key_identity(int identities, key_identity_t identity) {
+  return ((identities << 2) | identity) & 0xff;
+}
 
-int64_t last_draw_time = 0;
-int64_t biggest_draw_time_gap = 0;
+
+// The native reference window draws this many probe strips, spaced evenly down
+// the window.
+static const int native_probe_strips = 3;
 
 // Updates the given pattern with the given event data, then draws the pattern
-// to the current OpenGL context.
-void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
-                              int keydown_events, int esc_presses) {
+// and its probe strips to the current OpenGL context.
+void draw_pattern_with_opengl(draw_timing_t *timing, uint8_t pattern[],
+                              int scroll_events, int keydown_events,
+                              int key_identities, int esc_presses) {
   int64_t time = get_nanoseconds();
-  if (last_draw_time > 0) {
-    if (time - last_draw_time > biggest_draw_time_gap) {
-      biggest_draw_time_gap = time - last_draw_time;
+  if (timing->last_draw_time > 0) {
+    if (time - timing->last_draw_time > timing->biggest_draw_time_gap) {
+      timing->biggest_draw_time_gap = time - timing->last_draw_time;
       debug_log("New biggest draw time gap: %f ms.",
-          biggest_draw_time_gap / (double)nanoseconds_per_millisecond);
+          timing->biggest_draw_time_gap / (double)nanoseconds_per_millisecond);
     }
   }
-  last_draw_time = time;
-  if (esc_presses == 0) {
-    pattern[4 * 4 + 2] = TEST_MODE_JAVASCRIPT_LATENCY;
-  } else {
-    pattern[4 * 4 + 2] = TEST_MODE_ABORT;
+  timing->last_draw_time = time;
+  test_mode_t test_mode = TEST_MODE_JAVASCRIPT_LATENCY;
+  if (esc_presses > 0) {
+    test_mode = TEST_MODE_ABORT;
   }
-  // Update the pattern with the number of scroll events mod 255.
-  pattern[4 * 5] = pattern[4 * 5 + 1] = pattern[4 * 5 + 2] = scroll_events;
-  // Update the pattern with the number of keydown events mod 255.
-  pattern[4 * 4 + 1] = keydown_events;
+  write_pattern_value(pattern, test_mode_pixel,
+      test_mode | (key_identities & 0xff) << 8);
+  // Update the pattern with the number of scroll events, split between the
+  // high bits and the low byte the same way as the browser's scroll position.
+  write_pattern_value(pattern, scroll_position_high_pixel, scroll_events >> 8);
+  write_pattern_grey(pattern, scroll_position_pixel, scroll_events);
+  // Update the pattern with the number of keydown events.
+  write_pattern_value(pattern, key_down_events_pixel, keydown_events);
   // Increment the "JavaScript frames" counter.
-  pattern[4 * 4 + 0]++;
-  // Increment the "CSS animation frames" counter.
-  pattern[4 * 6 + 0]++;
-  pattern[4 * 6 + 1]++;
-  pattern[4 * 6 + 2]++;
+  int frames = (read_pattern_value(pattern, javascript_frames_pixel) + 1) %
+      pattern_counter_modulus;
+  write_pattern_value(pattern, javascript_frames_pixel, frames);
+  // Update the "CSS animation frames" counter, which counts frames just like
+  // the JavaScript one.
+  write_pattern_grey(pattern, css_frames_pixel, frames);
+  write_pattern_grey(pattern, css_frames_mid_pixel, frames >> 8);
+  write_pattern_grey(pattern, css_frames_high_pixel, frames >> 16);
   GLint viewport[4];
   glGetIntegerv(GL_VIEWPORT, viewport);
   GLint height = viewport[3];
   glDisable(GL_SCISSOR_TEST);
   // Alternate background each frame to make tearing easy to spot.
   float background = 1;
-  if (pattern[4 * 4 + 0] % 2 == 1)
+  if (frames % 2 == 1)
     background = 0.8;
   glClearColor(background, background, background, 1);
   glClear(GL_COLOR_BUFFER_BIT);
@@ -78,6 +116,16 @@ void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
     glScissor(i / 4, height - 1, 1, 1);
     glClear(GL_COLOR_BUFFER_BIT);
   }
+  for (int strip = 1; strip <= native_probe_strips; strip++) {
+    GLint row = height - 1 - height * strip / (native_probe_strips + 1);
+    for (int i = 0; i < probe_strip_pixels * 4; i += 4) {
+      glClearColor(pattern[i + 2] / 255.0,
+                   pattern[i + 1] / 255.0,
+                   pattern[i] / 255.0, 1);
+      glScissor(i / 4, row, 1, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+  }
 }
 
 
@@ -128,6 +176,98 @@ void hex_encode_magic_pattern(const uint8_t magic_pattern[],
 }
 
 
+// A pseudorandom number generator (SplitMix64). Unlike rand(), its state is
+// explicit, so tests on different threads don't share it and a test's choices
+// can be replayed from its seed.
+typedef struct {
+  uint64_t state;
+} random_t;
+
+static uint64_t mix_random_bits(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t next_random(random_t *random) {
+  random->state += 0x9e3779b97f4a7c15ULL;
+  return mix_random_bits(random->state);
+}
+
+// Seeds one of several independent streams from the same seed. Each kind of
+// random choice draws from its own stream, so that how many draws one kind
+// makes, which depends on how the browser responds, can't shift the others.
+static void seed_random(random_t *random, uint64_t seed, int stream) {
+  random->state = seed ^ mix_random_bits((uint64_t)stream + 1);
+}
+
+// Returns a value in [0, limit). The modulo bias is negligible for the small
+// limits used here.
+static int random_below(random_t *random, int limit) {
+  assert(limit > 0);
+  return (int)(next_random(random) % (uint64_t)limit);
+}
+
+// The streams of a run of the test loop. The floor calibration run draws from
+// its own set, after the test's.
+typedef enum {
+  STREAM_KEY_DOWN_JITTER,
+  STREAM_SCROLL_JITTER,
+  STREAM_KEY_IDENTITIES,
+  STREAM_REFERENCE_PATTERN,
+  STREAMS_PER_RUN,
+} random_stream_t;
+
+
+bool parse_seed(const char *encoded_seed, uint64_t *out_seed) {
+  uint64_t seed = 0;
+  if (!*encoded_seed) {
+    return false;
+  }
+  for (const char *c = encoded_seed; *c; c++) {
+    if (*c < '0' || *c > '9') {
+      return false;
+    }
+    uint64_t digit = *c - '0';
+    if (seed > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    seed = seed * 10 + digit;
+  }
+  if (seed == 0) {
+    return false;
+  }
+  *out_seed = seed;
+  return true;
+}
+
+
+// Distinguishes seeds chosen in the same clock tick. Updated with atomic
+// increment instructions.
+static volatile long seeds_chosen = 0;
+
+uint64_t choose_random_seed(void) {
+  uint64_t count = (uint64_t)__sync_fetch_and_add(&seeds_chosen, 1);
+  uint64_t seed = mix_random_bits((uint64_t)get_nanoseconds() ^
+      ((uint64_t)time(NULL) << 32) ^ mix_random_bits(count));
+  return seed ? seed : 1;
+}
+
+
+static void random_pattern(uint64_t seed, int stream, uint8_t pattern[]) {
+  random_t random;
+  seed_random(&random, seed, stream);
+  memset(pattern, 0, pattern_bytes);
+  for (int i = 0; i < pattern_magic_bytes; i++) {
+    pattern[i] = (uint8_t)random_below(&random, 256);
+  }
+}
+
+void random_pattern_from_seed(uint64_t seed, uint8_t pattern[]) {
+  random_pattern(seed, STREAM_REFERENCE_PATTERN, pattern);
+}
+
+
 // This function works something like memmem, except that it expects needle to
 // be 4-byte aligned in haystack (since each pixel is 4 bytes) and it ignores
 // every fourth byte (starting with haystack[3]) because those bytes represent
@@ -169,26 +309,101 @@ static bool find_pattern(const uint8_t magic_pattern[], screenshot *screenshot,
 // the test pattern.
 typedef struct {
   int64_t screenshot_time;
-  uint8_t javascript_frames;
-  uint8_t key_down_events;
-  uint8_t css_frames;
-  uint8_t scroll_position;
+  int javascript_frames;
+  int key_down_events;
+  int css_frames;
+  int scroll_position;
+  int key_identities;  // The page's echo of the most recent key identities.
   test_mode_t test_mode;
+  // The rows of the probe strips found below the pattern, relative to it, and
+  // the JavaScript frame counter each showed.
+  int num_probes;
+  uint32_t probe_rows[max_probe_strips];
+  int probe_javascript_frames[max_probe_strips];
 } measurement_t;
 
+// Returns true if the magic pattern starts at the given pixel.
+static bool magic_pattern_at(const uint8_t magic_pattern[],
+    const uint8_t *pixels) {
+  for (int i = 0; i < pattern_magic_bytes; i++) {
+    if (i % 4 != 3 && pixels[i] != magic_pattern[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Looks for probe strips in the screenshot below the pattern at (x, y), and
+// records the rows they start on in the measurement.
+static void find_probe_strips(const uint8_t magic_pattern[],
+    const screenshot *screenshot, size_t x, size_t y, measurement_t *out) {
+  out->num_probes = 0;
+  if (x + probe_strip_pixels > screenshot->width) {
+    return;
+  }
+  size_t previous_row = y;
+  for (size_t row = y + 1; row < screenshot->height &&
+       out->num_probes < max_probe_strips; row++) {
+    const uint8_t *pixels = screenshot->pixels + row * screenshot->stride +
+        x * 4;
+    // A strip more than one pixel tall is counted once, at its top row.
+    if (magic_pattern_at(magic_pattern, pixels)) {
+      if (row > previous_row + 1) {
+        out->probe_rows[out->num_probes++] = (uint32_t)(row - y);
+      }
+      previous_row = row;
+    }
+  }
+}
+
+// Some values are split between a low byte drawn by the browser's compositor
+// and high bits that come from elsewhere and may be a step early or late
+// relative to the low byte, e.g. because they're drawn by JavaScript a frame
+// after the compositor moved. This combines the two by picking the candidate
+// value consistent with the low byte that is closest to the previous value, or
+// to the middle of the hinted range if there is no previous value.
+static int combine_low_byte_with_hint(int low_byte, int high_hint,
+    int previous) {
+  if (previous < 0) {
+    previous = high_hint * 256 + 128;
+  }
+  int best = low_byte + high_hint * 256;
+  for (int high = high_hint - 1; high <= high_hint + 1; high++) {
+    int candidate = low_byte + high * 256;
+    if (candidate >= 0 && abs(candidate - previous) < abs(best - previous)) {
+      best = candidate;
+    }
+  }
+  return best % pattern_counter_modulus;
+}
+
 // This function takes a small screenshot at the specified position, checks for
 // the magic pattern, and then fills in the measurement struct with data
-// decoded from the pixels of the pattern. Returns true if successful, false
-// if the screenshot failed or the magic pattern was not present.
-static bool read_data_from_screen(uint32_t x, uint32_t y,
-  const uint8_t magic_pattern[], measurement_t *out) {
+// decoded from the pixels of the pattern and of its probe strips, if
+// out->num_probes is not 0, all in the same screenshot. out must either hold
+// the previous measurement read from the same pattern, or be zeroed apart from
+// its probe strips for the first one. Returns true if successful, false if the
+// screenshot failed or the magic pattern was not present.
+static bool read_data_from_screen(platform_context_t *platform, uint32_t x,
+  uint32_t y, const uint8_t magic_pattern[], trace_t *trace,
+  measurement_t *out) {
   assert(out);
-  screenshot *screenshot = take_screenshot(x, y, pattern_pixels, 1);
+  int64_t start_time = get_nanoseconds();
+  uint32_t height = 1;
+  if (out->num_probes > 0) {
+    height = out->probe_rows[out->num_probes - 1] + 1;
+  }
+  screenshot *screenshot = take_screenshot(platform, x, y, pattern_pixels,
+      height);
   if (!screenshot) {
+    trace_instant(trace, TRACE_TRACK_SCREENSHOTS, "screenshot failed",
+        get_nanoseconds(), "");
     return false;
   }
-  if (screenshot->width != pattern_pixels) {
+  if (screenshot->width != pattern_pixels || screenshot->height != height) {
     free_screenshot(screenshot);
+    trace_instant(trace, TRACE_TRACK_SCREENSHOTS, "screenshot failed",
+        get_nanoseconds(), "");
     return false;
   }
   // Check that the magic pattern is there, starting at the first pixel.
@@ -196,15 +411,44 @@ static bool read_data_from_screen(uint32_t x, uint32_t y,
   if (!find_pattern(magic_pattern, screenshot, &found_x, &found_y) ||
     found_x || found_y) {
     free_screenshot(screenshot);
+    trace_instant(trace, TRACE_TRACK_SCREENSHOTS, "pattern not found",
+        get_nanoseconds(), "");
     return false;
   }
-  out->javascript_frames = screenshot->pixels[pattern_magic_pixels * 4 + 0];
-  out->key_down_events = screenshot->pixels[pattern_magic_pixels * 4 + 1];
-  out->test_mode = (test_mode_t) screenshot->pixels[pattern_magic_pixels * 4 + 2];
-  out->scroll_position = screenshot->pixels[(pattern_magic_pixels + 1) * 4];
-  out->css_frames = screenshot->pixels[(pattern_magic_pixels + 2) * 4];
+  const uint8_t *pixels = screenshot->pixels;
+  bool first_measurement = out->screenshot_time == 0;
+  out->javascript_frames = read_pattern_value(pixels, javascript_frames_pixel);
+  out->key_down_events = read_pattern_value(pixels, key_down_events_pixel);
+  out->test_mode = (test_mode_t) pixels[test_mode_pixel * 4];
+  out->key_identities = pixels[test_mode_pixel * 4 + 1];
+  out->scroll_position = combine_low_byte_with_hint(
+      pixels[scroll_position_pixel * 4],
+      read_pattern_value(pixels, scroll_position_high_pixel),
+      first_measurement ? -1 : out->scroll_position);
+  out->css_frames = combine_low_byte_with_hint(
+      pixels[css_frames_pixel * 4],
+      pixels[css_frames_mid_pixel * 4] | pixels[css_frames_high_pixel * 4] << 8,
+      first_measurement ? -1 : out->css_frames);
+  for (int i = 0; i < out->num_probes; i++) {
+    const uint8_t *strip = pixels + out->probe_rows[i] * screenshot->stride;
+    if (!magic_pattern_at(magic_pattern, strip)) {
+      free_screenshot(screenshot);
+      trace_instant(trace, TRACE_TRACK_SCREENSHOTS, "probe strip not found",
+          get_nanoseconds(), "\"strip\": %d", i);
+      return false;
+    }
+    out->probe_javascript_frames[i] =
+        read_pattern_value(strip, javascript_frames_pixel);
+  }
   out->screenshot_time = screenshot->time_nanoseconds;
   free_screenshot(screenshot);
+  trace_complete(trace, TRACE_TRACK_SCREENSHOTS, "screenshot", start_time,
+      get_nanoseconds(), "\"screenshot_time_us\": %.3f, "
+      "\"javascript_frames\": %d, \"key_down_events\": %d, "
+      "\"css_frames\": %d, \"scroll_position\": %d, \"test_mode\": %d, "
+      "\"key_identities\": %d", out->screenshot_time / 1000.0,
+      out->javascript_frames, out->key_down_events, out->css_frames,
+      out->scroll_position, out->test_mode, out->key_identities);
   debug_log("javascript frames: %d, javascript events: %d, scroll position: %d"
       ", css frames: %d, test mode: %d", out->javascript_frames,
       out->key_down_events, out->scroll_position, out->css_frames,
@@ -212,6 +456,73 @@ static bool read_data_from_screen(uint32_t x, uint32_t y,
   return true;
 }
 
+// The bounds of each measurement of a statistic, in milliseconds, kept so the
+// distribution of the measured time can be fitted. Only the first
+// max_censored_samples measurements are kept.
+typedef struct {
+  int count;
+  double lower_ms[max_censored_samples];
+  double upper_ms[max_censored_samples];
+} latency_samples;
+
+// The measurements of a running test, published so that another thread can
+// stream them to a client. The measuring thread writes each sample into a ring
+// and then counts it in published with an atomic increment, which also serves
+// as a barrier between writing a sample and reading it. Readers that fall
+// behind by the size of the ring lose samples.
+enum { max_live_samples = 1024 };
+typedef struct {
+  live_sample_t samples[max_live_samples];
+  int64_t start_time;
+  volatile long published;
+} live_feed;
+
+static void publish_live_sample(live_feed *feed, const char *statistic,
+    int64_t screenshot_time, int64_t lower_bound, int64_t upper_bound) {
+  live_sample_t *sample = &feed->samples[feed->published % max_live_samples];
+  sample->statistic = statistic;
+  sample->time_ms = (screenshot_time - feed->start_time) /
+      (double)nanoseconds_per_millisecond;
+  sample->lower_ms = lower_bound / (double)nanoseconds_per_millisecond;
+  sample->upper_ms = upper_bound / (double)nanoseconds_per_millisecond;
+  __sync_fetch_and_add(&feed->published, 1);
+}
+
+// The intervals between frames of an animation, as seen by screenshots: each
+// observation is the time between two screenshots that saw a statistic change
+// and the number of frames it advanced by. Only the first
+// max_frame_observations are kept.
+enum { max_frame_observations = 8192 };
+typedef struct {
+  // If false, the value isn't a frame counter, and each change is taken to be
+  // one frame.
+  bool counts_frames;
+  int count;
+  int64_t elapsed[max_frame_observations];
+  int frames[max_frame_observations];
+  // The time between the screenshot that saw each change and the one before,
+  // within which the change happened, and the same for the change the
+  // interval started at. That is 0 if the interval started when input was
+  // sent, which is known exactly.
+  int64_t window[max_frame_observations];
+  int64_t previous_window[max_frame_observations];
+} frame_observations;
+
+// A measurement is dropped if the screenshot that saw the response took longer
+// than this and the one before it came too soon after the input to bound it.
+static const int64_t slow_screenshot_ms = 20;
+static const int64_t slow_screenshot_min_lower_bound_ms = 5;
+// Measurements whose bounds are further apart than this are counted as wide.
+static const int64_t wide_bound_threshold_ms = 20;
+// A test's measurements can't be trusted if more than these fractions of them
+// were dropped or had wide bounds.
+static const double max_dropped_sample_fraction = 0.1;
+static const double max_wide_bound_fraction = 0.25;
+// Every this many screenshots, if more than this fraction of the capture
+// intervals were slow, switch to a cheaper screenshot backend.
+static const int quality_check_screenshots = 60;
+static const double max_slow_capture_fraction = 0.25;
+
 // Each value reported in the measurement struct is tracked by a statistic
 // struct that records the length of time between changes.
 typedef struct {
@@ -235,19 +546,37 @@ typedef struct {
   // This records the longest length of time during which the value did not
   // change.
   int64_t max_lower_bound;
+  // The bounds of the most recently recorded measurement.
+  int64_t last_lower_bound;
+  int64_t last_upper_bound;
+  // The screenshot that last saw the value change, and the time since the
+  // screenshot before it. previous_change_time is also set when input is
+  // sent, and then differs from last_change_screenshot_time.
+  int64_t last_change_screenshot_time;
+  int64_t last_change_window;
+  // If not NULL, the bounds of every measurement are also kept here.
+  latency_samples *samples;
+  // If not NULL, every measurement is also published here.
+  live_feed *live;
+  // If not NULL, the time between changes and the size of each change are
+  // also kept here.
+  frame_observations *frame_intervals;
+  // The quality counters that measurements of this statistic update.
+  measurement_quality_t *quality;
   char *name;
 } statistic;
 
 
 // Updates a statistic struct with a new value from a recent measurement.
 static bool update_statistic(statistic *stat, int value, int64_t screenshot_time,
-    int64_t previous_screenshot_time) {
+    int64_t previous_screenshot_time, trace_t *trace) {
   assert(value >= 0 && stat->value >= 0);
   int change = value - stat->value;
   if (change < 0) {
-    // Handle values that wrap at 255.
-    assert(stat->value < 256 && value < 256);
-    change += 256;
+    // Handle values that wrap.
+    assert(stat->value < pattern_counter_modulus &&
+           value < pattern_counter_modulus);
+    change += pattern_counter_modulus;
     assert(change > 0);
   }
   assert(change >= 0);
@@ -256,16 +585,73 @@ static bool update_statistic(statistic *stat, int value, int64_t screenshot_time
   }
   int64_t lower_bound_time = previous_screenshot_time - stat->previous_change_time;
   int64_t screenshot_duration = screenshot_time - previous_screenshot_time;
-  if (lower_bound_time <= 0) {
+  // If input was sent since the previous screenshot, the response came after
+  // the input, so the input bounds it from below. Dropping these responses
+  // would leave out the fastest ones, and more of them the longer the first
+  // screenshot after the input is held back, as by an equivalent-time offset.
+  bool bounded_by_input = lower_bound_time <= 0 &&
+      stat->previous_change_time != stat->last_change_screenshot_time;
+  if (bounded_by_input) {
+    lower_bound_time = 0;
+  }
+  trace_counter(trace, stat->name, screenshot_time, value);
+  trace_complete(trace, TRACE_TRACK_RESPONSES, stat->name,
+      previous_screenshot_time, screenshot_time,
+      "\"change\": %d, \"since_previous_change_ms\": %f", change,
+      (screenshot_time - stat->previous_change_time) /
+          (double)nanoseconds_per_millisecond);
+  // Frame intervals don't need a bound on when the change happened: the time
+  // between the screenshots that saw consecutive changes is on average the
+  // time between the changes.
+  frame_observations *frames = stat->frame_intervals;
+  if (frames && frames->count < max_frame_observations) {
+    frames->elapsed[frames->count] =
+        screenshot_time - stat->previous_change_time;
+    frames->frames[frames->count] = frames->counts_frames ? change : 1;
+    frames->window[frames->count] = screenshot_duration;
+    frames->previous_window[frames->count] =
+        stat->previous_change_time == stat->last_change_screenshot_time ?
+            stat->last_change_window : 0;
+    frames->count++;
+  }
+  stat->last_change_screenshot_time = screenshot_time;
+  stat->last_change_window = screenshot_duration;
+  measurement_quality_t *quality = stat->quality;
+  if (lower_bound_time <= 0 && !bounded_by_input) {
     debug_log("%s: Didn't get a screenshot before response.", stat->name);
-  } else if (screenshot_duration > 20 * nanoseconds_per_millisecond &&
-             lower_bound_time < 5 * nanoseconds_per_millisecond) {
+    quality->samples_dropped_no_prior_screenshot++;
+  } else if (!bounded_by_input &&
+             screenshot_duration >
+                 slow_screenshot_ms * nanoseconds_per_millisecond &&
+             lower_bound_time <
+                 slow_screenshot_min_lower_bound_ms *
+                     nanoseconds_per_millisecond) {
     debug_log("%s: Ignoring measurement due to slow screenshot.", stat->name);
+    quality->samples_dropped_slow_screenshot++;
   } else {
     // Record the measurement.
     stat->measurements++;
-    stat->upper_bound_time += screenshot_time - stat->previous_change_time;
+    stat->last_lower_bound = lower_bound_time;
+    stat->last_upper_bound = screenshot_time - stat->previous_change_time;
+    stat->upper_bound_time += stat->last_upper_bound;
     stat->lower_bound_time += lower_bound_time;
+    quality->samples_recorded++;
+    if (stat->last_upper_bound - lower_bound_time >
+        wide_bound_threshold_ms * nanoseconds_per_millisecond) {
+      quality->wide_bound_samples++;
+    }
+    if (stat->samples && stat->samples->count < max_censored_samples) {
+      latency_samples *samples = stat->samples;
+      samples->lower_ms[samples->count] =
+          lower_bound_time / (double)nanoseconds_per_millisecond;
+      samples->upper_ms[samples->count] =
+          stat->last_upper_bound / (double)nanoseconds_per_millisecond;
+      samples->count++;
+    }
+    if (stat->live) {
+      publish_live_sample(stat->live, stat->name, screenshot_time,
+          lower_bound_time, stat->last_upper_bound);
+    }
     if (lower_bound_time > stat->max_lower_bound) {
       debug_log("%s: updated max_lower_bound to %f", stat->name,
           lower_bound_time / (double)nanoseconds_per_millisecond);
@@ -278,6 +664,17 @@ static bool update_statistic(statistic *stat, int value, int64_t screenshot_time
   return true;
 }
 
+// Copies the bounds of the first samples of a statistic into the results.
+static void report_sample_bounds(const latency_samples *samples,
+                                 latency_sample_bounds_t *out) {
+  out->count = samples->count < max_reported_samples ? samples->count :
+      max_reported_samples;
+  for (int i = 0; i < out->count; i++) {
+    out->lower_ms[i] = samples->lower_ms[i];
+    out->upper_ms[i] = samples->upper_ms[i];
+  }
+}
+
 // Returns the average upper bound time for a statistic, in milliseconds.
 static double upper_bound_ms(statistic *stat) {
   double bound = stat->upper_bound_time / (double) stat->measurements /
@@ -298,241 +695,2216 @@ static double lower_bound_ms(statistic *stat) {
   return bound;
 }
 
+// Counts the refreshes of the given period in which an animation drew none of
+// the given frames, over a span of elapsed_ms in which it drew them.
+static int count_dropped_frames(double elapsed_ms, int frames,
+                                double refresh_period_ms) {
+  int refreshes = (int)(elapsed_ms / refresh_period_ms + 0.5);
+  return refreshes > frames ? refreshes - frames : 0;
+}
+
+// A screenshot sees each change up to one screenshot window after it
+// happened: on average half a window late, and, since screenshots aren't
+// synchronized with the display, uniformly spread over the window. Returns the
+// elapsed time of the given observation with the mean delay of the changes at
+// both of its ends taken out.
+static double corrected_elapsed_ms(const frame_observations *observations,
+                                   int i) {
+  return (observations->elapsed[i] -
+      (observations->window[i] - observations->previous_window[i]) / 2.0) /
+      nanoseconds_per_millisecond;
+}
+
+typedef struct {
+  double interval_ms;
+  int frames;
+} weighted_interval;
+
+static int compare_weighted_intervals(const void *a, const void *b) {
+  const weighted_interval *x = (const weighted_interval *)a;
+  const weighted_interval *y = (const weighted_interval *)b;
+  if (x->interval_ms != y->interval_ms) {
+    return x->interval_ms < y->interval_ms ? -1 : 1;
+  }
+  return 0;
+}
+
+// Returns the median interval of the observed frames, or 0 if there are none
+// or screenshots were too far apart to time single frames. Unlike the mean,
+// it isn't lengthened by an animation missing the odd refresh, so it stands in
+// for the refresh period when counting dropped frames. Screenshots less than
+// a few times as frequent as frames alias intervals towards multiples of the
+// screenshot interval, which drags the median away from the period.
+static double median_frame_interval_ms(
+    const frame_observations *observations) {
+  if (observations->count == 0) {
+    return 0;
+  }
+  weighted_interval *intervals = (weighted_interval *)malloc(
+      observations->count * sizeof(weighted_interval));
+  if (!intervals) {
+    return 0;
+  }
+  int total_frames = 0;
+  int64_t window_sum = 0;
+  for (int i = 0; i < observations->count; i++) {
+    intervals[i].frames = observations->frames[i];
+    intervals[i].interval_ms = corrected_elapsed_ms(observations, i) /
+        observations->frames[i];
+    total_frames += observations->frames[i];
+    window_sum += observations->window[i];
+  }
+  qsort(intervals, observations->count, sizeof(weighted_interval),
+        compare_weighted_intervals);
+  double median_ms = intervals[observations->count - 1].interval_ms;
+  int frames_below = 0;
+  for (int i = 0; i < observations->count; i++) {
+    frames_below += intervals[i].frames;
+    if (2 * frames_below >= total_frames) {
+      median_ms = intervals[i].interval_ms;
+      break;
+    }
+  }
+  free(intervals);
+  double mean_window_ms = window_sum / (double)observations->count /
+      nanoseconds_per_millisecond;
+  return median_ms > 4 * mean_window_ms ? median_ms : 0;
+}
+
+// Summarizes the given frame interval observations.
+//
+// The mean screenshot delay of the changes at each end is taken out of each
+// interval, and the variance their uniform spread adds is taken out of the
+// intervals' variance, so that evenly paced frames have a deviation near 0 at
+// any capture rate. Dropped frames are counted over each run of intervals that
+// follow on from each other, in which the errors in timing the changes cancel
+// out but for the two at its ends. They are counted against the shorter of
+// the given refresh period, if it is known, and the median frame interval, if
+// it could be timed: both are estimated from the animation's own frames, so
+// neither reads short, but the period reads long once the animation misses
+// frames.
+static void summarize_frame_intervals(const frame_observations *observations,
+    int64_t refresh_period, frame_intervals_t *out) {
+  memset(out, 0, sizeof(frame_intervals_t));
+  double refresh_period_ms = refresh_period /
+      (double)nanoseconds_per_millisecond;
+  double median_ms = median_frame_interval_ms(observations);
+  if (median_ms > 0 &&
+      (refresh_period_ms <= 0 || median_ms < refresh_period_ms)) {
+    refresh_period_ms = median_ms;
+  }
+  double sum_ms = 0;
+  double squares_sum_ms = 0;
+  double quantization_variance_sum = 0;
+  double run_elapsed_ms = 0;
+  int run_frames = 0;
+  for (int i = 0; i < observations->count; i++) {
+    int frames = observations->frames[i];
+    double window_ms = observations->window[i] /
+        (double)nanoseconds_per_millisecond;
+    double previous_window_ms = observations->previous_window[i] /
+        (double)nanoseconds_per_millisecond;
+    double elapsed_ms = corrected_elapsed_ms(observations, i);
+    double interval_ms = elapsed_ms / frames;
+    int bin = (int)(interval_ms / frame_histogram_bin_ms);
+    if (bin < 0) {
+      bin = 0;
+    } else if (bin >= frame_histogram_bins) {
+      bin = frame_histogram_bins - 1;
+    }
+    out->histogram[bin] += frames;
+    out->frames += frames;
+    sum_ms += interval_ms * frames;
+    squares_sum_ms += interval_ms * interval_ms * frames;
+    // The variance of the interval is that of a uniform delay over each
+    // window, and that of each of its frames is frames^2 smaller.
+    quantization_variance_sum += (window_ms * window_ms +
+        previous_window_ms * previous_window_ms) / 12 / frames;
+    if (observations->previous_window[i] == 0 && run_frames > 0 &&
+        refresh_period_ms > 0) {
+      out->dropped_frames += count_dropped_frames(run_elapsed_ms, run_frames,
+          refresh_period_ms);
+      run_elapsed_ms = 0;
+      run_frames = 0;
+    }
+    run_elapsed_ms += elapsed_ms;
+    run_frames += frames;
+  }
+  if (run_frames > 0 && refresh_period_ms > 0) {
+    out->dropped_frames += count_dropped_frames(run_elapsed_ms, run_frames,
+        refresh_period_ms);
+  }
+  if (out->frames > 0) {
+    out->mean_interval_ms = sum_ms / out->frames;
+    double quantization_variance = quantization_variance_sum / out->frames;
+    double variance = squares_sum_ms / out->frames -
+        out->mean_interval_ms * out->mean_interval_ms -
+        quantization_variance;
+    out->interval_stddev_ms = variance > 0 ? sqrt(variance) : 0;
+    out->quantization_stddev_ms = sqrt(quantization_variance);
+  }
+}
+
+// Fits the distribution of the given samples (see interval-stats.h) and reports
+// its mean, latency_percentiles and, for the out parameters that aren't NULL,
+// its standard deviation and effective resolution. Returns false if there are
+// no samples.
+static bool fit_latency_distribution(const latency_samples *samples,
+    double *out_mean_ms, double out_percentiles_ms[],
+    double *out_stddev_ms, double *out_resolution_ms) {
+  // Too big for the stack of a server thread.
+  censored_distribution_t *distribution =
+      (censored_distribution_t *)malloc(sizeof(censored_distribution_t));
+  bool fitted = fit_censored_distribution(samples->lower_ms,
+      samples->upper_ms, samples->count, distribution);
+  if (fitted) {
+    *out_mean_ms = censored_distribution_mean(distribution);
+    if (out_stddev_ms) {
+      *out_stddev_ms = sqrt(censored_distribution_variance(distribution));
+    }
+    if (out_resolution_ms) {
+      *out_resolution_ms = censored_distribution_resolution(distribution);
+    }
+    for (int i = 0; i < num_latency_percentiles; i++) {
+      out_percentiles_ms[i] = censored_distribution_quantile(distribution,
+          latency_percentiles[i] / 100.0);
+    }
+    debug_log("fitted %d samples in %d EM iterations", samples->count,
+        distribution->iterations);
+  }
+  free(distribution);
+  return fitted;
+}
+
 // Initializes a statistic struct.
 static void init_statistic(char *name, statistic *stat, int value,
-    int64_t start_time) {
+    int64_t start_time, measurement_quality_t *quality) {
   memset(stat, 0, sizeof(statistic));
   stat->value = value;
   stat->previous_change_time = start_time;
+  stat->quality = quality;
   stat->name = name;
 }
 
 
+// Estimates the display's refresh period and vblank phase from the cadence of
+// the page's frame counters. Like every other value we read from the screen, a
+// frame counter change is only known to have happened sometime between two
+// screenshots, so the narrowest recent such bracket is used as the reference
+// point for the phase.
+typedef struct {
+  int64_t first_change_time;  // Midpoint of the first bracketed frame change.
+  int first_frame;            // Frames counted as of first_change_time.
+  int64_t period;             // The estimated refresh period, 0 until known.
+  int64_t anchor_time;        // Estimated time at which a recent frame appeared.
+  int64_t anchor_width;       // Width of the bracket anchor_time came from.
+} vblank_estimator;
+
+// The estimator needs to watch frames for at least this long before its period
+// estimate is trusted.
+static const int64_t vblank_estimator_warmup_ms = 250;
+// An anchor is replaced by any narrower bracket, or by any bracket at all once
+// it is this old, to bound the phase error from accumulated period error.
+static const int64_t vblank_anchor_max_age_ms = 500;
+
+// Updates the estimator after a frame counter statistic changed. frames is the
+// total number of frames counted so far by the statistic that drives the
+// period estimate, or -1 if the change came from a counter that should only
+// refine the phase.
+static void update_vblank_estimator(vblank_estimator *estimator, int frames,
+    int64_t screenshot_time, int64_t previous_screenshot_time) {
+  int64_t width = screenshot_time - previous_screenshot_time;
+  int64_t midpoint = previous_screenshot_time + width / 2;
+  if (frames >= 0) {
+    if (estimator->first_change_time == 0) {
+      estimator->first_change_time = midpoint;
+      estimator->first_frame = frames;
+    } else if (frames > estimator->first_frame &&
+               midpoint - estimator->first_change_time >
+                   vblank_estimator_warmup_ms * nanoseconds_per_millisecond) {
+      estimator->period = (midpoint - estimator->first_change_time) /
+          (frames - estimator->first_frame);
+    }
+  }
+  if (estimator->anchor_time == 0 || width <= estimator->anchor_width ||
+      midpoint - estimator->anchor_time >
+          vblank_anchor_max_age_ms * nanoseconds_per_millisecond) {
+    estimator->anchor_time = midpoint;
+    estimator->anchor_width = width;
+  }
+}
+
+// Returns the offset of the given time into the refresh interval. Only valid
+// once the estimator's period is known.
+static int64_t vblank_phase(const vblank_estimator *estimator, int64_t time) {
+  assert(estimator->period > 0);
+  int64_t phase = (time - estimator->anchor_time) % estimator->period;
+  if (phase < 0) {
+    phase += estimator->period;
+  }
+  return phase;
+}
+
+// Returns the first time no earlier than the given one at which the refresh
+// interval is at the given phase offset.
+static int64_t next_time_at_vblank_phase(const vblank_estimator *estimator,
+    int64_t earliest, int64_t phase) {
+  int64_t time = earliest - vblank_phase(estimator, earliest) + phase;
+  if (time < earliest) {
+    time += estimator->period;
+  }
+  return time;
+}
+
+void sleep_until(int64_t time) {
+  int64_t remaining = time - get_nanoseconds();
+  if (remaining > nanoseconds_per_millisecond) {
+    usleep((unsigned int)((remaining - nanoseconds_per_millisecond) / 1000));
+  }
+  while (get_nanoseconds() < time);
+}
+
+
+// The input throughput test keeps many key down events in flight at once. They
+// are queued here in the order they were sent, so that each response can be
+// matched to the oldest outstanding event.
+enum { max_outstanding_events = 4096 };
+typedef struct {
+  int64_t send_times[max_outstanding_events];
+  key_identity_t identities[max_outstanding_events];
+  int head;   // Index of the oldest outstanding event.
+  int count;  // Number of outstanding events.
+} event_queue;
+
+static bool push_event(event_queue *queue, int64_t send_time,
+    key_identity_t identity) {
+  if (queue->count == max_outstanding_events) {
+    return false;
+  }
+  int index = (queue->head + queue->count) % max_outstanding_events;
+  queue->send_times[index] = send_time;
+  queue->identities[index] = identity;
+  queue->count++;
+  return true;
+}
+
+static int64_t pop_event(event_queue *queue) {
+  assert(queue->count > 0);
+  int64_t send_time = queue->send_times[queue->head];
+  queue->head = (queue->head + 1) % max_outstanding_events;
+  queue->count--;
+  return send_time;
+}
+
+// Sends a key down event for a key identity drawn from the given generator and
+// records it in the queue. Returns false if sending failed or the queue is
+// full.
+static bool send_identified_keystroke(platform_context_t *platform,
+    random_t *identities, event_queue *queue, int64_t *out_send_time,
+    trace_t *trace, char **error) {
+  key_identity_t identity =
+      (key_identity_t)random_below(identities, num_key_identities);
+  bool sent = false;
+  switch (identity) {
+    case KEY_IDENTITY_Z: sent = send_keystroke_z(platform); break;
+    case KEY_IDENTITY_B: sent = send_keystroke_b(platform); break;
+    case KEY_IDENTITY_T: sent = send_keystroke_t(platform); break;
+    case KEY_IDENTITY_W: sent = send_keystroke_w(platform); break;
+  }
+  if (!sent) {
+    *error = "Failed to send keystroke to test window.";
+    return false;
+  }
+  *out_send_time = get_nanoseconds();
+  trace_instant(trace, TRACE_TRACK_INPUT, "key down", *out_send_time,
+      "\"identity\": %d, \"outstanding\": %d", identity, queue->count + 1);
+  if (!push_event(queue, *out_send_time, identity)) {
+    *error = "Too many key down events outstanding. The browser stopped "
+        "handling input.";
+    return false;
+  }
+  return true;
+}
+
+// Counts of how key down responses were matched to the events that caused
+// them. See latency_results_t.
+typedef struct {
+  int dropped;
+  int coalesced;
+  int unidentified;
+} key_down_tally;
+
+// Returns how many outstanding events, counting from the oldest, the page must
+// have gotten through to produce the given echo of key identities after
+// handling the given number of new events. The most recent events the page
+// handled are assumed not to have been dropped, and the alignment with the
+// fewest dropped events wins. Returns -1 if no alignment matches the echo.
+static int align_key_identity_echo(const event_queue *queue, int handled,
+    int echo) {
+  int checked = handled < echoed_key_identities ?
+      handled : echoed_key_identities;
+  for (int end = handled; end <= queue->count; end++) {
+    bool match = true;
+    for (int i = 0; i < checked && match; i++) {
+      int index = (queue->head + end - 1 - i) % max_outstanding_events;
+      match = ((echo >> (2 * i)) & 3) == (int)queue->identities[index];
+    }
+    if (match) {
+      return end;
+    }
+  }
+  return -1;
+}
+
+// Accumulates the measurements for one rate of the input throughput test.
+typedef struct {
+  int rate;
+  int64_t start_time;        // When we started sending at this rate.
+  int64_t end_time;          // When we stopped, or 0 while still sending.
+  int sent;
+  int received;
+  int received_while_sending;
+  // Sums for the mean latency and the least squares fit of latency (in ms)
+  // against send time (in seconds since start_time).
+  double latency_sum;
+  double time_sum;
+  double time_squared_sum;
+  double time_latency_sum;
+  int64_t outstanding_sum;
+  int outstanding_samples;
+  int max_outstanding;
+} throughput_step;
+
+// Rates swept by the input throughput test when none are specified.
+static const int default_input_rates[] = { 10, 20, 50, 100, 200, 500, 1000 };
+// How long we send events at each rate.
+static const int64_t throughput_step_duration_ms = 2000;
+// The most events we send between two screenshots when we fall behind the
+// schedule, so that we keep watching the screen at high rates.
+static const int max_events_per_screenshot = 16;
+// A step counts as saturated once latency grows by this much per second of
+// sending, which means the browser's input queue is backing up.
+static const double saturation_latency_growth_ms_per_s = 10;
+
+static void init_throughput_step(throughput_step *step, int rate,
+    int64_t start_time) {
+  memset(step, 0, sizeof(throughput_step));
+  step->rate = rate;
+  step->start_time = start_time;
+}
+
+// Records the response to an event sent at send_time, seen in a screenshot
+// taken at screenshot_time but not in the one at previous_screenshot_time.
+static void record_throughput_response(throughput_step *step,
+    int64_t send_time, int64_t screenshot_time,
+    int64_t previous_screenshot_time) {
+  int64_t lower_bound = previous_screenshot_time - send_time;
+  if (lower_bound < 0) {
+    // The event was sent after the previous screenshot was taken.
+    lower_bound = 0;
+  }
+  double latency_ms = (lower_bound + screenshot_time - send_time) / 2.0 /
+      nanoseconds_per_millisecond;
+  double time_s = (send_time - step->start_time) /
+      (double) nanoseconds_per_second;
+  step->received++;
+  if (step->end_time == 0) {
+    step->received_while_sending++;
+  }
+  step->latency_sum += latency_ms;
+  step->time_sum += time_s;
+  step->time_squared_sum += time_s * time_s;
+  step->time_latency_sum += time_s * latency_ms;
+}
+
+// Records the oldest outstanding event in the trace, as a span from when it was
+// sent to the screenshot where its fate was seen.
+static void trace_event_span(trace_t *trace, const event_queue *queue,
+    const char *name, int64_t screenshot_time) {
+  trace_async(trace, name, queue->send_times[queue->head],
+      queue->send_times[queue->head], screenshot_time, "\"identity\": %d",
+      queue->identities[queue->head]);
+}
+
+// Matches key down responses newly counted by the page to the outstanding
+// events that caused them, using the page's echo of the identities of the keys
+// it handled most recently. frames is the number of JavaScript frames drawn
+// since the previous screenshot. Matched events are removed from the queue and
+// recorded in step, if it isn't NULL. Events the page skipped over are removed
+// and counted as dropped. If no alignment of the outstanding events matches the
+// echo, the responses are matched in send order and counted as unidentified.
+// Returns false if more responses were counted than events are outstanding.
+static bool match_key_down_responses(event_queue *queue, int handled,
+    int echo, int frames, int64_t screenshot_time,
+    int64_t previous_screenshot_time, throughput_step *step,
+    key_down_tally *tally, trace_t *trace) {
+  if (handled == 0) {
+    return true;
+  }
+  if (handled > queue->count) {
+    return false;
+  }
+  int end = align_key_identity_echo(queue, handled, echo);
+  if (end < 0) {
+    debug_log("key identity echo %x matches no outstanding events", echo);
+    tally->unidentified += handled;
+    end = handled;
+  }
+  // We can't tell which of the skipped events were dropped, but the oldest
+  // ones are the likeliest.
+  for (int i = handled; i < end; i++) {
+    trace_event_span(trace, queue, "key down dropped", screenshot_time);
+    pop_event(queue);
+    tally->dropped++;
+  }
+  for (int i = 0; i < handled; i++) {
+    trace_event_span(trace, queue, "key down", screenshot_time);
+    int64_t send_time = pop_event(queue);
+    if (step) {
+      record_throughput_response(step, send_time, screenshot_time,
+          previous_screenshot_time);
+    }
+  }
+  // Each frame the page draws can show the result of any number of events, so
+  // when there are more events than frames some of them must have shared one.
+  if (frames < 1) {
+    frames = 1;
+  }
+  if (handled > frames) {
+    tally->coalesced += handled - frames;
+    trace_instant(trace, TRACE_TRACK_RESPONSES, "key downs coalesced",
+        screenshot_time, "\"events\": %d, \"frames\": %d", handled, frames);
+  }
+  return true;
+}
+
+static void finish_throughput_step(const throughput_step *step, int lost,
+    const key_down_tally *tally, throughput_step_results_t *out) {
+  memset(out, 0, sizeof(throughput_step_results_t));
+  double duration_s = (step->end_time - step->start_time) /
+      (double) nanoseconds_per_second;
+  out->target_rate = step->rate;
+  out->events_sent = step->sent;
+  out->events_lost = lost;
+  out->events_dropped = tally->dropped;
+  out->events_coalesced = tally->coalesced;
+  out->max_outstanding = step->max_outstanding;
+  if (duration_s > 0) {
+    out->sent_rate = step->sent / duration_s;
+    out->received_rate = step->received_while_sending / duration_s;
+  }
+  if (step->outstanding_samples > 0) {
+    out->mean_outstanding =
+        step->outstanding_sum / (double) step->outstanding_samples;
+  }
+  int n = step->received;
+  if (n > 0) {
+    out->mean_latency_ms = step->latency_sum / n;
+  }
+  double denominator = n * step->time_squared_sum -
+      step->time_sum * step->time_sum;
+  if (n > 1 && denominator > 0) {
+    out->latency_growth_ms_per_s = (n * step->time_latency_sum -
+        step->time_sum * step->latency_sum) / denominator;
+  }
+}
+
+
+// The test page reports the times at which its key down handler ran over HTTP
+// while a test runs, from a different server thread. Each session has a store
+// claimed by the magic pattern of the test it is running. Times are indexed by
+// the page's key down count modulo the size of the store, and the full count
+// is kept alongside to detect stale entries.
+enum { max_page_handler_times = 1024, page_magic_bytes_capacity = 16 };
+typedef struct {
+  uint8_t magic_pattern[page_magic_bytes_capacity];
+  volatile long active;
+  int64_t times[max_page_handler_times];
+  int key_downs[max_page_handler_times];
+  double clock_sync_uncertainty_ms;
+  // Incremented after each report is stored, which also serves as a barrier
+  // between storing a report and reading it.
+  volatile long reports;
+} page_handler_times_t;
+
+static void begin_page_handler_times(page_handler_times_t *store,
+    const uint8_t magic_pattern[]) {
+  assert(pattern_magic_bytes <= page_magic_bytes_capacity);
+  store->active = 0;
+  memcpy(store->magic_pattern, magic_pattern, pattern_magic_bytes);
+  memset(store->key_downs, -1, sizeof(store->key_downs));
+  store->clock_sync_uncertainty_ms = 0;
+  store->reports = 0;
+  // Publishes the reset store to the threads recording reports.
+  __sync_fetch_and_add(&store->active, 1);
+}
+
+static void end_page_handler_times(page_handler_times_t *store) {
+  __sync_fetch_and_add(&store->active, -1);
+}
+
+// Returns false if the store doesn't belong to a running test with the given
+// magic pattern.
+static bool store_page_handler_times(page_handler_times_t *store,
+    const uint8_t magic_pattern[], int first_key_down, const int64_t times[],
+    int count, double clock_sync_uncertainty_ms) {
+  if (!store->active ||
+      memcmp(magic_pattern, store->magic_pattern, pattern_magic_bytes)) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    // Kept in range even if first_key_down isn't, since it comes from the
+    // page.
+    int key_down = ((first_key_down + i) % pattern_counter_modulus +
+        pattern_counter_modulus) % pattern_counter_modulus;
+    int index = key_down % max_page_handler_times;
+    store->times[index] = times[i];
+    store->key_downs[index] = key_down;
+  }
+  store->clock_sync_uncertainty_ms = clock_sync_uncertainty_ms;
+  __sync_fetch_and_add(&store->reports, 1);
+  return true;
+}
+
+// Looks up the time the page reported its handler ran for the given key down
+// count. Returns false if the page hasn't reported it (yet).
+static bool find_page_handler_time(page_handler_times_t *store, int key_down,
+    int64_t *out_time) {
+  __sync_fetch_and_add(&store->reports, 0);
+  int index = key_down % max_page_handler_times;
+  if (store->key_downs[index] != key_down) {
+    return false;
+  }
+  *out_time = store->times[index];
+  return true;
+}
+
+// A key down latency sample, kept so that it can be split at the time the
+// page's handler ran once the page reports it.
+typedef struct {
+  int64_t send_time;
+  int64_t previous_screenshot_time;  // Before the response was drawn.
+  int64_t screenshot_time;           // After the response was drawn.
+  int key_down;                      // The page's key down count for it.
+} key_down_sample;
+enum { max_key_down_samples = 256 };
+// How long to wait after the test for the page to report the remaining handler
+// times. The page reports them every 250 ms.
+static const int64_t page_handler_times_wait_ms = 600;
+
+// Returns true if the page runs a test with the given magic pattern and hasn't
+// yet reported the handler time of the last of the given samples.
+static bool page_handler_times_pending(page_handler_times_t *store,
+    const uint8_t magic_pattern[], const key_down_sample samples[],
+    int num_samples) {
+  if (num_samples == 0 || store->reports == 0 ||
+      memcmp(magic_pattern, store->magic_pattern, pattern_magic_bytes)) {
+    return false;
+  }
+  int64_t handler_time;
+  return !find_page_handler_time(store, samples[num_samples - 1].key_down,
+      &handler_time);
+}
+
+// Splits the given samples into the time from sending each event to the page's
+// handler running, and from then to the response being drawn, using the
+// handler times the page reported. Samples whose handler time is missing are
+// left out.
+static void split_key_down_latency(page_handler_times_t *store,
+    const uint8_t magic_pattern[], const key_down_sample samples[],
+    int num_samples, latency_results_t *out_results) {
+  if (num_samples == 0 || store->reports == 0 ||
+      memcmp(magic_pattern, store->magic_pattern, pattern_magic_bytes)) {
+    // The test window doesn't report handler times, e.g. the native reference
+    // window.
+    return;
+  }
+  int64_t handler_time;
+  double input_to_handler_sum = 0;
+  double handler_to_pixels_sum = 0;
+  int count = 0;
+  for (int i = 0; i < num_samples; i++) {
+    const key_down_sample *sample = &samples[i];
+    if (!find_page_handler_time(store, sample->key_down, &handler_time)) {
+      continue;
+    }
+    // The response was drawn after both the previous screenshot and the
+    // handler, and before the screenshot that showed it.
+    int64_t drawn_after = sample->previous_screenshot_time > handler_time ?
+        sample->previous_screenshot_time : handler_time;
+    if (drawn_after > sample->screenshot_time) {
+      debug_log("Handler time for key down %d is after it was drawn; the "
+          "page's clock sync is probably off.", sample->key_down);
+      drawn_after = sample->screenshot_time;
+    }
+    input_to_handler_sum += handler_time - sample->send_time;
+    handler_to_pixels_sum +=
+        (drawn_after + sample->screenshot_time) / 2.0 - handler_time;
+    count++;
+  }
+  if (count == 0) {
+    return;
+  }
+  out_results->key_down_handler_samples = count;
+  out_results->key_down_input_to_handler_ms =
+      input_to_handler_sum / count / nanoseconds_per_millisecond;
+  out_results->key_down_handler_to_pixels_ms =
+      handler_to_pixels_sum / count / nanoseconds_per_millisecond;
+  out_results->clock_sync_uncertainty_ms = store->clock_sync_uncertainty_ms;
+}
+
+
 static const int64_t test_timeout_ms = 80000;
 static const int64_t event_response_timeout_ms = 4000;
 static const int latency_measurements_to_take = 50;
+// Equivalent-time sampling needs more samples to fill in the distribution.
+static const int equivalent_time_measurements_to_take = 200;
 
-// Main test function. Locates the given magic pixel pattern on the screen, then
-// runs one full latency test, sending input events and recording responses. On
-// success, the results of the test are reported in the output parameters, and
-// true is returned. If the test fails, the error parameter is filled in with
-// an error message and false is returned.
-bool measure_latency(
-    const uint8_t magic_pattern[],
-    double *out_key_down_latency_ms,
-    double *out_scroll_latency_ms,
-    double *out_max_js_pause_time_ms,
-    double *out_max_css_pause_time_ms,
-    double *out_max_scroll_pause_time_ms,
-    char **error) {
-  screenshot *screenshot = take_screenshot(0, 0, UINT32_MAX, UINT32_MAX);
+// The scroll animation being followed, and the totals of those that settled,
+// for scroll_trajectory_t.
+typedef struct {
+  int64_t send_time;
+  int start_position;
+  int64_t first_movement_time;
+  int64_t first_movement_screenshot_time;
+  int64_t last_movement_time;
+  int frames;
+  int64_t displacement[scroll_profile_bins];
+} scroll_trajectory;
+
+typedef struct {
+  int scrolls;
+  int64_t time_to_first_movement_sum;
+  int64_t animation_duration_sum;
+  int64_t frames_sum;
+  int64_t distance_sum;
+  int64_t displacement_sum[scroll_profile_bins];
+} scroll_trajectory_totals;
+
+// Adds a change in scroll position seen at the given screenshot time to the
+// trajectory.
+static void add_trajectory_point(scroll_trajectory *trajectory,
+    int64_t screenshot_time, int displacement) {
+  int bin = (int)((screenshot_time -
+      trajectory->first_movement_screenshot_time) /
+      nanoseconds_per_millisecond / scroll_profile_bin_ms);
+  if (bin >= scroll_profile_bins) {
+    bin = scroll_profile_bins - 1;
+  }
+  trajectory->displacement[bin] += displacement;
+  trajectory->last_movement_time = screenshot_time;
+  trajectory->frames++;
+}
+
+// Starts a trajectory at the first movement of a scroll from start_position
+// to position, seen by a screenshot at screenshot_time but not by the one at
+// previous_screenshot_time.
+static void start_scroll_trajectory(scroll_trajectory *trajectory,
+    int64_t send_time, int start_position, int64_t previous_screenshot_time,
+    int64_t screenshot_time, int position) {
+  memset(trajectory, 0, sizeof(scroll_trajectory));
+  trajectory->send_time = send_time;
+  trajectory->start_position = start_position;
+  trajectory->first_movement_time =
+      (previous_screenshot_time + screenshot_time) / 2;
+  trajectory->first_movement_screenshot_time = screenshot_time;
+  add_trajectory_point(trajectory, screenshot_time,
+      position - start_position);
+}
+
+// Adds a settled scroll's trajectory, ending at end_position, to the totals.
+static void finish_scroll_trajectory(const scroll_trajectory *trajectory,
+    int end_position, trace_t *trace, scroll_trajectory_totals *totals) {
+  int64_t duration = trajectory->last_movement_time -
+      trajectory->first_movement_screenshot_time;
+  totals->scrolls++;
+  totals->time_to_first_movement_sum +=
+      trajectory->first_movement_time - trajectory->send_time;
+  totals->animation_duration_sum += duration;
+  totals->frames_sum += trajectory->frames;
+  totals->distance_sum += end_position - trajectory->start_position;
+  for (int i = 0; i < scroll_profile_bins; i++) {
+    totals->displacement_sum[i] += trajectory->displacement[i];
+  }
+  trace_complete(trace, TRACE_TRACK_RESPONSES, "scroll animation",
+      trajectory->first_movement_screenshot_time,
+      trajectory->last_movement_time, "\"frames\": %d, \"distance\": %d",
+      trajectory->frames, end_position - trajectory->start_position);
+}
+
+// Reports the mean of the settled scrolls' trajectories.
+static void summarize_scroll_trajectories(
+    const scroll_trajectory_totals *totals, scroll_trajectory_t *out) {
+  memset(out, 0, sizeof(scroll_trajectory_t));
+  out->scrolls = totals->scrolls;
+  if (totals->scrolls == 0) {
+    return;
+  }
+  double scrolls = totals->scrolls;
+  out->time_to_first_movement_ms = totals->time_to_first_movement_sum /
+      scrolls / nanoseconds_per_millisecond;
+  out->animation_duration_ms = totals->animation_duration_sum / scrolls /
+      nanoseconds_per_millisecond;
+  out->frames = totals->frames_sum / scrolls;
+  out->distance_pixels = totals->distance_sum / scrolls;
+  for (int i = 0; i < scroll_profile_bins; i++) {
+    out->velocity_pixels_per_s[i] = totals->displacement_sum[i] / scrolls /
+        (scroll_profile_bin_ms / 1000.0);
+  }
+}
+
+// Probe strips are matched to the pattern over this many recent frames.
+enum { probe_frame_history = 64 };
+
+// Times how far behind the pattern each probe strip shows each frame. Row 0 is
+// the pattern and row i + 1 is probe strip i.
+typedef struct {
+  // The time each row was first seen showing each of the recent frames, by
+  // frame number modulo probe_frame_history. A frame of -1 is empty.
+  int frames[max_probe_strips + 1][probe_frame_history];
+  int64_t times[max_probe_strips + 1][probe_frame_history];
+  int64_t offset_sum[max_probe_strips];
+  int offset_samples[max_probe_strips];
+  int tear_events;
+  int screenshots;
+} probe_tracker;
+
+// Records that the given row was seen showing the given frame at the given
+// time. Once the pattern and a probe strip have both been seen showing the
+// same frame, the difference between when they first did is one sample of the
+// strip's offset. Both are seen by the same screenshots, so the offset is only
+// quantized by the capture interval, not biased by it.
+static void probe_row_shows_frame(probe_tracker *tracker, int num_probes,
+    int row, int frame, int64_t time) {
+  int slot = frame % probe_frame_history;
+  if (tracker->frames[row][slot] == frame) {
+    return;
+  }
+  tracker->frames[row][slot] = frame;
+  tracker->times[row][slot] = time;
+  if (row > 0) {
+    if (tracker->frames[0][slot] == frame) {
+      tracker->offset_sum[row - 1] += time - tracker->times[0][slot];
+      tracker->offset_samples[row - 1]++;
+    }
+    return;
+  }
+  for (int i = 0; i < num_probes; i++) {
+    if (tracker->frames[i + 1][slot] == frame) {
+      tracker->offset_sum[i] += tracker->times[i + 1][slot] - time;
+      tracker->offset_samples[i]++;
+    }
+  }
+}
+
+// Updates the tracker with the rows read from one screenshot. A screenshot in
+// which the rows disagree on the frame caught the window mid-update: a tear.
+static void update_probe_tracker(probe_tracker *tracker,
+    const measurement_t *measurement, trace_t *trace) {
+  if (measurement->num_probes == 0) {
+    return;
+  }
+  int64_t time = measurement->screenshot_time;
+  tracker->screenshots++;
+  probe_row_shows_frame(tracker, measurement->num_probes, 0,
+      measurement->javascript_frames, time);
+  int torn_strips = 0;
+  for (int i = 0; i < measurement->num_probes; i++) {
+    int frame = measurement->probe_javascript_frames[i];
+    probe_row_shows_frame(tracker, measurement->num_probes, i + 1, frame,
+        time);
+    if (frame != measurement->javascript_frames) {
+      torn_strips++;
+    }
+  }
+  if (torn_strips > 0) {
+    tracker->tear_events++;
+    trace_instant(trace, TRACE_TRACK_RESPONSES, "tear", time,
+        "\"frame\": %d, \"torn_strips\": %d",
+        measurement->javascript_frames, torn_strips);
+  }
+}
+
+// Working memory for a latency test that is too big for the stack of a server
+// thread.
+typedef struct {
+  event_queue key_down_queue;  // Outstanding key down events.
+  latency_samples key_down_latency;
+  latency_samples scroll_latency;
+  // In a session, key downs sent while a scroll was outstanding or settling
+  // are kept apart from key_down_latency.
+  latency_samples key_down_during_scroll_latency;
+  // Frame intervals seen during the pause time test.
+  frame_observations javascript_frame_intervals;
+  frame_observations css_frame_intervals;
+  frame_observations scroll_frame_intervals;
+  latency_results_t floor_results;
+  // Shared by the floor calibration and the test that follows it.
+  live_feed live;
+} test_scratch;
+
+// The floor calibration is a short burst of key down events.
+static const int floor_calibration_measurements = 20;
+// How long to wait for the test window to show again after the native
+// reference window closes.
+static const int64_t floor_calibration_reappear_timeout_ms = 2000;
+// How often to look for the test window while waiting for it, and for handler
+// time reports while waiting for them.
+static const int64_t session_poll_interval_ms = 10;
+
+// What a test run does once it's done waiting.
+typedef enum {
+  RESUME_NOTHING,
+  RESUME_SEND_KEY_DOWN,
+  RESUME_SEND_SCROLL,
+} resume_action_t;
+
+// The state of one run of the test loop against one test pattern, kept between
+// steps so that the run can wait for its next input event without holding a
+// thread. Each step takes one screenshot.
+typedef struct {
+  test_options_t options;
+  uint8_t magic_pattern[page_magic_bytes_capacity];
+  latency_results_t *out_results;
+  size_t x, y;
+  measurement_t measurement;
+  measurement_t previous_measurement;
+  int64_t start_time;
+  int screenshots;
+  statistic javascript_frames;
+  statistic css_frames;
+  statistic key_down_events;
+  statistic scroll_stats;
+  // The frame counters aren't latency samples, so the quality counters they
+  // update are kept apart from the results and don't decide whether the
+  // results are acceptable.
+  measurement_quality_t frame_counter_quality;
+  vblank_estimator vblank;
+  // The phase bin of the outstanding key down event, or -1 if it was sent
+  // before the vblank phase was known.
+  int key_down_phase_bin;
+  int64_t key_down_phase_latency[refresh_phase_bins];
+  int key_down_phase_samples[refresh_phase_bins];
+  int sent_events;
+  int key_down_measurements_to_take;
+  // The sum and count of the intervals between screenshots. Intervals in which
+  // a key down event was sent are left out, since they include deliberate
+  // delays.
+  int64_t capture_interval_sum;
+  int capture_intervals;
+  bool delayed_screenshot;
+  // Capture intervals since the screenshot backend was last checked, and how
+  // many of them were slow.
+  int quality_check_intervals;
+  int quality_check_slow_intervals;
+  key_down_sample key_down_samples[max_key_down_samples];
+  int num_key_down_samples;
+  // The number of key down responses matched to events so far.
+  int key_downs_matched;
+  key_down_tally key_down_test_tally;
+  // State for the input throughput test.
+  const int *input_rates;
+  int num_input_rates;
+  bool throughput_started;
+  throughput_step step;
+  key_down_tally step_tally;
+  int64_t last_throughput_response_time;
+  int scroll_x;
+  int scroll_y;
+  int64_t last_scroll_sent;
+  // The run's random choices, seeded from test_options_t.seed.
+  random_t key_down_jitter;
+  random_t scroll_jitter;
+  random_t key_identities;
+  // State for the session test mode. Each kind of probe is sent at a random
+  // time after its previous one finished, or 0 if not yet scheduled.
+  int64_t next_key_down_time;
+  int64_t next_scroll_time;
+  bool scroll_outstanding;
+  // Whether the outstanding key down was sent during a scroll, the key down
+  // measurements taken before it was sent, and the earlier key downs sent
+  // during a scroll that were measured. See
+  // key_downs_measured_during_scroll.
+  bool key_down_sent_during_scroll;
+  int key_down_measurements_at_send;
+  int key_down_during_scroll_measurements;
+  // While a scroll animation finishes, scroll position changes aren't
+  // responses to input. scroll_settle_time is when the position last changed.
+  bool scroll_settling;
+  int64_t scroll_settle_start_time;
+  int64_t scroll_settle_time;
+  // The trajectory of the scroll animation being followed. Its send time and
+  // start position are set before every scroll update, since any update may
+  // start an animation.
+  scroll_trajectory trajectory;
+  scroll_trajectory_totals trajectory_totals;
+  probe_tracker probes;
+  // While waiting, the run takes no screenshots until resume_time, and then
+  // does resume_action. The wait is traced with the given name and args.
+  bool waiting;
+  int64_t resume_time;
+  resume_action_t resume_action;
+  int64_t wait_start_time;
+  const char *wait_name;
+  const char *wait_args;
+  int wait_arg;
+} test_run;
+
+typedef enum {
+  RUN_CONTINUE,
+  RUN_FINISHED,
+  RUN_FAILED,
+} run_status_t;
+
+// Pauses the run until the given time, then does the given action. args is a
+// trace args format string taking at most the one int arg.
+static void wait_until(test_run *run, int64_t wait_start_time,
+    int64_t resume_time, resume_action_t action, const char *name,
+    const char *args, int arg) {
+  run->waiting = true;
+  run->wait_start_time = wait_start_time;
+  run->resume_time = resume_time;
+  run->resume_action = action;
+  run->wait_name = name;
+  run->wait_args = args;
+  run->wait_arg = arg;
+}
+
+// Finds the given magic pattern on the screen and reads the first measurement
+// from it.
+static bool locate_pattern(platform_context_t *platform,
+    const uint8_t magic_pattern[], trace_t *trace, size_t *out_x,
+    size_t *out_y, measurement_t *out_measurement, char **error) {
+  int64_t search_start_time = get_nanoseconds();
+  screenshot *screenshot = take_screenshot(platform, 0, 0, UINT32_MAX,
+      UINT32_MAX);
   if (!screenshot) {
     *error = "Failed to take screenshot.";
     return false;
   }
   assert(screenshot->width > 0 && screenshot->height > 0);
 
-  size_t x, y;
-  bool found_pattern = find_pattern(magic_pattern, screenshot, &x, &y);
+  bool found_pattern = find_pattern(magic_pattern, screenshot, out_x, out_y);
+  memset(out_measurement, 0, sizeof(measurement_t));
+  if (found_pattern) {
+    find_probe_strips(magic_pattern, screenshot, *out_x, *out_y,
+        out_measurement);
+  }
   free_screenshot(screenshot);
+  trace_complete(trace, TRACE_TRACK_SCREENSHOTS, "find pattern",
+      search_start_time, get_nanoseconds(), "\"found\": %s, "
+      "\"probe_strips\": %d", found_pattern ? "true" : "false",
+      out_measurement->num_probes);
   if (!found_pattern) {
     *error = "Failed to find test pattern on screen. Ensure that your browser's zoom level is set to \"100%\", and the top-left corner of the window is visible. If you have multiple displays, try moving the browser window to the main display.";
     return false;
   }
-  uint8_t full_pattern[pattern_bytes];
-  for (int i = 0; i < pattern_magic_bytes; i++) {
-    full_pattern[i] = magic_pattern[i];
-  }
-  measurement_t measurement;
-  measurement_t previous_measurement;
-  memset(&measurement, 0, sizeof(measurement_t));
-  memset(&previous_measurement, 0, sizeof(measurement_t));
-  int screenshots = 0;
-  bool first_screenshot_successful = read_data_from_screen((uint32_t)x,
-      (uint32_t) y, magic_pattern, &measurement);
-  if (!first_screenshot_successful) {
+  if (!read_data_from_screen(platform, (uint32_t)*out_x, (uint32_t)*out_y,
+          magic_pattern, trace, out_measurement)) {
     *error = "Failed to read data from test pattern.";
     return false;
   }
-  if (measurement.test_mode == TEST_MODE_NATIVE_REFERENCE) {
-    uint8_t *test_pattern = (uint8_t *)malloc(pattern_bytes);
-    memset(test_pattern, 0, pattern_bytes);
-    for (int i = 0; i < pattern_magic_bytes; i++) {
-      test_pattern[i] = rand();
-    }
-    if (!open_native_reference_window(test_pattern)) {
-      *error = "Failed to open native reference window.";
+  return true;
+}
+
+// Starts a run against the test pattern at (x, y), from its first measurement.
+// The run draws from the streams of options->seed starting at first_stream.
+static void init_test_run(test_run *run, test_scratch *scratch,
+    platform_context_t *platform, trace_t *trace,
+    const uint8_t magic_pattern[], const test_options_t *options,
+    int first_stream, size_t x, size_t y, const measurement_t *measurement,
+    latency_results_t *out_results) {
+  memset(run, 0, sizeof(test_run));
+  memset(&scratch->key_down_queue, 0, sizeof(event_queue));
+  memset(&scratch->key_down_latency, 0, sizeof(latency_samples));
+  memset(&scratch->scroll_latency, 0, sizeof(latency_samples));
+  memset(&scratch->key_down_during_scroll_latency, 0,
+         sizeof(latency_samples));
+  memset(&scratch->javascript_frame_intervals, 0, sizeof(frame_observations));
+  memset(&scratch->css_frame_intervals, 0, sizeof(frame_observations));
+  memset(&scratch->scroll_frame_intervals, 0, sizeof(frame_observations));
+  scratch->javascript_frame_intervals.counts_frames = true;
+  scratch->css_frame_intervals.counts_frames = true;
+  run->options = *options;
+  memcpy(run->magic_pattern, magic_pattern, pattern_magic_bytes);
+  run->out_results = out_results;
+  run->x = x;
+  run->y = y;
+  run->measurement = *measurement;
+  run->previous_measurement = *measurement;
+  run->start_time = measurement->screenshot_time;
+  measurement_quality_t *quality = &out_results->quality;
+  init_statistic("javascript_frames", &run->javascript_frames,
+      measurement->javascript_frames, run->start_time,
+      &run->frame_counter_quality);
+  init_statistic("key_down_events", &run->key_down_events,
+      measurement->key_down_events, run->start_time, quality);
+  init_statistic("css_frames", &run->css_frames, measurement->css_frames,
+      run->start_time, &run->frame_counter_quality);
+  init_statistic("scroll", &run->scroll_stats, measurement->scroll_position,
+      run->start_time, quality);
+  run->key_down_events.samples = &scratch->key_down_latency;
+  run->scroll_stats.samples = &scratch->scroll_latency;
+  run->javascript_frames.live = &scratch->live;
+  run->key_down_events.live = &scratch->live;
+  run->css_frames.live = &scratch->live;
+  run->scroll_stats.live = &scratch->live;
+  memset(run->probes.frames, 0xff, sizeof(run->probes.frames));
+  run->key_down_phase_bin = -1;
+  run->key_down_measurements_to_take = latency_measurements_to_take;
+  if (options->key_down_measurements > 0) {
+    run->key_down_measurements_to_take = options->key_down_measurements;
+  } else if (options->equivalent_time_phases > 0) {
+    run->key_down_measurements_to_take = equivalent_time_measurements_to_take;
+  }
+  run->delayed_screenshot = true;
+  run->key_downs_matched = run->key_down_events.value_delta;
+  run->input_rates = default_input_rates;
+  run->num_input_rates =
+      sizeof(default_input_rates) / sizeof(default_input_rates[0]);
+  if (options->num_input_rates > 0) {
+    run->input_rates = run->options.input_rates;
+    run->num_input_rates = options->num_input_rates;
+  }
+  seed_random(&run->key_down_jitter, options->seed,
+      first_stream + STREAM_KEY_DOWN_JITTER);
+  seed_random(&run->scroll_jitter, options->seed,
+      first_stream + STREAM_SCROLL_JITTER);
+  seed_random(&run->key_identities, options->seed,
+      first_stream + STREAM_KEY_IDENTITIES);
+  run->scroll_x = x + 40;
+  run->scroll_y = y + 40;
+  run->last_scroll_sent = run->start_time;
+  if (measurement->test_mode == TEST_MODE_SCROLL_LATENCY) {
+    send_scroll_down(platform, run->scroll_x, run->scroll_y);
+    run->scroll_stats.previous_change_time = get_nanoseconds();
+    trace_instant(trace, TRACE_TRACK_INPUT, "scroll",
+        run->scroll_stats.previous_change_time, "");
+  }
+}
+
+// Follows the scroll animation started by a scroll event until the scroll
+// position has held still for 100 ms, when it sets *out_settled. Returns false
+// if the browser keeps scrolling for too long.
+static bool follow_scroll_animation(test_run *run, bool scroll_updated,
+    int64_t screenshot_time, trace_t *trace, bool *out_settled,
+    char **error) {
+  *out_settled = false;
+  if (scroll_updated) {
+    run->scroll_settling = true;
+    run->scroll_settle_start_time = screenshot_time;
+    run->scroll_settle_time = screenshot_time;
+    start_scroll_trajectory(&run->trajectory, run->trajectory.send_time,
+        run->trajectory.start_position,
+        run->previous_measurement.screenshot_time, screenshot_time,
+        run->scroll_stats.value);
+  } else if (run->scroll_settling) {
+    if (screenshot_time - run->scroll_settle_start_time >
+        nanoseconds_per_second) {
+      *error = "Browser kept scrolling for more than 1 second after a "
+          "single scrollwheel event.";
       return false;
     }
-    bool return_value = measure_latency(test_pattern, out_key_down_latency_ms, out_scroll_latency_ms, out_max_js_pause_time_ms, out_max_css_pause_time_ms, out_max_scroll_pause_time_ms, error);
-    if (!close_native_reference_window()) {
-      debug_log("Failed to close native reference window.");
-    };
-    return return_value;
+    if (screenshot_time - run->scroll_settle_time >=
+        100 * nanoseconds_per_millisecond) {
+      run->scroll_settling = false;
+      *out_settled = true;
+      finish_scroll_trajectory(&run->trajectory, run->scroll_stats.value,
+          trace, &run->trajectory_totals);
+      trace_complete(trace, TRACE_TRACK_WAITS, "scroll settle wait",
+          run->scroll_settle_start_time, screenshot_time,
+          "\"scroll_position\": %d", run->scroll_stats.value);
+    }
   }
-  int64_t start_time = measurement.screenshot_time;
-  previous_measurement = measurement;
-  statistic javascript_frames;
-  statistic css_frames;
-  statistic key_down_events;
-  statistic scroll_stats;
-  init_statistic("javascript_frames", &javascript_frames,
-      measurement.javascript_frames, start_time);
-  init_statistic("key_down_events", &key_down_events,
-      measurement.key_down_events, start_time);
-  init_statistic("css_frames", &css_frames, measurement.css_frames, start_time);
-  init_statistic("scroll", &scroll_stats, measurement.scroll_position,
-      start_time);
-  int sent_events = 0;
-  int scroll_x = x + 40;
-  int scroll_y = y + 40;
-  int64_t last_scroll_sent = start_time;
-  if (measurement.test_mode == TEST_MODE_SCROLL_LATENCY) {
-    send_scroll_down(scroll_x, scroll_y);
-    scroll_stats.previous_change_time = get_nanoseconds();
-  }
-  while(true) {
-    bool screenshot_successful = read_data_from_screen((uint32_t)x,
-        (uint32_t) y, magic_pattern, &measurement);
-    if (!screenshot_successful) {
-      *error = "Test window moved during test. The test window must remain "
-          "stationary and focused during the entire test.";
+  return true;
+}
+
+// Does what the run was waiting to do. Returns false on failure.
+static bool resume_test_run(test_run *run, test_scratch *scratch,
+    platform_context_t *platform, trace_t *trace, char **error) {
+  run->waiting = false;
+  trace_complete(trace, TRACE_TRACK_WAITS, run->wait_name,
+      run->wait_start_time, get_nanoseconds(), run->wait_args, run->wait_arg);
+  if (run->resume_action == RESUME_SEND_KEY_DOWN) {
+    if (!send_identified_keystroke(platform, &run->key_identities,
+            &scratch->key_down_queue,
+            &run->key_down_events.previous_change_time, trace, error)) {
       return false;
     }
-    if (measurement.test_mode == TEST_MODE_ABORT) {
-      *error = "Test aborted.";
-      return false;
+    run->delayed_screenshot = true;
+    int64_t send_time = run->key_down_events.previous_change_time;
+    // Bin by the phase the event was actually sent at, which can differ from
+    // the target if we overslept.
+    run->key_down_phase_bin = -1;
+    if (run->vblank.period > 0) {
+      run->key_down_phase_bin = (int)(vblank_phase(&run->vblank, send_time) *
+          refresh_phase_bins / run->vblank.period);
     }
-    screenshots++;
-    int64_t screenshot_time = measurement.screenshot_time;
-    int64_t previous_screenshot_time = previous_measurement.screenshot_time;
-    debug_log("screenshot time %f",
-        (screenshot_time - previous_screenshot_time) /
-            (double)nanoseconds_per_millisecond);
-    update_statistic(&javascript_frames, measurement.javascript_frames,
-        screenshot_time, previous_screenshot_time);
-    update_statistic(&key_down_events, measurement.key_down_events,
+    if (run->options.equivalent_time_phases > 0 &&
+        run->capture_intervals > 0) {
+      // Like an equivalent-time sampling oscilloscope, shift the capture clock
+      // by a different fraction of its period for each event, so that across
+      // many events the screenshots bracket every point in time after the
+      // input.
+      int phase = run->sent_events % run->options.equivalent_time_phases;
+      int64_t offset = run->capture_interval_sum / run->capture_intervals *
+          phase / run->options.equivalent_time_phases;
+      wait_until(run, send_time, send_time + offset, RESUME_NOTHING,
+          "equivalent time offset", "\"phase\": %d", phase);
+    }
+    run->sent_events++;
+  } else if (run->resume_action == RESUME_SEND_SCROLL) {
+    send_scroll_down(platform, run->scroll_x, run->scroll_y);
+    run->scroll_stats.previous_change_time = get_nanoseconds();
+    trace_instant(trace, TRACE_TRACK_INPUT, "scroll",
+        run->scroll_stats.previous_change_time, "");
+  }
+  return true;
+}
+
+// Takes one screenshot of the test pattern, records the responses it shows and
+// sends or schedules the next input events. Does nothing if the run is waiting
+// and its time hasn't come.
+// Returns the key down measurements of a session that were of key downs sent
+// during a scroll. At most one key down is outstanding, so the key down sent
+// last was measured if the measurements grew after it was sent.
+static int key_downs_measured_during_scroll(const test_run *run) {
+  int measured = run->key_down_during_scroll_measurements;
+  if (run->key_down_sent_during_scroll &&
+      run->key_down_events.measurements > run->key_down_measurements_at_send) {
+    measured++;
+  }
+  return measured;
+}
+
+static run_status_t step_test_run(test_run *run, test_scratch *scratch,
+    platform_context_t *platform, trace_t *trace, char **error) {
+  if (run->waiting) {
+    if (get_nanoseconds() < run->resume_time) {
+      return RUN_CONTINUE;
+    }
+    if (!resume_test_run(run, scratch, platform, trace, error)) {
+      return RUN_FAILED;
+    }
+    if (run->waiting) {
+      return RUN_CONTINUE;
+    }
+  }
+  event_queue *key_down_queue = &scratch->key_down_queue;
+  latency_results_t *out_results = run->out_results;
+  measurement_quality_t *quality = &out_results->quality;
+  measurement_t *measurement = &run->measurement;
+  statistic *key_down_events = &run->key_down_events;
+  statistic *scroll_stats = &run->scroll_stats;
+  bool screenshot_successful = read_data_from_screen(platform,
+      (uint32_t)run->x, (uint32_t)run->y, run->magic_pattern, trace,
+      measurement);
+  if (!screenshot_successful) {
+    *error = "Test window moved during test. The test window must remain "
+        "stationary and focused during the entire test.";
+    return RUN_FAILED;
+  }
+  if (measurement->test_mode == TEST_MODE_ABORT) {
+    *error = "Test aborted.";
+    return RUN_FAILED;
+  }
+  run->screenshots++;
+  update_probe_tracker(&run->probes, measurement, trace);
+  int64_t screenshot_time = measurement->screenshot_time;
+  int64_t previous_screenshot_time =
+      run->previous_measurement.screenshot_time;
+  debug_log("screenshot time %f",
+      (screenshot_time - previous_screenshot_time) /
+          (double)nanoseconds_per_millisecond);
+  if (!run->delayed_screenshot) {
+    int64_t capture_interval = screenshot_time - previous_screenshot_time;
+    run->capture_interval_sum += capture_interval;
+    run->capture_intervals++;
+    int bin = (int)(capture_interval / nanoseconds_per_millisecond /
+        capture_histogram_bin_ms);
+    if (bin >= capture_histogram_bins) {
+      bin = capture_histogram_bins - 1;
+    }
+    quality->capture_interval_histogram[bin]++;
+    run->quality_check_intervals++;
+    if (capture_interval > slow_screenshot_ms * nanoseconds_per_millisecond) {
+      run->quality_check_slow_intervals++;
+    }
+  }
+  run->delayed_screenshot = false;
+  if (run->quality_check_intervals >= quality_check_screenshots) {
+    // Screenshots this slow can't bound responses, so rather than finish a
+    // test whose results are mostly noise, try a cheaper way of taking them.
+    if (run->quality_check_slow_intervals >
+            max_slow_capture_fraction * run->quality_check_intervals) {
+      const char *previous_backend = get_screenshot_backend(platform);
+      if (use_cheaper_screenshot_backend(platform)) {
+        debug_log("%d of %d screenshots were slow, switching from %s to %s",
+            run->quality_check_slow_intervals, run->quality_check_intervals,
+            previous_backend, get_screenshot_backend(platform));
+        trace_instant(trace, TRACE_TRACK_SCREENSHOTS,
+            "screenshot backend switched", screenshot_time,
+            "\"from\": \"%s\", \"to\": \"%s\"", previous_backend,
+            get_screenshot_backend(platform));
+        quality->backend_switches++;
+      }
+    }
+    run->quality_check_intervals = 0;
+    run->quality_check_slow_intervals = 0;
+  }
+  // Frame intervals are kept while the page animates continuously for the
+  // pause time test, leaving out the interval that spans the switch into it.
+  bool pause_time = measurement->test_mode == TEST_MODE_PAUSE_TIME &&
+      run->previous_measurement.test_mode == TEST_MODE_PAUSE_TIME;
+  run->javascript_frames.frame_intervals =
+      pause_time ? &scratch->javascript_frame_intervals : NULL;
+  run->css_frames.frame_intervals =
+      pause_time ? &scratch->css_frame_intervals : NULL;
+  scroll_stats->frame_intervals =
+      pause_time ? &scratch->scroll_frame_intervals : NULL;
+  int javascript_frames_seen = run->javascript_frames.value_delta;
+  if (update_statistic(&run->javascript_frames, measurement->javascript_frames,
+      screenshot_time, previous_screenshot_time, trace)) {
+    update_vblank_estimator(&run->vblank, run->javascript_frames.value_delta,
         screenshot_time, previous_screenshot_time);
-    update_statistic(&css_frames, measurement.css_frames, screenshot_time,
+  }
+  int key_down_measurements = key_down_events->measurements;
+  update_statistic(key_down_events, measurement->key_down_events,
+      screenshot_time, previous_screenshot_time, trace);
+  if (key_down_events->measurements > key_down_measurements &&
+      run->key_down_phase_bin >= 0) {
+    run->key_down_phase_latency[run->key_down_phase_bin] +=
+        (key_down_events->last_lower_bound +
+         key_down_events->last_upper_bound) / 2;
+    run->key_down_phase_samples[run->key_down_phase_bin]++;
+  }
+  if (update_statistic(&run->css_frames, measurement->css_frames,
+      screenshot_time, previous_screenshot_time, trace)) {
+    update_vblank_estimator(&run->vblank, -1, screenshot_time,
         previous_screenshot_time);
-    bool scroll_updated = update_statistic(&scroll_stats,
-        measurement.scroll_position, screenshot_time, previous_screenshot_time);
+  }
+  bool scroll_updated = false;
+  if (run->scroll_settling) {
+    if (measurement->scroll_position != scroll_stats->value) {
+      add_trajectory_point(&run->trajectory, screenshot_time,
+          measurement->scroll_position - scroll_stats->value);
+      scroll_stats->value = measurement->scroll_position;
+      run->scroll_settle_time = screenshot_time;
+      trace_counter(trace, scroll_stats->name, screenshot_time,
+          scroll_stats->value);
+    }
+  } else {
+    run->trajectory.send_time = scroll_stats->previous_change_time;
+    run->trajectory.start_position = scroll_stats->value;
+    scroll_updated = update_statistic(scroll_stats,
+        measurement->scroll_position, screenshot_time,
+        previous_screenshot_time, trace);
+  }
+  int new_key_downs = key_down_events->value_delta - run->key_downs_matched;
+  run->key_downs_matched = key_down_events->value_delta;
+  int new_javascript_frames =
+      run->javascript_frames.value_delta - javascript_frames_seen;
 
-    if (measurement.test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
-      if (key_down_events.measurements >= latency_measurements_to_take) {
-        break;
+  if (measurement->test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
+    if (key_down_events->measurements >= run->key_down_measurements_to_take) {
+      return RUN_FINISHED;
+    }
+    // Keep each cleanly measured response, where exactly the one event we
+    // sent was handled, so that its latency can be split later.
+    if (key_down_events->measurements > key_down_measurements &&
+        new_key_downs == 1 && key_down_queue->count == 1 &&
+        run->num_key_down_samples < max_key_down_samples) {
+      key_down_sample *sample =
+          &run->key_down_samples[run->num_key_down_samples++];
+      sample->send_time = key_down_queue->send_times[key_down_queue->head];
+      sample->previous_screenshot_time = previous_screenshot_time;
+      sample->screenshot_time = screenshot_time;
+      sample->key_down = measurement->key_down_events;
+    }
+    if (!match_key_down_responses(key_down_queue, new_key_downs,
+            measurement->key_identities, new_javascript_frames,
+            screenshot_time, previous_screenshot_time, NULL,
+            &run->key_down_test_tally, trace)) {
+      *error = "More events received than sent! This is probably a bug in "
+          "the test.";
+      return RUN_FAILED;
+    }
+    if (screenshot_time - key_down_events->previous_change_time >
+        event_response_timeout_ms * nanoseconds_per_millisecond) {
+      *error = "Browser did not respond to keyboard input. Make sure the "
+          "test page remains focused for the entire test.";
+      return RUN_FAILED;
+    }
+    if (key_down_events->value_delta == run->sent_events) {
+      int64_t wait_start_time = get_nanoseconds();
+      if (run->vblank.period > 0) {
+        // Once we know the refresh cadence, inject each event at the center
+        // of the next phase bin in turn so that latency can be reported as a
+        // function of where in the refresh interval the input landed.
+        int bin = run->sent_events % refresh_phase_bins;
+        int64_t phase = run->vblank.period * (2 * bin + 1) /
+            (2 * refresh_phase_bins);
+        wait_until(run, wait_start_time, next_time_at_vblank_phase(
+                &run->vblank, wait_start_time, phase),
+            RESUME_SEND_KEY_DOWN, "vblank phase wait", "\"bin\": %d", bin);
+      } else {
+        // We want to avoid sending input events at a predictable time
+        // relative to frames, so introduce a random delay of up to 1 frame
+        // (16.67 ms) before sending the next event.
+        wait_until(run, wait_start_time, wait_start_time +
+                random_below(&run->key_down_jitter, 17) *
+                    nanoseconds_per_millisecond,
+            RESUME_SEND_KEY_DOWN, "jitter wait", "", 0);
       }
-      if (key_down_events.value_delta > sent_events) {
+    }
+  } else if (measurement->test_mode == TEST_MODE_SCROLL_LATENCY) {
+    if (scroll_stats->measurements >= latency_measurements_to_take) {
+      return RUN_FINISHED;
+    }
+    if (screenshot_time - scroll_stats->previous_change_time >
+        event_response_timeout_ms * nanoseconds_per_millisecond) {
+      *error = "Browser did not respond to scroll events. Make sure the "
+          "test page remains focused for the entire test.";
+      return RUN_FAILED;
+    }
+    if (scroll_updated) {
+      debug_log("scroll measurements: %d", scroll_stats->measurements);
+    }
+    // We saw the start of a scroll. Wait for the scroll animation to finish
+    // before sending the next one.
+    bool settled;
+    if (!follow_scroll_animation(run, scroll_updated, screenshot_time, trace,
+            &settled, error)) {
+      return RUN_FAILED;
+    }
+    if (settled) {
+      // We want to avoid sending input events at a predictable time relative
+      // to frames, so introduce a random delay of up to 1 frame (16.67 ms)
+      // before sending the next event.
+      int64_t wait_start_time = get_nanoseconds();
+      wait_until(run, wait_start_time, wait_start_time +
+              random_below(&run->scroll_jitter, 17) *
+                  nanoseconds_per_millisecond,
+          RESUME_SEND_SCROLL, "jitter wait", "", 0);
+    }
+  } else if (measurement->test_mode == TEST_MODE_SESSION) {
+    // Key down and scroll probes run side by side instead of one test after
+    // the other, so key down events fill the time spent waiting for scrolls
+    // to settle. To keep the two kinds of measurement independent, neither
+    // is sent while the other is waiting for its response: key downs go out
+    // while idle or while a scroll settles, and scrolls only once the last
+    // key down was answered. Each is sent after a random delay that starts
+    // over whenever the other is sent, and their responses are read from
+    // different counters in the pattern. Key downs sent while a scroll
+    // settles may still be slowed by its animation, so they are kept as a
+    // distribution of their own and don't count towards the key down
+    // measurements to take.
+    bool key_downs_done = key_down_events->measurements -
+        key_downs_measured_during_scroll(run) >=
+            run->key_down_measurements_to_take;
+    bool scrolls_done =
+        scroll_stats->measurements >= latency_measurements_to_take;
+    if (key_downs_done && scrolls_done && !run->scroll_settling) {
+      return RUN_FINISHED;
+    }
+    if (!match_key_down_responses(key_down_queue, new_key_downs,
+            measurement->key_identities, new_javascript_frames,
+            screenshot_time, previous_screenshot_time, NULL,
+            &run->key_down_test_tally, trace)) {
+      *error = "More events received than sent! This is probably a bug in "
+          "the test.";
+      return RUN_FAILED;
+    }
+    if (key_down_events->value_delta != run->sent_events &&
+        screenshot_time - key_down_events->previous_change_time >
+            event_response_timeout_ms * nanoseconds_per_millisecond) {
+      *error = "Browser did not respond to keyboard input. Make sure the "
+          "test page remains focused for the entire test.";
+      return RUN_FAILED;
+    }
+    if (run->scroll_outstanding &&
+        screenshot_time - scroll_stats->previous_change_time >
+            event_response_timeout_ms * nanoseconds_per_millisecond) {
+      *error = "Browser did not respond to scroll events. Make sure the "
+          "test page remains focused for the entire test.";
+      return RUN_FAILED;
+    }
+    // As in the scroll latency test, wait until the scroll position hasn't
+    // changed for 100 ms before sending the next scroll.
+    if (scroll_updated) {
+      run->scroll_outstanding = false;
+    }
+    bool settled;
+    if (!follow_scroll_animation(run, scroll_updated, screenshot_time, trace,
+            &settled, error)) {
+      return RUN_FAILED;
+    }
+    int64_t now = get_nanoseconds();
+    bool key_down_outstanding =
+        key_down_events->value_delta != run->sent_events;
+    if (!key_downs_done && !key_down_outstanding &&
+        !run->scroll_outstanding) {
+      // A random delay of up to 1 frame, as in the key down test.
+      if (run->next_key_down_time == 0) {
+        run->next_key_down_time = now +
+            random_below(&run->key_down_jitter, 17) *
+                nanoseconds_per_millisecond;
+      } else if (now >= run->next_key_down_time) {
+        run->next_key_down_time = 0;
+        run->next_scroll_time = 0;
+        run->key_down_during_scroll_measurements =
+            key_downs_measured_during_scroll(run);
+        run->key_down_sent_during_scroll = run->scroll_settling;
+        run->key_down_measurements_at_send = key_down_events->measurements;
+        key_down_events->samples = run->key_down_sent_during_scroll ?
+            &scratch->key_down_during_scroll_latency :
+            &scratch->key_down_latency;
+        if (!send_identified_keystroke(platform, &run->key_identities,
+                key_down_queue, &key_down_events->previous_change_time, trace,
+                error)) {
+          return RUN_FAILED;
+        }
+        run->sent_events++;
+        key_down_outstanding = true;
+      }
+    }
+    if (!scrolls_done && !key_down_outstanding && !run->scroll_outstanding &&
+        !run->scroll_settling) {
+      if (run->next_scroll_time == 0) {
+        run->next_scroll_time = now +
+            random_below(&run->scroll_jitter, 17) *
+                nanoseconds_per_millisecond;
+      } else if (now >= run->next_scroll_time) {
+        run->next_scroll_time = 0;
+        run->next_key_down_time = 0;
+        send_scroll_down(platform, run->scroll_x, run->scroll_y);
+        scroll_stats->previous_change_time = get_nanoseconds();
+        run->scroll_outstanding = true;
+        trace_instant(trace, TRACE_TRACK_INPUT, "scroll",
+            scroll_stats->previous_change_time, "");
+      }
+    }
+  } else if (measurement->test_mode == TEST_MODE_PAUSE_TIME) {
+    // For the pause time test we want the browser to scroll continuously.
+    // Send a scroll event every frame.
+    if (screenshot_time - run->last_scroll_sent >
+        17 * nanoseconds_per_millisecond) {
+      send_scroll_down(platform, run->scroll_x, run->scroll_y);
+      run->last_scroll_sent = get_nanoseconds();
+      trace_instant(trace, TRACE_TRACK_INPUT, "scroll", run->last_scroll_sent,
+          "");
+    }
+  } else if (measurement->test_mode == TEST_MODE_INPUT_THROUGHPUT) {
+    throughput_step *step = &run->step;
+    if (!run->throughput_started) {
+      run->throughput_started = true;
+      init_throughput_step(step, run->input_rates[0], screenshot_time);
+      memset(&run->step_tally, 0, sizeof(run->step_tally));
+      run->last_throughput_response_time = screenshot_time;
+    }
+    if (new_key_downs > 0) {
+      if (!match_key_down_responses(key_down_queue, new_key_downs,
+              measurement->key_identities, new_javascript_frames,
+              screenshot_time, previous_screenshot_time, step,
+              &run->step_tally, trace)) {
         *error = "More events received than sent! This is probably a bug in "
             "the test.";
-        return false;
+        return RUN_FAILED;
       }
-      if (screenshot_time - key_down_events.previous_change_time >
-          event_response_timeout_ms * nanoseconds_per_millisecond) {
-        *error = "Browser did not respond to keyboard input. Make sure the "
-            "test page remains focused for the entire test.";
-        return false;
+      run->last_throughput_response_time = screenshot_time;
+    }
+    if (step->end_time == 0) {
+      step->outstanding_sum += key_down_queue->count;
+      step->outstanding_samples++;
+      if (key_down_queue->count > step->max_outstanding) {
+        step->max_outstanding = key_down_queue->count;
       }
-      if (key_down_events.value_delta == sent_events) {
-        // We want to avoid sending input events at a predictable time relative
-        // to frames, so introduce a random delay of up to 1 frame (16.67 ms)
-        // before sending the next event.
-        usleep((rand() % 17) * 1000);
-        if (!send_keystroke_z()) {
-          *error = "Failed to send keystroke for \"Z\" key to test window.";
-          return false;
+      // Send every event that is due according to the schedule for this
+      // rate. The schedule is open loop: it doesn't wait for responses.
+      int64_t now = get_nanoseconds();
+      int64_t elapsed = now - step->start_time;
+      if (elapsed >= throughput_step_duration_ms *
+                     nanoseconds_per_millisecond) {
+        step->end_time = now;
+      } else {
+        int due = (int)(elapsed * step->rate / nanoseconds_per_second) + 1;
+        for (int i = 0; step->sent < due && i < max_events_per_screenshot;
+             i++) {
+          int64_t send_time;
+          if (!send_identified_keystroke(platform, &run->key_identities,
+                  key_down_queue, &send_time, trace, error)) {
+            return RUN_FAILED;
+          }
+          step->sent++;
         }
-        key_down_events.previous_change_time = get_nanoseconds();
-        sent_events++;
       }
-    } else if (measurement.test_mode == TEST_MODE_SCROLL_LATENCY) {
-        if (scroll_stats.measurements >= latency_measurements_to_take) {
-          break;
-        }
-        if (screenshot_time - scroll_stats.previous_change_time >
-            event_response_timeout_ms * nanoseconds_per_millisecond) {
-          *error = "Browser did not respond to scroll events. Make sure the "
-              "test page remains focused for the entire test.";
-          return false;
+    } else if (key_down_queue->count == 0 ||
+               screenshot_time - run->last_throughput_response_time >
+                   event_response_timeout_ms * nanoseconds_per_millisecond) {
+      // Everything we sent at this rate has been seen, or the rest is never
+      // coming. Either way move on to the next rate.
+      int lost = key_down_queue->count;
+      key_down_queue->count = 0;
+      int index = out_results->num_throughput_steps++;
+      finish_throughput_step(step, lost, &run->step_tally,
+          &out_results->throughput[index]);
+      trace_complete(trace, TRACE_TRACK_INPUT, "throughput step",
+          step->start_time, screenshot_time, "\"rate\": %d, \"sent\": %d, "
+          "\"lost\": %d", step->rate, step->sent, lost);
+      throughput_step_results_t *finished = &out_results->throughput[index];
+      debug_log("throughput at %d events/s: %f ms mean latency, %f ms/s "
+          "growth, %f mean outstanding, %d lost", finished->target_rate,
+          finished->mean_latency_ms, finished->latency_growth_ms_per_s,
+          finished->mean_outstanding, lost);
+      if (out_results->saturation_rate == 0 && (lost > 0 ||
+          finished->latency_growth_ms_per_s >
+              saturation_latency_growth_ms_per_s)) {
+        out_results->saturation_rate = finished->target_rate;
+      }
+      if (out_results->num_throughput_steps >= run->num_input_rates) {
+        return RUN_FINISHED;
+      }
+      init_throughput_step(step,
+          run->input_rates[out_results->num_throughput_steps],
+          get_nanoseconds());
+      memset(&run->step_tally, 0, sizeof(run->step_tally));
+      run->last_throughput_response_time = step->start_time;
+    }
+  } else if (measurement->test_mode == TEST_MODE_PAUSE_TIME_TEST_FINISHED) {
+    return RUN_FINISHED;
+  } else {
+    *error = "Invalid test type. This is a bug in the test.";
+    return RUN_FAILED;
+  }
+
+  if (screenshot_time - run->start_time >
+      test_timeout_ms * nanoseconds_per_millisecond) {
+    *error = "Timeout.";
+    return RUN_FAILED;
+  }
+  run->previous_measurement = *measurement;
+  return RUN_CONTINUE;
+}
+
+// Fills in the run's results from what it measured. The key down latency split
+// is left to split_key_down_latency, which may need to wait for the page.
+static void finish_test_run(test_run *run, test_scratch *scratch,
+    platform_context_t *platform) {
+  latency_results_t *out_results = run->out_results;
+  measurement_quality_t *quality = &out_results->quality;
+  // The latency we report is the mean of the distribution fitted to the
+  // intervals we measured. Without samples, fall back to the midpoint of the
+  // interval given by the average upper and lower bounds.
+  out_results->key_down_latency_ms = (upper_bound_ms(&run->key_down_events) +
+      lower_bound_ms(&run->key_down_events)) / 2;
+  out_results->scroll_latency_ms = (upper_bound_ms(&run->scroll_stats) +
+      lower_bound_ms(&run->scroll_stats)) / 2;
+  fit_latency_distribution(&scratch->key_down_latency,
+      &out_results->key_down_latency_ms,
+      out_results->key_down_latency_percentiles_ms,
+      &out_results->key_down_latency_stddev_ms,
+      &out_results->key_down_effective_resolution_ms);
+  fit_latency_distribution(&scratch->scroll_latency,
+      &out_results->scroll_latency_ms,
+      out_results->scroll_latency_percentiles_ms, NULL, NULL);
+  int key_downs_during_scroll = key_downs_measured_during_scroll(run);
+  out_results->key_down_samples =
+      run->key_down_events.measurements - key_downs_during_scroll;
+  out_results->key_down_during_scroll_samples = key_downs_during_scroll;
+  fit_latency_distribution(&scratch->key_down_during_scroll_latency,
+      &out_results->key_down_during_scroll_latency_ms,
+      out_results->key_down_during_scroll_latency_percentiles_ms, NULL, NULL);
+  if (out_results->floor_samples > 0) {
+    // The browser's latency adds to the floor, so its mean is shifted by the
+    // floor's mean and its variance is what's left of ours. Percentiles don't
+    // subtract like that, and would need the floor's distribution
+    // deconvolved out of ours, so none are reported above the floor.
+    out_results->key_down_latency_above_floor_ms =
+        out_results->key_down_latency_ms - out_results->floor_latency_ms;
+    double variance = out_results->key_down_latency_stddev_ms *
+        out_results->key_down_latency_stddev_ms -
+        out_results->floor_stddev_ms * out_results->floor_stddev_ms;
+    out_results->key_down_stddev_above_floor_ms =
+        variance > 0 ? sqrt(variance) : 0;
+  }
+  out_results->max_js_pause_time_ms = run->javascript_frames.max_lower_bound /
+      (double) nanoseconds_per_millisecond;
+  out_results->max_css_pause_time_ms =
+      run->css_frames.max_lower_bound / (double) nanoseconds_per_millisecond;
+  out_results->max_scroll_pause_time_ms =
+      run->scroll_stats.max_lower_bound / (double) nanoseconds_per_millisecond;
+  out_results->refresh_period_ms =
+      run->vblank.period / (double) nanoseconds_per_millisecond;
+  out_results->num_probe_strips = run->measurement.num_probes;
+  for (int i = 0; i < run->measurement.num_probes; i++) {
+    out_results->probe_strip_rows[i] = (int)run->measurement.probe_rows[i];
+    out_results->probe_strip_samples[i] = run->probes.offset_samples[i];
+    if (run->probes.offset_samples[i] > 0) {
+      out_results->probe_strip_offset_ms[i] = run->probes.offset_sum[i] /
+          (double)run->probes.offset_samples[i] / nanoseconds_per_millisecond;
+    }
+  }
+  out_results->tear_events = run->probes.tear_events;
+  out_results->probe_screenshots = run->probes.screenshots;
+  summarize_scroll_trajectories(&run->trajectory_totals,
+      &out_results->scroll_trajectory);
+  summarize_frame_intervals(&scratch->javascript_frame_intervals,
+      run->vblank.period, &out_results->js_frame_intervals);
+  summarize_frame_intervals(&scratch->css_frame_intervals,
+      run->vblank.period, &out_results->css_frame_intervals);
+  summarize_frame_intervals(&scratch->scroll_frame_intervals,
+      run->vblank.period, &out_results->scroll_frame_intervals);
+  report_sample_bounds(&scratch->key_down_latency,
+                       &out_results->key_down_sample_bounds);
+  report_sample_bounds(&scratch->scroll_latency,
+                       &out_results->scroll_sample_bounds);
+  if (run->capture_intervals > 0) {
+    out_results->mean_capture_interval_ms = run->capture_interval_sum /
+        (double)run->capture_intervals / nanoseconds_per_millisecond;
+  }
+  quality->screenshot_backend = get_screenshot_backend(platform);
+  int samples_dropped = quality->samples_dropped_slow_screenshot +
+      quality->samples_dropped_no_prior_screenshot;
+  int samples_seen = quality->samples_recorded + samples_dropped;
+  quality->acceptable = quality->samples_recorded > 0 &&
+      samples_dropped <= max_dropped_sample_fraction * samples_seen &&
+      quality->wide_bound_samples <=
+          max_wide_bound_fraction * quality->samples_recorded;
+  out_results->key_down_events_dropped = run->key_down_test_tally.dropped;
+  out_results->key_down_events_coalesced = run->key_down_test_tally.coalesced;
+  out_results->key_down_events_unidentified =
+      run->key_down_test_tally.unidentified;
+  for (int i = 0; i < refresh_phase_bins; i++) {
+    out_results->key_down_samples_by_phase[i] = run->key_down_phase_samples[i];
+    if (run->key_down_phase_samples[i] > 0) {
+      out_results->key_down_latency_by_phase_ms[i] =
+          run->key_down_phase_latency[i] /
+          (double) run->key_down_phase_samples[i] /
+          nanoseconds_per_millisecond;
+    }
+  }
+  debug_log("out_key_down_latency_ms: %f out_scroll_latency_ms: %f "
+      "out_max_js_pause_time_ms: %f out_max_css_pause_time: %f\n "
+      "out_max_scroll_pause_time_ms: %f refresh_period_ms: %f",
+      out_results->key_down_latency_ms,
+      out_results->scroll_latency_ms,
+      out_results->max_js_pause_time_ms,
+      out_results->max_css_pause_time_ms,
+      out_results->max_scroll_pause_time_ms,
+      out_results->refresh_period_ms);
+}
+
+// What a session is doing. A test moves through these in order, skipping the
+// calibration phases unless a floor calibration was requested.
+typedef enum {
+  SESSION_IDLE,
+  // Running the floor calibration against the native reference window.
+  SESSION_CALIBRATING,
+  // Waiting for the test window to show again after calibration.
+  SESSION_WAITING_FOR_PATTERN,
+  SESSION_MEASURING,
+  // Waiting for the page to report the handler times of the last key downs.
+  SESSION_SPLITTING,
+  SESSION_SUCCEEDED,
+  SESSION_FAILED,
+} session_phase_t;
+static const char *session_phase_names[] = {
+  "idle",
+  "calibrating",
+  "waiting for pattern",
+  "measuring",
+  "splitting",
+  "succeeded",
+  "failed",
+};
+
+// Everything one measurement needs, so that sessions on different displays can
+// run at the same time.
+struct latency_session_t {
+  platform_context_t *platform;
+  page_handler_times_t handler_times;
+  test_scratch scratch;
+  test_run run;
+  session_phase_t phase;
+  // When step_latency_tests should next step the session.
+  int64_t next_step_time;
+  // The test as passed to begin_latency_test.
+  uint8_t magic_pattern[page_magic_bytes_capacity];
+  test_options_t options;
+  latency_results_t *out_results;
+  trace_t *trace;
+  char *error;
+  // Where the test pattern and its probe strips were found, to look for them
+  // again after calibration.
+  size_t x, y;
+  int num_probes;
+  uint32_t probe_rows[max_probe_strips];
+  bool native_window_open;
+  // When the current calibration, wait for the pattern or wait for handler
+  // times started.
+  int64_t phase_start_time;
+  // The progress last published for get_latency_progress. progress_sequence
+  // is odd while the progress is being written, and is updated with atomic
+  // increment instructions.
+  latency_progress_t progress;
+  volatile long progress_sequence;
+  // Set by cancel_latency_test, with atomic increment instructions.
+  volatile long cancel_requested;
+};
+
+// The first stream of each run of the test loop. See random_stream_t.
+static const int test_run_streams = 0;
+static const int calibration_run_streams = STREAMS_PER_RUN;
+
+static void close_session_window(latency_session_t *session) {
+  if (!session->native_window_open) {
+    return;
+  }
+  session->native_window_open = false;
+  if (!close_native_reference_window(session->platform)) {
+    debug_log("Failed to close native reference window.");
+  }
+}
+
+// Finds the test pattern and starts the first run of the session's test: the
+// floor calibration if one was requested, otherwise the test itself.
+static bool start_latency_test(latency_session_t *session, char **error) {
+  platform_context_t *platform = session->platform;
+  test_scratch *scratch = &session->scratch;
+  const test_options_t *options = &session->options;
+  size_t x, y;
+  measurement_t measurement;
+  if (!locate_pattern(platform, session->magic_pattern, session->trace, &x,
+          &y, &measurement, error)) {
+    return false;
+  }
+  uint8_t test_pattern[pattern_bytes];
+  if (measurement.test_mode == TEST_MODE_NATIVE_REFERENCE) {
+    random_pattern(options->seed, test_run_streams + STREAM_REFERENCE_PATTERN,
+        test_pattern);
+    if (!open_native_reference_window(platform, test_pattern)) {
+      *error = "Failed to open native reference window.";
+      return false;
+    }
+    session->native_window_open = true;
+    if (!locate_pattern(platform, test_pattern, session->trace, &x, &y,
+            &measurement, error)) {
+      return false;
+    }
+    init_test_run(&session->run, scratch, platform, session->trace,
+        test_pattern, options, test_run_streams, x, y, &measurement,
+        session->out_results);
+    session->phase = SESSION_MEASURING;
+    return true;
+  }
+  session->x = x;
+  session->y = y;
+  session->num_probes = measurement.num_probes;
+  memcpy(session->probe_rows, measurement.probe_rows,
+      sizeof(session->probe_rows));
+  if (options->calibrate_floor &&
+      (measurement.test_mode == TEST_MODE_JAVASCRIPT_LATENCY ||
+       measurement.test_mode == TEST_MODE_SESSION)) {
+    // Run a short key down test against the native reference window, which
+    // responds as fast as this machine can draw, and record its latency as the
+    // floor.
+    random_pattern(options->seed,
+        calibration_run_streams + STREAM_REFERENCE_PATTERN, test_pattern);
+    if (!open_native_reference_window(platform, test_pattern)) {
+      *error = "Failed to open native reference window for calibration.";
+      return false;
+    }
+    session->native_window_open = true;
+    session->phase_start_time = get_nanoseconds();
+    test_options_t calibration_options = *options;
+    calibration_options.calibrate_floor = false;
+    calibration_options.equivalent_time_phases = 0;
+    calibration_options.key_down_measurements = floor_calibration_measurements;
+    memset(&scratch->floor_results, 0, sizeof(latency_results_t));
+    if (!locate_pattern(platform, test_pattern, session->trace, &x, &y,
+            &measurement, error)) {
+      return false;
+    }
+    init_test_run(&session->run, scratch, platform, session->trace,
+        test_pattern, &calibration_options, calibration_run_streams, x, y,
+        &measurement, &scratch->floor_results);
+    session->phase = SESSION_CALIBRATING;
+    return true;
+  }
+  init_test_run(&session->run, scratch, platform, session->trace,
+      session->magic_pattern, options, test_run_streams, x, y, &measurement,
+      session->out_results);
+  session->phase = SESSION_MEASURING;
+  return true;
+}
+
+// Ends the session's test, releasing what it held.
+static void end_latency_test(latency_session_t *session, bool succeeded,
+    char *error) {
+  close_session_window(session);
+  end_page_handler_times(&session->handler_times);
+  trace_close(session->trace);
+  session->trace = NULL;
+  session->error = error;
+  session->phase = succeeded ? SESSION_SUCCEEDED : SESSION_FAILED;
+}
+
+// Publishes the progress of the session's test for get_latency_progress.
+static void publish_progress(latency_session_t *session) {
+  const test_run *run = &session->run;
+  latency_progress_t *progress = &session->progress;
+  __sync_fetch_and_add(&session->progress_sequence, 1);
+  progress->phase = session_phase_names[session->phase];
+  progress->test_mode = run->measurement.test_mode;
+  progress->elapsed_ms =
+      (get_nanoseconds() - session->scratch.live.start_time) /
+          (double)nanoseconds_per_millisecond;
+  progress->screenshots = run->screenshots;
+  progress->key_down_measurements = run->key_down_events.measurements -
+      key_downs_measured_during_scroll(run);
+  progress->key_down_measurements_target = run->key_down_measurements_to_take;
+  progress->scroll_measurements = run->scroll_stats.measurements;
+  if (run->out_results) {
+    progress->quality = run->out_results->quality;
+  }
+  __sync_fetch_and_add(&session->progress_sequence, 1);
+}
+
+// Advances the session's test as far as it can go without waiting, and sets
+// next_step_time to when it can go further.
+static void step_latency_test(latency_session_t *session) {
+  platform_context_t *platform = session->platform;
+  test_scratch *scratch = &session->scratch;
+  test_run *run = &session->run;
+  char *error = "Unknown error.";
+  int64_t now = get_nanoseconds();
+  session->next_step_time = now;
+  if (__sync_fetch_and_add(&session->cancel_requested, 0)) {
+    end_latency_test(session, false, "The test was cancelled.");
+  }
+  switch (session->phase) {
+    case SESSION_CALIBRATING:
+    case SESSION_MEASURING: {
+      run_status_t status = step_test_run(run, scratch, platform,
+          session->trace, &error);
+      if (status == RUN_FAILED) {
+        if (session->phase == SESSION_CALIBRATING) {
+          trace_complete(session->trace, TRACE_TRACK_WAITS,
+              "floor calibration", session->phase_start_time,
+              get_nanoseconds(), "\"floor_ms\": %f",
+              scratch->floor_results.key_down_latency_ms);
         }
-        if (scroll_updated) {
-          debug_log("scroll measurements: %d", scroll_stats.measurements);
-          // We saw the start of a scroll. Wait for the scroll animation to
-          // finish before continuing. We assume the animation is finished if
-          // it's been 100 milliseconds since we last saw the scroll position
-          // change.
-          int64_t scroll_update_time = screenshot_time;
-          int64_t scroll_wait_start_time = screenshot_time;
-          while (screenshot_time - scroll_update_time <
-                 100 * nanoseconds_per_millisecond) {
-            screenshot_successful = read_data_from_screen((uint32_t)x,
-                (uint32_t) y, magic_pattern, &measurement);
-            if (!screenshot_successful) {
-              *error = "Test window moved during test. The test window must "
-                  "remain stationary and focused during the entire test.";
-              return false;
-            }
-            screenshot_time = measurement.screenshot_time;
-            if (screenshot_time - scroll_wait_start_time >
-                nanoseconds_per_second) {
-              *error = "Browser kept scrolling for more than 1 second after a "
-                  "single scrollwheel event.";
-              return false;
-            }
-            if (measurement.scroll_position != scroll_stats.value) {
-              scroll_stats.value = measurement.scroll_position;
-              scroll_update_time = screenshot_time;
-            }
-          }
-          // We want to avoid sending input events at a predictable time
-          // relative to frames, so introduce a random delay of up to 1 frame
-          // (16.67 ms) before sending the next event.
-          usleep((rand() % 17) * 1000);
-          send_scroll_down(scroll_x, scroll_y);
-          scroll_stats.previous_change_time = get_nanoseconds();
+        end_latency_test(session, false, error);
+      } else if (status == RUN_CONTINUE) {
+        if (run->waiting) {
+          session->next_step_time = run->resume_time;
         }
-    } else if (measurement.test_mode == TEST_MODE_PAUSE_TIME) {
-      // For the pause time test we want the browser to scroll continuously.
-      // Send a scroll event every frame.
-      if (screenshot_time - last_scroll_sent >
-          17 * nanoseconds_per_millisecond) {
-        send_scroll_down(scroll_x, scroll_y);
-        last_scroll_sent = get_nanoseconds();
+      } else if (session->phase == SESSION_CALIBRATING) {
+        finish_test_run(run, scratch, platform);
+        close_session_window(session);
+        latency_results_t *floor = &scratch->floor_results;
+        latency_results_t *out_results = session->out_results;
+        trace_complete(session->trace, TRACE_TRACK_WAITS, "floor calibration",
+            session->phase_start_time, get_nanoseconds(),
+            "\"floor_ms\": %f", floor->key_down_latency_ms);
+        out_results->floor_latency_ms = floor->key_down_latency_ms;
+        out_results->floor_stddev_ms = floor->key_down_latency_stddev_ms;
+        out_results->floor_samples = floor->key_down_samples;
+        debug_log("latency floor: %f ms, standard deviation %f ms, %d samples",
+            out_results->floor_latency_ms, out_results->floor_stddev_ms,
+            out_results->floor_samples);
+        // Start over from the first screenshot of the test window once the
+        // native reference window is gone.
+        session->phase = SESSION_WAITING_FOR_PATTERN;
+        session->phase_start_time = get_nanoseconds();
+      } else {
+        finish_test_run(run, scratch, platform);
+        session->phase = SESSION_SPLITTING;
+        session->phase_start_time = get_nanoseconds();
+      }
+      break;
+    }
+    case SESSION_WAITING_FOR_PATTERN: {
+      measurement_t measurement;
+      memset(&measurement, 0, sizeof(measurement_t));
+      measurement.num_probes = session->num_probes;
+      memcpy(measurement.probe_rows, session->probe_rows,
+          sizeof(measurement.probe_rows));
+      if (read_data_from_screen(platform, (uint32_t)session->x,
+              (uint32_t)session->y, session->magic_pattern, session->trace,
+              &measurement)) {
+        init_test_run(run, scratch, platform, session->trace,
+            session->magic_pattern, &session->options, test_run_streams,
+            session->x, session->y, &measurement, session->out_results);
+        session->phase = SESSION_MEASURING;
+      } else if (now - session->phase_start_time >
+                 floor_calibration_reappear_timeout_ms *
+                     nanoseconds_per_millisecond) {
+        end_latency_test(session, false, "Test window was hidden after "
+            "calibration. The test window must remain stationary and "
+            "focused during the entire test.");
+      } else {
+        session->next_step_time =
+            now + session_poll_interval_ms * nanoseconds_per_millisecond;
       }
-    } else if (measurement.test_mode == TEST_MODE_PAUSE_TIME_TEST_FINISHED) {
       break;
-    } else {
-      *error = "Invalid test type. This is a bug in the test.";
-      return false;
     }
+    case SESSION_SPLITTING:
+      if (page_handler_times_pending(&session->handler_times,
+              run->magic_pattern, run->key_down_samples,
+              run->num_key_down_samples) &&
+          now - session->phase_start_time <
+              page_handler_times_wait_ms * nanoseconds_per_millisecond) {
+        session->next_step_time =
+            now + session_poll_interval_ms * nanoseconds_per_millisecond;
+        break;
+      }
+      split_key_down_latency(&session->handler_times, run->magic_pattern,
+          run->key_down_samples, run->num_key_down_samples,
+          session->out_results);
+      end_latency_test(session, true, NULL);
+      break;
+    default:
+      break;
+  }
+  publish_progress(session);
+}
+
+bool latency_test_running(latency_session_t *session) {
+  return session->phase != SESSION_IDLE &&
+      session->phase != SESSION_SUCCEEDED &&
+      session->phase != SESSION_FAILED;
+}
+
+
+static const int clock_benchmark_reads = 1000000;
+
+void benchmark_clock(clock_benchmark_results_t *out_results) {
+  memset(out_results, 0, sizeof(clock_benchmark_results_t));
+  out_results->source = get_clock_source();
+  out_results->reads = clock_benchmark_reads;
+  out_results->resolution_ns = INT64_MAX;
+  int64_t start_time = get_nanoseconds();
+  int64_t previous_time = start_time;
+  for (int i = 0; i < clock_benchmark_reads; i++) {
+    int64_t time = get_nanoseconds();
+    int64_t step = time - previous_time;
+    if (step < 0) {
+      out_results->backward_steps++;
+    } else if (step > 0 && step < out_results->resolution_ns) {
+      out_results->resolution_ns = step;
+    }
+    if (step > out_results->max_step_ns) {
+      out_results->max_step_ns = step;
+    }
+    previous_time = time;
+  }
+  out_results->read_overhead_ns =
+      (previous_time - start_time) / (double)clock_benchmark_reads;
+  if (out_results->resolution_ns == INT64_MAX) {
+    // The clock never advanced.
+    out_results->resolution_ns = 0;
+  }
+}
 
-    if (screenshot_time - start_time >
-        test_timeout_ms * nanoseconds_per_millisecond) {
-      *error = "Timeout.";
+void format_clock_benchmark(const clock_benchmark_results_t *results,
+                            char *buffer, size_t size) {
+  snprintf(buffer, size,
+           "Clock source: %s\n"
+           "Read overhead: %.1f ns (mean of %d reads)\n"
+           "Resolution: %lld ns or better\n"
+           "Largest step between reads: %lld ns\n"
+           "Backward steps: %d\n",
+           results->source, results->read_overhead_ns, results->reads,
+           (long long)results->resolution_ns, (long long)results->max_step_ns,
+           results->backward_steps);
+  buffer[size - 1] = '\0';
+}
+
+
+bool begin_latency_test(
+    latency_session_t *session,
+    const uint8_t magic_pattern[],
+    const test_options_t *options,
+    latency_results_t *out_results,
+    char **error) {
+  if (latency_test_running(session)) {
+    *error = "A test is already running in this session.";
+    return false;
+  }
+  trace_t *trace = NULL;
+  if (options->trace_path) {
+    trace = trace_open(options->trace_path);
+    if (!trace) {
+      *error = "Failed to open trace file.";
       return false;
     }
-    previous_measurement = measurement;
-    usleep(0);
   }
-  // The latency we report is the midpoint of the interval given by the average
-  // upper and lower bounds we've computed.
-  *out_key_down_latency_ms =
-      (upper_bound_ms(&key_down_events) + lower_bound_ms(&key_down_events)) / 2;
-  *out_scroll_latency_ms =
-      (upper_bound_ms(&scroll_stats) + lower_bound_ms(&scroll_stats) / 2);
-  *out_max_js_pause_time_ms =
-      javascript_frames.max_lower_bound / (double) nanoseconds_per_millisecond;
-  *out_max_css_pause_time_ms =
-      css_frames.max_lower_bound / (double) nanoseconds_per_millisecond;
-  *out_max_scroll_pause_time_ms =
-      scroll_stats.max_lower_bound / (double) nanoseconds_per_millisecond;
-  debug_log("out_key_down_latency_ms: %f out_scroll_latency_ms: %f "
-      "out_max_js_pause_time_ms: %f out_max_css_pause_time: %f\n "
-      "out_max_scroll_pause_time_ms: %f",
-      *out_key_down_latency_ms,
-      *out_scroll_latency_ms,
-      *out_max_js_pause_time_ms,
-      *out_max_css_pause_time_ms,
-      *out_max_scroll_pause_time_ms);
+  memset(out_results, 0, sizeof(latency_results_t));
+  memcpy(session->magic_pattern, magic_pattern, pattern_magic_bytes);
+  session->options = *options;
+  if (session->options.seed == 0) {
+    session->options.seed = choose_random_seed();
+  }
+  out_results->seed = session->options.seed;
+  debug_log("test seed: %llu", (unsigned long long)out_results->seed);
+  session->out_results = out_results;
+  session->trace = trace;
+  session->error = NULL;
+  session->native_window_open = false;
+  session->cancel_requested = 0;
+  session->scratch.live.start_time = get_nanoseconds();
+  session->scratch.live.published = 0;
+  begin_page_handler_times(&session->handler_times, magic_pattern);
+  if (!start_latency_test(session, error)) {
+    end_latency_test(session, false, *error);
+    return false;
+  }
+  publish_progress(session);
+  session->next_step_time = get_nanoseconds();
   return true;
 }
+
+int64_t step_latency_tests(latency_session_t *sessions[], int num_sessions) {
+  int64_t next_step_time = 0;
+  for (int i = 0; i < num_sessions; i++) {
+    latency_session_t *session = sessions[i];
+    if (!latency_test_running(session)) {
+      continue;
+    }
+    if (get_nanoseconds() >= session->next_step_time) {
+      step_latency_test(session);
+      if (!latency_test_running(session)) {
+        continue;
+      }
+    }
+    if (next_step_time == 0 || session->next_step_time < next_step_time) {
+      next_step_time = session->next_step_time;
+    }
+  }
+  return next_step_time;
+}
+
+void run_latency_tests(latency_session_t *sessions[], int num_sessions) {
+  while (true) {
+    int64_t next_step_time = step_latency_tests(sessions, num_sessions);
+    if (next_step_time == 0) {
+      return;
+    }
+    if (next_step_time > get_nanoseconds()) {
+      sleep_until(next_step_time);
+    } else {
+      usleep(0);
+    }
+  }
+}
+
+bool latency_test_succeeded(latency_session_t *session, char **error) {
+  if (session->phase == SESSION_SUCCEEDED) {
+    return true;
+  }
+  *error = session->error ? session->error : "The test did not finish.";
+  return false;
+}
+
+void get_latency_progress(latency_session_t *session,
+    latency_progress_t *out_progress) {
+  while (true) {
+    long sequence = __sync_fetch_and_add(&session->progress_sequence, 0);
+    if (sequence % 2 == 0) {
+      *out_progress = session->progress;
+      if (__sync_fetch_and_add(&session->progress_sequence, 0) == sequence) {
+        return;
+      }
+    }
+    usleep(0);
+  }
+}
+
+int read_live_samples(latency_session_t *session, long *cursor,
+    live_sample_t out_samples[], int max_samples, int *out_missed) {
+  live_feed *feed = &session->scratch.live;
+  // The slot after the newest sample may be being overwritten, so only the
+  // rest of the ring can be read.
+  const long readable = max_live_samples - 1;
+  long published = __sync_fetch_and_add(&feed->published, 0);
+  *out_missed = 0;
+  if (published - *cursor > readable) {
+    *out_missed = (int)(published - readable - *cursor);
+    *cursor = published - readable;
+  }
+  int count = 0;
+  while (count < max_samples && *cursor + count < published) {
+    out_samples[count] = feed->samples[(*cursor + count) % max_live_samples];
+    count++;
+  }
+  // Drop the samples that were overwritten while they were copied.
+  published = __sync_fetch_and_add(&feed->published, 0);
+  long overwritten = published - readable - *cursor;
+  if (overwritten > count) {
+    overwritten = count;
+  }
+  *cursor += count;
+  if (overwritten > 0) {
+    count -= (int)overwritten;
+    *out_missed += (int)overwritten;
+    memmove(out_samples, out_samples + overwritten,
+        count * sizeof(live_sample_t));
+  }
+  return count;
+}
+
+void cancel_latency_test(latency_session_t *session) {
+  __sync_fetch_and_add(&session->cancel_requested, 1);
+}
+
+bool measure_latency(
+    latency_session_t *session,
+    const uint8_t magic_pattern[],
+    const test_options_t *options,
+    latency_results_t *out_results,
+    char **error) {
+  if (!begin_latency_test(session, magic_pattern, options, out_results,
+          error)) {
+    return false;
+  }
+  run_latency_tests(&session, 1);
+  return latency_test_succeeded(session, error);
+}
+
+latency_session_t *create_latency_session(const char *display_name) {
+  platform_context_t *platform = create_platform_context(display_name);
+  if (!platform) {
+    return NULL;
+  }
+  // The session holds the test's working memory, which is too big for the
+  // stack of a server thread.
+  latency_session_t *session =
+      (latency_session_t *)malloc(sizeof(latency_session_t));
+  if (!session) {
+    destroy_platform_context(platform);
+    return NULL;
+  }
+  memset(session, 0, sizeof(latency_session_t));
+  session->platform = platform;
+  return session;
+}
+
+void destroy_latency_session(latency_session_t *session) {
+  if (!session) {
+    return;
+  }
+  destroy_platform_context(session->platform);
+  free(session);
+}
+
+platform_context_t *get_session_platform(latency_session_t *session) {
+  return session->platform;
+}
+
+bool record_page_handler_times(latency_session_t *session,
+    const uint8_t magic_pattern[], int first_key_down, const int64_t times[],
+    int count, double clock_sync_uncertainty_ms) {
+  return store_page_handler_times(&session->handler_times, magic_pattern,
+      first_key_down, times, count, clock_sync_uncertainty_ms);
+}
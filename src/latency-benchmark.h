@@ -26,6 +26,7 @@
 #else
 #include <GL/gl.h>
 #endif
+#include <stddef.h>
 
 // The test mode is communicated from the test page to the server as one of the
 // pixel values in the test pattern.
@@ -36,26 +37,430 @@ typedef enum {
   TEST_MODE_PAUSE_TIME_TEST_FINISHED = 4,
   TEST_MODE_NATIVE_REFERENCE = 5,
   TEST_MODE_ABORT = 6,
+  TEST_MODE_INPUT_THROUGHPUT = 7,
+  // Measures key down latency, scroll latency and pause times in one run, with
+  // key down events sent while scrolls settle.
+  TEST_MODE_SESSION = 8,
 } test_mode_t;
 
+// Key down events are sent as a random sequence of these keys. The test window
+// echoes the identities of the most recent keys it handled into the pattern,
+// so that each response can be matched to the exact event that caused it.
+typedef enum {
+  KEY_IDENTITY_Z = 0,
+  KEY_IDENTITY_B = 1,
+  KEY_IDENTITY_T = 2,
+  KEY_IDENTITY_W = 3,
+} key_identity_t;
+enum { num_key_identities = 4, echoed_key_identities = 4 };
+
+// Returns the echo of key identities updated for a newly handled key.
+int push_key_identity(int identities, key_identity_t identity);
+
+// The number of equal-width bins the display refresh interval is divided into
+// when reporting key down latency as a function of where in the refresh
+// interval the input event was injected.
+enum { refresh_phase_bins = 8 };
+
+// The percentiles of the key down and scroll latency distributions reported
+// in latency_results_t.
+enum { num_latency_percentiles = 3 };
+static const int latency_percentiles[num_latency_percentiles] = { 50, 90, 99 };
+
+// The maximum number of probe strips read below the test pattern. See
+// probe_strip_pixels in screenscraper.h.
+enum { max_probe_strips = 8 };
+
+// The maximum number of key down rates swept by one input throughput test.
+enum { max_input_rates = 16 };
+
+// Options controlling how a latency test is run. A zero-initialized struct
+// selects the defaults.
+typedef struct {
+  // Key down rates, in events per second, swept by the input throughput test.
+  // If num_input_rates is 0, a default sweep from 10 to 1000 is used.
+  int input_rates[max_input_rates];
+  int num_input_rates;
+  // If not 0, the key down test uses equivalent-time sampling: after sending
+  // each event, the next screenshot is delayed by an offset that cycles
+  // through this many equally spaced fractions of the capture interval. The
+  // bounds of the samples are then staggered relative to the input, which lets
+  // the latency distribution be resolved much more finely than one capture
+  // interval. More samples are taken in this mode.
+  int equivalent_time_phases;
+  // If not 0, overrides the number of key down measurements taken.
+  int key_down_measurements;
+  // If true, a key down test first runs a short key down test against the
+  // native reference window to measure the latency added by the benchmark and
+  // the display themselves, and reports the mean and standard deviation of key
+  // down latency both with and without it. Off by default, since it adds a
+  // test against a separate window to every key down test.
+  bool calibrate_floor;
+  // If not 0, seeds every random choice the test makes: the jitter before each
+  // input event, the key sent for each key down and the native reference
+  // window's pattern. Tests with the same seed send the same schedule of input
+  // events, so browsers can be compared on identical timing. If 0, a seed is
+  // chosen from the clock. Either way the seed is reported in the results.
+  uint64_t seed;
+  // If not NULL, a timeline of the test is written to this file in the Trace
+  // Event Format, for loading in chrome://tracing or Perfetto.
+  const char *trace_path;
+} test_options_t;
+
+// The results of the input throughput test at one key down rate.
+typedef struct {
+  int target_rate;                 // Events per second we tried to send.
+  double sent_rate;                // Events per second actually sent.
+  double received_rate;            // Events per second seen while sending.
+  double mean_latency_ms;
+  // The slope of a least squares fit of latency against send time. Near zero
+  // while the browser keeps up; grows once its input queue starts backing up.
+  double latency_growth_ms_per_s;
+  double mean_outstanding;         // Mean number of events sent but not seen.
+  int max_outstanding;
+  int events_sent;
+  int events_lost;                 // Events never seen before the drain timeout.
+  int events_dropped;              // Events the page skipped over.
+  int events_coalesced;            // Events that shared a frame with another.
+} throughput_step_results_t;
+
+// Capture intervals are counted in bins this wide. The last bin also counts
+// all longer intervals.
+enum { capture_histogram_bins = 16 };
+static const int capture_histogram_bin_ms = 2;
+
+// Frame intervals are counted in bins this wide. The last bin also counts all
+// longer intervals.
+enum { frame_histogram_bins = 25 };
+static const int frame_histogram_bin_ms = 4;
+
+// The intervals between the frames of one animation during the pause time
+// test. A single long pause and a steady stutter can have the same worst gap;
+// the histogram and the pacing deviation tell them apart. When a screenshot
+// sees several frames at once, each is taken to have lasted an equal share of
+// the time since the last change seen, so the histogram only resolves
+// intervals to about one capture interval.
+typedef struct {
+  // Frames counted by their interval, in bins of frame_histogram_bin_ms.
+  int histogram[frame_histogram_bins];
+  int frames;
+  double mean_interval_ms;
+  // The standard deviation of the frame intervals: 0 for perfectly even
+  // pacing, whatever the frame rate. The deviation that screenshots add by
+  // only seeing each change sometime within a capture interval is estimated
+  // and taken out.
+  double interval_stddev_ms;
+  // The estimated deviation screenshots added, which was taken out of
+  // interval_stddev_ms. Pacing deviations much smaller than this aren't
+  // resolved.
+  double quantization_stddev_ms;
+  // Refreshes of the display in which the animation should have drawn a frame
+  // but didn't, counted against the median frame interval when screenshots
+  // are frequent enough to time single frames, or else the estimated refresh
+  // period. Both come from the animation's own frames, so an animation that
+  // misses every other refresh throughout counts as drawing every frame. 0 if
+  // neither could be estimated.
+  int dropped_frames;
+} frame_intervals_t;
+
+// The raw bounds of the first max_reported_samples latency measurements of a
+// test, in milliseconds, so clients can fit or plot the distribution
+// themselves. Each measurement's true latency lies between its bounds.
+enum { max_reported_samples = 256 };
+typedef struct {
+  int count;
+  double lower_ms[max_reported_samples];
+  double upper_ms[max_reported_samples];
+} latency_sample_bounds_t;
+
+// The scroll velocity profile is reported in bins this wide, from the first
+// movement of each scroll. The last bin also counts all later movement.
+enum { scroll_profile_bins = 32 };
+static const int scroll_profile_bin_ms = 16;
+
+// The mean trajectory of the scroll animations followed by the scroll latency
+// test, from every change in scroll position seen until each scroll settled.
+// Scrolls that hadn't settled when the test finished are left out.
+typedef struct {
+  int scrolls;
+  // From sending the scroll event to the first movement, at the midpoint of
+  // the screenshots that bound it.
+  double time_to_first_movement_ms;
+  // From the first movement to the last.
+  double animation_duration_ms;
+  // Changes in scroll position seen per scroll, which is the number of frames
+  // the animation drew if screenshots are taken faster than the refresh rate.
+  double frames;
+  double distance_pixels;
+  // The mean scroll velocity in each bin, in device pixels per second.
+  double velocity_pixels_per_s[scroll_profile_bins];
+} scroll_trajectory_t;
+
+// How trustworthy a latency test's measurements are. Measurements are dropped
+// when the screenshots around a response are too far apart to bound it, and
+// bounds wider than wide_bound_threshold_ms locate a response only coarsely.
+// The sample counts are of key down and scroll latency samples only; frame
+// counter changes aren't counted.
+typedef struct {
+  // The screenshot method in use at the end of the test, and how many times
+  // the test switched to a cheaper one because screenshots were too slow.
+  const char *screenshot_backend;
+  int backend_switches;
+  // Intervals between screenshots, excluding those deliberately delayed.
+  int capture_interval_histogram[capture_histogram_bins];
+  int samples_recorded;
+  int samples_dropped_slow_screenshot;
+  int samples_dropped_no_prior_screenshot;
+  int wide_bound_samples;
+  // False if too many samples were dropped or had wide bounds for the results
+  // to be trusted.
+  bool acceptable;
+} measurement_quality_t;
+
+// The results of one latency test, filled in by measure_latency.
+typedef struct {
+  // Mean latencies, from the distribution fitted to the interval-censored
+  // samples (see interval-stats.h).
+  double key_down_latency_ms;
+  double scroll_latency_ms;
+  // Percentiles of the same distributions, in the order of
+  // latency_percentiles.
+  double key_down_latency_percentiles_ms[num_latency_percentiles];
+  double scroll_latency_percentiles_ms[num_latency_percentiles];
+  double key_down_latency_stddev_ms;
+  int key_down_samples;
+  // In a session, the latency of key down events that were sent while a
+  // scroll was settling, and may have been slowed by its animation. These
+  // are left out of the key down results above. All are 0 if there were none.
+  double key_down_during_scroll_latency_ms;
+  double key_down_during_scroll_latency_percentiles_ms[num_latency_percentiles];
+  int key_down_during_scroll_samples;
+  // The key down latency of the native reference window, measured before the
+  // test if test_options_t.calibrate_floor was set: the floor below which no
+  // browser can go on this machine with this benchmark. The mean and standard
+  // deviation of key down latency are also reported with the floor taken out,
+  // treating the floor and the browser's own latency as independent. The
+  // reference window doesn't scroll, so scroll latency has no floor. All are
+  // 0 if floor_samples is 0.
+  double floor_latency_ms;
+  double floor_stddev_ms;
+  int floor_samples;
+  double key_down_latency_above_floor_ms;
+  double key_down_stddev_above_floor_ms;
+  scroll_trajectory_t scroll_trajectory;
+  double max_js_pause_time_ms;
+  double max_css_pause_time_ms;
+  double max_scroll_pause_time_ms;
+  // Every frame interval seen during the pause time test. The scroll position
+  // isn't a frame counter, so each change in it seen is counted as one frame.
+  frame_intervals_t js_frame_intervals;
+  frame_intervals_t css_frame_intervals;
+  frame_intervals_t scroll_frame_intervals;
+  latency_sample_bounds_t key_down_sample_bounds;
+  latency_sample_bounds_t scroll_sample_bounds;
+  // The display refresh period estimated from the cadence of frame counter
+  // changes, or 0 if it could not be estimated. Reads long if the page misses
+  // frames.
+  double refresh_period_ms;
+  // The mean time between screenshots, which bounds how precisely a single
+  // sample is known, and the resolution actually achieved by the fitted key
+  // down latency distribution (see censored_distribution_resolution).
+  double mean_capture_interval_ms;
+  double key_down_effective_resolution_ms;
+  // Key down latency of the events injected in each bin of the refresh
+  // interval. Bin 0 starts at the estimated vblank, as seen by screenshots.
+  // Bins that received no events have a sample count of 0.
+  double key_down_latency_by_phase_ms[refresh_phase_bins];
+  int key_down_samples_by_phase[refresh_phase_bins];
+  // How the key down test's responses matched the events that were sent, as
+  // identified by the key identities the page echoes back. Dropped events
+  // were skipped over by the page; coalesced events were drawn in the same
+  // frame as another event; unidentified responses matched no sent event.
+  int key_down_events_dropped;
+  int key_down_events_coalesced;
+  int key_down_events_unidentified;
+  // Key down latency split at the time the page's key down handler ran, as
+  // reported by the page: from sending the event until the handler ran, and
+  // from then until the response was drawn. The page's timestamps are
+  // converted to our clock with a handshake that is only accurate to within
+  // clock_sync_uncertainty_ms. All are 0 if key_down_handler_samples is 0.
+  double key_down_input_to_handler_ms;
+  double key_down_handler_to_pixels_ms;
+  int key_down_handler_samples;
+  double clock_sync_uncertainty_ms;
+  // The probe strips found below the test pattern, if the test window draws
+  // them. For each, its row relative to the pattern and the mean time from the
+  // pattern showing a frame to the strip showing the same frame: how far behind
+  // the top of the window each row updates. Offsets are only measured for
+  // frames whose update both rows were seen making, so if screenshots are
+  // taken less often than the refresh rate, they read low.
+  int num_probe_strips;
+  int probe_strip_rows[max_probe_strips];
+  double probe_strip_offset_ms[max_probe_strips];
+  int probe_strip_samples[max_probe_strips];
+  // Screenshots in which a probe strip showed a different frame from the
+  // pattern, out of the screenshots taken with probe strips.
+  int tear_events;
+  int probe_screenshots;
+  // Results of the input throughput test, one step per swept rate.
+  throughput_step_results_t throughput[max_input_rates];
+  int num_throughput_steps;
+  // The lowest swept rate at which the browser's input pipeline saturated, or
+  // 0 if it kept up at every rate.
+  int saturation_rate;
+  measurement_quality_t quality;
+  // The seed the test's random choices were made with, to rerun it exactly.
+  uint64_t seed;
+} latency_results_t;
+
+// A measurement session owns everything a latency test needs: its connection
+// to the display, the processes it launched, and the test's working memory.
+// Sessions share no state, so tests on different displays can run at the same
+// time on different threads. A session runs one test at a time.
+typedef struct latency_session_t latency_session_t;
+
+// Creates a session that tests on the named display, or the default display if
+// display_name is NULL. Returns NULL if the display can't be opened.
+latency_session_t *create_latency_session(const char *display_name);
+// Frees the session and closes its display connection. Accepts NULL.
+void destroy_latency_session(latency_session_t *session);
+// Returns the platform context the session uses, for launching a browser on
+// the session's display.
+platform_context_t *get_session_platform(latency_session_t *session);
+
 // Main test function. Locates the given magic pixel pattern on the screen, then
 // runs one full latency test, sending input events and recording responses. On
-// success, the results of the test are reported in the output parameters, and
+// success, the results of the test are reported in the results parameter, and
 // true is returned. If the test fails, the error parameter is filled in with
 // an error message and false is returned.
 bool measure_latency(
+    latency_session_t *session,
+    const uint8_t magic_pattern[],
+    const test_options_t *options,
+    latency_results_t *out_results,
+    char **error);
+
+// measure_latency in parts, so that one thread can run many sessions' tests at
+// once. A test is a state machine that waits for its next input event or
+// screenshot on a timer instead of blocking, and step_latency_tests advances
+// each test that is due.
+//
+// Locates the magic pattern on the screen and starts a test in the session,
+// which must not already be running one. out_results must stay valid until the
+// test ends. Returns false with an error if the test can't start.
+bool begin_latency_test(
+    latency_session_t *session,
     const uint8_t magic_pattern[],
-    double *out_key_down_latency_ms,
-    double *out_scroll_latency_ms,
-    double *out_max_js_pause_time_ms,
-    double *out_max_css_pause_time_ms,
-    double *out_max_scroll_pause_time_ms,
+    const test_options_t *options,
+    latency_results_t *out_results,
     char **error);
+// Advances each of the given sessions' tests that is due, taking at most one
+// screenshot for each. Returns the earliest get_nanoseconds() time at which a
+// test will next be due, or 0 if none of the sessions is running a test.
+int64_t step_latency_tests(latency_session_t *sessions[], int num_sessions);
+// Steps the given sessions' tests until all of them have ended, sleeping while
+// none is due.
+void run_latency_tests(latency_session_t *sessions[], int num_sessions);
+// Returns true while the session's test hasn't ended.
+bool latency_test_running(latency_session_t *session);
+// Returns true if the session's last test succeeded and filled in its results.
+// Otherwise fills in the error parameter and returns false.
+bool latency_test_succeeded(latency_session_t *session, char **error);
+
+// What a running test has measured so far, for reporting its progress.
+typedef struct {
+  // "idle", "calibrating", "waiting for pattern", "measuring", "splitting",
+  // "succeeded" or "failed".
+  const char *phase;
+  test_mode_t test_mode;
+  // Since the test began.
+  double elapsed_ms;
+  int screenshots;
+  int key_down_measurements;
+  // The key down test ends once it has taken this many measurements.
+  int key_down_measurements_target;
+  int scroll_measurements;
+  measurement_quality_t quality;
+} latency_progress_t;
+
+// One measurement recorded by a running test: the bounds on the time until the
+// named statistic of the page changed, e.g. the latency of a key down event
+// for "key_down_events" or a pause for "javascript_frames".
+typedef struct {
+  const char *statistic;
+  // When the screenshot that saw the change was taken, since the test began.
+  double time_ms;
+  double lower_ms;
+  double upper_ms;
+} live_sample_t;
+
+// Copies the latest progress of the session's test. Safe to call from any
+// thread while the test runs.
+void get_latency_progress(latency_session_t *session,
+                          latency_progress_t *out_progress);
+// Copies up to max_samples of the measurements the session's test has recorded
+// since *cursor, which starts at 0, and advances *cursor past them. Returns the
+// number copied. A reader that falls too far behind loses samples, which are
+// counted in *out_missed. Safe to call from any thread while the test runs.
+int read_live_samples(latency_session_t *session, long *cursor,
+                      live_sample_t out_samples[], int max_samples,
+                      int *out_missed);
+// Makes the session's test fail at its next step, e.g. because its client went
+// away. Safe to call from any thread.
+void cancel_latency_test(latency_session_t *session);
+
+// Sleeps until get_nanoseconds() reaches the given time. usleep is too coarse
+// to hit a phase bin reliably, so the final millisecond is spent spinning.
+void sleep_until(int64_t time);
+
+// Records the times at which the test page's key down handler ran for a run of
+// consecutive key down events, numbered by the page's key down counter
+// starting at first_key_down. Times are in get_nanoseconds() units, converted
+// by the page from its own clock. Returns false, ignoring the report, if the
+// session isn't running a test with the given magic pattern. Safe to call from
+// any thread.
+bool record_page_handler_times(latency_session_t *session,
+                               const uint8_t magic_pattern[],
+                               int first_key_down, const int64_t times[],
+                               int count, double clock_sync_uncertainty_ms);
+
+// The results of benchmark_clock.
+typedef struct {
+  const char *source;        // From get_clock_source.
+  int reads;                 // The number of times the clock was read.
+  double read_overhead_ns;   // The mean time taken by one read.
+  // The smallest nonzero difference between two consecutive reads, which is an
+  // upper bound on the clock's resolution.
+  int64_t resolution_ns;
+  // The largest difference between two consecutive reads, usually due to the
+  // thread being preempted.
+  int64_t max_step_ns;
+  // The number of reads that returned less than the read before. Should be 0.
+  int backward_steps;
+} clock_benchmark_results_t;
+
+// Measures the overhead and resolution of get_nanoseconds by reading it many
+// times in a tight loop. Every latency we report is a difference of two reads,
+// so both bound the precision of our results.
+void benchmark_clock(clock_benchmark_results_t *out_results);
+// Describes the results of benchmark_clock as a few lines of text, so each
+// platform can show them where its user will see them.
+void format_clock_benchmark(const clock_benchmark_results_t *results,
+                            char *buffer, size_t size);
+
+// Tracks the time between draws of a native reference window, to log stalls.
+// Zero-initialize one per window.
+typedef struct {
+  int64_t last_draw_time;
+  int64_t biggest_draw_time_gap;
+} draw_timing_t;
 
 // Updates the given pattern with the given event data, then draws the pattern to
-// the current OpenGL context.
-void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
-                              int keydown_events, int esc_presses);
+// the current OpenGL context. key_identities is the echo of the identities of
+// the most recent key down events, built with push_key_identity.
+void draw_pattern_with_opengl(draw_timing_t *timing, uint8_t pattern[],
+                              int scroll_events, int keydown_events,
+                              int key_identities, int esc_presses);
 
 // Parses the magic pattern from a hexadecimal encoded string and fills
 // parsed_pattern with the result. parsed_pattern must be a buffer at least
@@ -63,6 +468,17 @@ void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
 bool parse_hex_magic_pattern(const char *encoded_pattern,
                              uint8_t parsed_pattern[]);
 
+// Parses a nonzero decimal seed for test_options_t. Returns false if the string
+// isn't one.
+bool parse_seed(const char *encoded_seed, uint64_t *out_seed);
+
+// Returns a nonzero seed taken from the clock, different on every call.
+uint64_t choose_random_seed(void);
+
+// Fills the magic bytes of a pattern with random bytes derived from the given
+// seed, and the rest with zeros. pattern must be pattern_bytes long.
+void random_pattern_from_seed(uint64_t seed, uint8_t pattern[]);
+
 // Encodes the given magic pattern into hexadecimal. encoded_pattern must be a
 // buffer at least hex_pattern_length + 1 bytes long.
 void hex_encode_magic_pattern(const uint8_t magic_pattern[],
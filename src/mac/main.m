@@ -27,7 +27,9 @@ NSOpenGLContext *context;
 uint8_t pattern[pattern_bytes];
 static int scrolls = 0;
 static int key_downs = 0;
+static int key_identities = 0;
 static int esc_presses = 0;
+static draw_timing_t timing;
 
 // This callback is called for each display refresh by CVDisplayLink so that we
 // can draw at exactly the display's refresh rate.
@@ -60,7 +62,8 @@ static CVReturn vsync_callback(
   // We must lock the OpenGL context since it's shared with the main thread.
   CGLLockContext((CGLContextObj)[context CGLContextObj]);
   [context makeCurrentContext];
-  draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+  draw_pattern_with_opengl(&timing, pattern, scrolls, key_downs,
+                           key_identities, esc_presses);
   [context flushBuffer];
   CGLUnlockContext((CGLContextObj)[context CGLContextObj]);
   return kCVReturnSuccess;
@@ -141,7 +144,8 @@ int main(int argc, const char *argv[])
     [context setView:[window contentView]];
     // Draw the test pattern on the window before it is shown.
     [context makeCurrentContext];
-    draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+    draw_pattern_with_opengl(&timing, pattern, scrolls, key_downs,
+                             key_identities, esc_presses);
     [context flushBuffer];
     // Show the window.
     [window makeKeyAndOrderFront:window];
@@ -159,8 +163,21 @@ int main(int argc, const char *argv[])
       return nil;
     }];
     [NSEvent addLocalMonitorForEventsMatchingMask:NSKeyDownMask handler:^NSEvent *(NSEvent *event) {
-      if ([event keyCode] == 53) {
-        esc_presses++;
+      // These are the virtual key codes send_keystroke uses.
+      switch ([event keyCode]) {
+        case 53: esc_presses++; break;
+        case 6:
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_Z);
+          break;
+        case 11:
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_B);
+          break;
+        case 17:
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_T);
+          break;
+        case 13:
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_W);
+          break;
       }
       key_downs++;
       return nil;
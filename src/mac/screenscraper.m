@@ -19,6 +19,8 @@
 #import "../latency-benchmark.h"
 #import <Cocoa/Cocoa.h>
 #import <mach-o/dyld.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
 
 
 const float float_epsilon = 0.0001;
@@ -29,8 +31,50 @@ bool near_integer(float f) {
 static const CGWindowImageOption image_options =
     kCGWindowImageBestResolution | kCGWindowImageShouldBeOpaque;
 
-screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
-    uint32_t height) {
+struct platform_context_t {
+  // Set once the test has given up on compositing the window list for each
+  // screenshot, and reads the display's framebuffer directly instead.
+  bool use_display_image;
+  pid_t browser_process_pid;
+  pid_t window_process_pid;
+};
+
+// Only the main display is supported, so the display name is ignored.
+platform_context_t *create_platform_context(const char *display_name) {
+  platform_context_t *context =
+      (platform_context_t *)malloc(sizeof(platform_context_t));
+  memset(context, 0, sizeof(platform_context_t));
+  return context;
+}
+
+void destroy_platform_context(platform_context_t *context) {
+  if (!context) {
+    return;
+  }
+  if (context->window_process_pid) {
+    close_native_reference_window(context);
+  }
+  if (context->browser_process_pid) {
+    close_browser(context);
+  }
+  free(context);
+}
+
+const char *get_screenshot_backend(platform_context_t *context) {
+  return context->use_display_image ? "CGDisplayCreateImageForRect" :
+      "CGWindowListCreateImage";
+}
+
+bool use_cheaper_screenshot_backend(platform_context_t *context) {
+  if (context->use_display_image) {
+    return false;
+  }
+  context->use_display_image = true;
+  return true;
+}
+
+screenshot *take_screenshot(platform_context_t *context, uint32_t x,
+    uint32_t y, uint32_t width, uint32_t height) {
   // TODO: support multiple monitors.
   NSScreen *screen = [[NSScreen screens] objectAtIndex:0];
   CGRect screen_rect = [screen convertRectToBacking:[screen frame]];
@@ -54,11 +98,17 @@ screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
       ceilf(converted_capture_rect.size.height);
   // Update capture_rect with the final rounded values.
   capture_rect = [screen convertRectToBacking:converted_capture_rect];
-  CGImageRef window_image = CGWindowListCreateImage(converted_capture_rect,
-      kCGWindowListOptionAll, kCGNullWindowID, image_options);
+  CGImageRef window_image;
+  if (context->use_display_image) {
+    window_image = CGDisplayCreateImageForRect(CGMainDisplayID(),
+        converted_capture_rect);
+  } else {
+    window_image = CGWindowListCreateImage(converted_capture_rect,
+        kCGWindowListOptionAll, kCGNullWindowID, image_options);
+  }
   int64_t screenshot_time = get_nanoseconds();
   if (!window_image) {
-    debug_log("CGWindowListCreateImage failed");
+    debug_log("%s failed", get_screenshot_backend(context));
     return NULL;
   }
   size_t image_width = CGImageGetWidth(window_image);
@@ -80,9 +130,9 @@ screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
       (kCGImageAlphaFirst | kCGImageAlphaNoneSkipFirst |
        kCGImageAlphaPremultipliedFirst);
   if (bpp != 32 || bpc != 8 || !correct_byte_order || !correct_alpha_location) {
-    debug_log("Incorrect image format from CGWindowListCreateImage. "
+    debug_log("Incorrect image format from %s. "
               "bpp = %d, bpc = %d, byte order = %s, alpha location = %s",
-              bpp, bpc, correct_byte_order ? "correct" : "wrong",
+              get_screenshot_backend(context), bpp, bpc, correct_byte_order ? "correct" : "wrong",
               correct_alpha_location ? "correct" : "wrong");
     CFRelease(window_image);
     return NULL;
@@ -116,12 +166,20 @@ bool send_keystroke(int keyCode) {
   return true;
 }
 
-bool send_keystroke_b() { return send_keystroke(11); }
-bool send_keystroke_t() { return send_keystroke(17); }
-bool send_keystroke_w() { return send_keystroke(13); }
-bool send_keystroke_z() { return send_keystroke(6); }
+bool send_keystroke_b(platform_context_t *context) {
+  return send_keystroke(11);
+}
+bool send_keystroke_t(platform_context_t *context) {
+  return send_keystroke(17);
+}
+bool send_keystroke_w(platform_context_t *context) {
+  return send_keystroke(13);
+}
+bool send_keystroke_z(platform_context_t *context) {
+  return send_keystroke(6);
+}
 
-bool send_scroll_down(x, y) {
+bool send_scroll_down(platform_context_t *context, int x, int y) {
   CGFloat devicePixelRatio =
       [[[NSScreen screens] objectAtIndex:0] backingScaleFactor];
   CGWarpMouseCursorPosition(
@@ -133,14 +191,30 @@ bool send_scroll_down(x, y) {
   return true;
 }
 
-static AbsoluteTime start_time = { .hi = 0, .lo = 0 };
+// mach_absolute_time is monotonic and has the highest resolution available,
+// but ticks in units that must be converted using the timebase.
+static pthread_once_t clock_init_once = PTHREAD_ONCE_INIT;
+static uint64_t start_time;
+static mach_timebase_info_data_t timebase;
+static void init_clock() {
+  mach_timebase_info(&timebase);
+  start_time = mach_absolute_time();
+}
+
+// Returns the number of nanoseconds elapsed since the first call to
+// get_nanoseconds in this process.
 int64_t get_nanoseconds() {
-  // TODO: Apple deprecated UpTime(), so switch to mach_absolute_time.
-  if (UnsignedWideToUInt64(start_time) == 0) {
-    start_time = UpTime();
-    return 0;
+  pthread_once(&clock_init_once, init_clock);
+  uint64_t elapsed = mach_absolute_time() - start_time;
+  // The timebase is 1/1 on Intel Macs, so skip the conversion there.
+  if (timebase.numer == timebase.denom) {
+    return (int64_t)elapsed;
   }
-  return UnsignedWideToUInt64(AbsoluteDeltaToNanoseconds(UpTime(), start_time));
+  return (int64_t)(elapsed * (timebase.numer / (double)timebase.denom));
+}
+
+const char *get_clock_source() {
+  return "mach_absolute_time";
 }
 
 void debug_log(const char *message, ...) {
@@ -153,11 +227,10 @@ void debug_log(const char *message, ...) {
 #endif
 }
 
-static pid_t browser_process_pid = 0;
-
-bool open_browser(const char *program, const char *args, const char *url) {
+bool open_browser(platform_context_t *context, const char *program,
+                  const char *args, const char *url) {
   assert(url);
-  if (browser_process_pid) {
+  if (context->browser_process_pid) {
     debug_log("Warning: calling open_browser, but browser already open.");
   }
   if (program == NULL) {
@@ -182,8 +255,8 @@ bool open_browser(const char *program, const char *args, const char *url) {
     debug_log("Failed to parse command line: %s", command_line);
     return false;
   }
-  browser_process_pid = fork();
-  if (!browser_process_pid) {
+  context->browser_process_pid = fork();
+  if (!context->browser_process_pid) {
     // child process, launch the browser!
     execv(expanded_args.we_wordv[0], expanded_args.we_wordv);
     exit(1);
@@ -192,13 +265,13 @@ bool open_browser(const char *program, const char *args, const char *url) {
   return true;
 }
 
-bool close_browser() {
-  if (browser_process_pid == 0) {
+bool close_browser(platform_context_t *context) {
+  if (context->browser_process_pid == 0) {
     debug_log("Browser not open");
     return false;
   }
-  int r = kill(browser_process_pid, SIGKILL);
-  browser_process_pid = 0;
+  int r = kill(context->browser_process_pid, SIGKILL);
+  context->browser_process_pid = 0;
   if (r) {
     debug_log("Failed to close browser window");
     return false;
@@ -207,10 +280,9 @@ bool close_browser() {
 }
 
 
-pid_t window_process_pid = 0;
-
-bool open_native_reference_window(uint8_t *test_pattern_for_window) {
-  if (window_process_pid != 0) {
+bool open_native_reference_window(platform_context_t *context,
+                                  uint8_t *test_pattern_for_window) {
+  if (context->window_process_pid != 0) {
     debug_log("Native reference window already open");
     return false;
   }
@@ -222,8 +294,8 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
   }
   char hex_pattern[hex_pattern_length + 1];
   hex_encode_magic_pattern(test_pattern_for_window, hex_pattern);
-  window_process_pid = fork();
-  if (!window_process_pid) {
+  context->window_process_pid = fork();
+  if (!context->window_process_pid) {
     // Child process. It would be nice to just call into Cocoa from here, but
     // Cocoa can't handle running after a call to fork(), so instead we must
     // restart the process.
@@ -235,13 +307,13 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
   return true;
 }
 
-bool close_native_reference_window() {
-  if (window_process_pid == 0) {
+bool close_native_reference_window(platform_context_t *context) {
+  if (context->window_process_pid == 0) {
     debug_log("Native reference window not open");
     return false;
   }
-  int r = kill(window_process_pid, SIGKILL);
-  window_process_pid = 0;
+  int r = kill(context->window_process_pid, SIGKILL);
+  context->window_process_pid = 0;
   if (r) {
     debug_log("Failed to close native reference window");
     return false;
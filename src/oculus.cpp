@@ -13,6 +13,9 @@ extern "C" {
 static char result_buffer[2048];
 static OVR::DeviceManager *manager = NULL;
 static OVR::LatencyTestDevice *global_latency_device = NULL;
+// There's only one latency tester, so its keystrokes go through one context on
+// the default display.
+static platform_context_t *platform = NULL;
 
 class Handler : public OVR::MessageHandler {
   virtual void OnMessage(const OVR::Message &message) {
@@ -25,8 +28,8 @@ class Handler : public OVR::MessageHandler {
       usleep(1000);
       local_device->Release();
     }
-    if (message.Type == OVR::Message_LatencyTestButton) {
-      send_keystroke_t();
+    if (message.Type == OVR::Message_LatencyTestButton && platform) {
+      send_keystroke_t(platform);
     }
   }
 };
@@ -53,6 +56,7 @@ static OVR::LatencyTestDevice *get_device() {
 // Must be called before all other functions in this file.
 extern "C" void init_oculus() {
   OVR::System::Init();
+  platform = create_platform_context(NULL);
   manager = OVR::DeviceManager::Create();
   OVR::LatencyTestDevice *latency_device = get_device();
 }
@@ -75,6 +79,10 @@ extern "C" bool run_hardware_latency_test(const char **result) {
   assert(manager);
   assert(result);
   *result = "Unknown error";
+  if (!platform) {
+    *result = "Failed to connect to the display.";
+    return false;
+  }
   OVR::LatencyTestDevice *latency_device = get_device();
   // Check that the latency tester is plugged in.
   if (!latency_device) {
@@ -96,10 +104,10 @@ extern "C" bool run_hardware_latency_test(const char **result) {
     if (color.R != displayed_color) {
       if (color.R == 255 && color.G == 255 && color.B == 255) {
         // Display white.
-        send_keystroke_w();
+        send_keystroke_w(platform);
       } else if (color.R == 0 && color.G == 0 && color.B == 0) {
         // Display black.
-        send_keystroke_b();
+        send_keystroke_b(platform);
       } else {
         // We can only display white or black.
         *result = "Unexpected color requested by latency tester.";
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "results-writer.h"
+#include "header-list.h"
+
+//MSVC doesn't hvae snprintf defined, for our use, this works- beware they are not identical
+#ifdef WIN32
+#define snprintf sprintf_s
+#endif
+
+// The writer's buffer starts this big and doubles when full.
+static const size_t initial_capacity = 4096;
+
+// CBOR major types, in the top three bits of each item's initial byte.
+enum {
+  CBOR_UNSIGNED = 0,
+  CBOR_NEGATIVE = 1,
+  CBOR_TEXT = 3,
+  CBOR_ARRAY = 4,
+  CBOR_MAP = 5,
+};
+// Initial bytes with fixed meanings.
+static const uint8_t cbor_false = 0xf4;
+static const uint8_t cbor_true = 0xf5;
+static const uint8_t cbor_null = 0xf6;
+static const uint8_t cbor_double = 0xfb;
+// Starts a map or array of indefinite length, and ends it.
+static const uint8_t cbor_indefinite = 31;
+static const uint8_t cbor_break = 0xff;
+
+void init_results_writer(results_writer_t *writer, results_format_t format) {
+  memset(writer, 0, sizeof(results_writer_t));
+  writer->format = format;
+}
+
+void free_results_writer(results_writer_t *writer) {
+  free(writer->data);
+  writer->data = NULL;
+  writer->length = writer->capacity = 0;
+}
+
+const char *results_content_type(const results_writer_t *writer) {
+  return writer->format == RESULTS_FORMAT_CBOR ? "application/cbor" :
+      "application/json";
+}
+
+results_format_t negotiate_results_format(const char *accept_header) {
+  double cbor = header_list_quality(accept_header, "application/cbor");
+  // JSON is the default, so it takes the quality of the most specific range
+  // that covers it, and only CBOR named outright can beat it.
+  double json = header_list_quality(accept_header, "application/json");
+  if (json < 0) {
+    json = header_list_quality(accept_header, "application/*");
+  }
+  if (json < 0) {
+    json = header_list_quality(accept_header, "*/*");
+  }
+  if (cbor > 0 && cbor >= json) {
+    return RESULTS_FORMAT_CBOR;
+  }
+  return RESULTS_FORMAT_JSON;
+}
+
+static void append(results_writer_t *writer, const void *bytes,
+                   size_t length) {
+  if (writer->failed) {
+    return;
+  }
+  if (writer->length + length > writer->capacity) {
+    size_t capacity = writer->capacity ? writer->capacity : initial_capacity;
+    while (writer->length + length > capacity) {
+      capacity *= 2;
+    }
+    char *data = (char *)realloc(writer->data, capacity);
+    if (!data) {
+      writer->failed = true;
+      return;
+    }
+    writer->data = data;
+    writer->capacity = capacity;
+  }
+  memcpy(writer->data + writer->length, bytes, length);
+  writer->length += length;
+}
+
+static void append_string(results_writer_t *writer, const char *string) {
+  append(writer, string, strlen(string));
+}
+
+static void append_byte(results_writer_t *writer, uint8_t byte) {
+  append(writer, &byte, 1);
+}
+
+// Writes a CBOR item head: the major type and the argument, in the fewest
+// bytes, most significant first.
+static void append_cbor_head(results_writer_t *writer, int major_type,
+                             uint64_t argument) {
+  uint8_t head[9];
+  size_t length = 1;
+  int additional;
+  if (argument < 24) {
+    additional = (int)argument;
+  } else if (argument <= UINT8_MAX) {
+    additional = 24;
+    length = 2;
+  } else if (argument <= UINT16_MAX) {
+    additional = 25;
+    length = 3;
+  } else if (argument <= UINT32_MAX) {
+    additional = 26;
+    length = 5;
+  } else {
+    additional = 27;
+    length = 9;
+  }
+  head[0] = (uint8_t)(major_type << 5 | additional);
+  for (size_t i = 1; i < length; i++) {
+    head[i] = (uint8_t)(argument >> (8 * (length - 1 - i)));
+  }
+  append(writer, head, length);
+}
+
+// Writes a JSON string literal, escaping what JSON requires.
+static void append_json_string(results_writer_t *writer, const char *string) {
+  append_byte(writer, '"');
+  for (const char *c = string; *c; c++) {
+    char escaped[8];
+    if (*c == '"' || *c == '\\') {
+      snprintf(escaped, sizeof(escaped), "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+    } else {
+      append_byte(writer, (uint8_t)*c);
+      continue;
+    }
+    append_string(writer, escaped);
+  }
+  append_byte(writer, '"');
+}
+
+static void append_cbor_text(results_writer_t *writer, const char *string) {
+  size_t length = strlen(string);
+  append_cbor_head(writer, CBOR_TEXT, length);
+  append(writer, string, length);
+}
+
+// Starts a value: writes the separator and key it needs in the enclosing
+// object or array.
+static void begin_value(results_writer_t *writer, const char *key) {
+  if (writer->depth == 0) {
+    return;
+  }
+  bool *has_members = &writer->has_members[writer->depth - 1];
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    if (*has_members) {
+      append_string(writer, ", ");
+    }
+    if (key) {
+      append_json_string(writer, key);
+      append_string(writer, ": ");
+    }
+  } else if (key) {
+    append_cbor_text(writer, key);
+  }
+  *has_members = true;
+}
+
+static void begin_container(results_writer_t *writer, const char *key,
+                            int cbor_major_type, const char *json_open) {
+  begin_value(writer, key);
+  if (writer->depth == max_results_depth) {
+    writer->failed = true;
+    return;
+  }
+  writer->has_members[writer->depth++] = false;
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    append_string(writer, json_open);
+  } else {
+    append_byte(writer, (uint8_t)(cbor_major_type << 5 | cbor_indefinite));
+  }
+}
+
+static void end_container(results_writer_t *writer, const char *json_close) {
+  if (writer->depth == 0) {
+    writer->failed = true;
+    return;
+  }
+  writer->depth--;
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    append_string(writer, json_close);
+  } else {
+    append_byte(writer, cbor_break);
+  }
+}
+
+void results_begin_object(results_writer_t *writer, const char *key) {
+  begin_container(writer, key, CBOR_MAP, "{");
+}
+
+void results_end_object(results_writer_t *writer) {
+  end_container(writer, "}");
+}
+
+void results_begin_array(results_writer_t *writer, const char *key) {
+  begin_container(writer, key, CBOR_ARRAY, "[");
+}
+
+void results_end_array(results_writer_t *writer) {
+  end_container(writer, "]");
+}
+
+void results_int(results_writer_t *writer, const char *key, int64_t value) {
+  begin_value(writer, key);
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", (long long)value);
+    append_string(writer, text);
+  } else if (value >= 0) {
+    append_cbor_head(writer, CBOR_UNSIGNED, (uint64_t)value);
+  } else {
+    // CBOR stores -1 - value, which can't overflow.
+    append_cbor_head(writer, CBOR_NEGATIVE, (uint64_t)(-1 - value));
+  }
+}
+
+void results_double(results_writer_t *writer, const char *key, double value) {
+  // NaN is the only value not equal to itself, and infinities are the only
+  // values whose difference with themselves isn't 0.
+  if (value != value || value - value != 0) {
+    results_null(writer, key);
+    return;
+  }
+  begin_value(writer, key);
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    // Big enough for any double in %f notation.
+    char text[512];
+    snprintf(text, sizeof(text), "%f", value);
+    append_string(writer, text);
+  } else {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t encoded[9];
+    encoded[0] = cbor_double;
+    for (int i = 0; i < 8; i++) {
+      encoded[i + 1] = (uint8_t)(bits >> (8 * (7 - i)));
+    }
+    append(writer, encoded, sizeof(encoded));
+  }
+}
+
+void results_bool(results_writer_t *writer, const char *key, bool value) {
+  begin_value(writer, key);
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    append_string(writer, value ? "true" : "false");
+  } else {
+    append_byte(writer, value ? cbor_true : cbor_false);
+  }
+}
+
+void results_string(results_writer_t *writer, const char *key,
+                    const char *value) {
+  begin_value(writer, key);
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    append_json_string(writer, value);
+  } else {
+    append_cbor_text(writer, value);
+  }
+}
+
+void results_null(results_writer_t *writer, const char *key) {
+  begin_value(writer, key);
+  if (writer->format == RESULTS_FORMAT_JSON) {
+    append_string(writer, "null");
+  } else {
+    append_byte(writer, cbor_null);
+  }
+}
+
+void results_double_array(results_writer_t *writer, const char *key,
+                          const double values[], const int counts[],
+                          int length) {
+  results_begin_array(writer, key);
+  for (int i = 0; i < length; i++) {
+    if (counts && counts[i] == 0) {
+      results_null(writer, NULL);
+    } else {
+      results_double(writer, NULL, values[i]);
+    }
+  }
+  results_end_array(writer);
+}
+
+void results_int_array(results_writer_t *writer, const char *key,
+                       const int values[], int length) {
+  results_begin_array(writer, key);
+  for (int i = 0; i < length; i++) {
+    results_int(writer, NULL, values[i]);
+  }
+  results_end_array(writer);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Builds structured results in memory as either JSON or CBOR (RFC 7049), so
+// that results are described once and encoded in whichever format the client
+// asked for. Values are added in order: each begin_object or begin_array must
+// be matched by an end, and members of an object are given a key while
+// elements of an array and the top-level value are not (pass NULL).
+
+#ifndef WLB_RESULTS_WRITER_H_
+#define WLB_RESULTS_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "screenscraper.h"
+
+typedef enum {
+  RESULTS_FORMAT_JSON,
+  RESULTS_FORMAT_CBOR,
+} results_format_t;
+
+// Objects and arrays can be nested this deep.
+enum { max_results_depth = 16 };
+
+typedef struct {
+  results_format_t format;
+  char *data;
+  size_t length;
+  size_t capacity;
+  int depth;
+  // Whether the object or array at each depth has a member yet, so JSON knows
+  // to write a separator.
+  bool has_members[max_results_depth];
+  // Set if memory ran out or the nesting was unbalanced. The data is then
+  // incomplete.
+  bool failed;
+} results_writer_t;
+
+void init_results_writer(results_writer_t *writer, results_format_t format);
+// Frees the writer's data.
+void free_results_writer(results_writer_t *writer);
+// The MIME type of the writer's format.
+const char *results_content_type(const results_writer_t *writer);
+// Returns the format the given Accept header prefers: CBOR if it names
+// application/cbor with a q value above 0 and at least that of JSON,
+// otherwise JSON. Accepts NULL.
+results_format_t negotiate_results_format(const char *accept_header);
+
+void results_begin_object(results_writer_t *writer, const char *key);
+void results_end_object(results_writer_t *writer);
+void results_begin_array(results_writer_t *writer, const char *key);
+void results_end_array(results_writer_t *writer);
+void results_int(results_writer_t *writer, const char *key, int64_t value);
+// Values that aren't finite are written as null.
+void results_double(results_writer_t *writer, const char *key, double value);
+void results_bool(results_writer_t *writer, const char *key, bool value);
+void results_string(results_writer_t *writer, const char *key,
+                    const char *value);
+void results_null(results_writer_t *writer, const char *key);
+
+// Writes an array of doubles. If counts is not NULL, values whose count is
+// zero were never measured, and are written as null.
+void results_double_array(results_writer_t *writer, const char *key,
+                          const double values[], const int counts[],
+                          int length);
+void results_int_array(results_writer_t *writer, const char *key,
+                       const int values[], int length);
+
+#endif  // WLB_RESULTS_WRITER_H_
@@ -35,11 +35,29 @@
 #endif
 #include <intrin.h>
 #define __sync_fetch_and_add _InterlockedExchangeAdd
+// _InterlockedExchangeAdd only adds to longs, which are 32 bits on Windows.
+#define fetch_and_add_64 _InterlockedExchangeAdd64
 // Ugh, MSVC doesn't have a sensible snprintf. sprintf_s is close, as long as
 // you don't care about the return value.
 #define snprintf sprintf_s
+#else
+#define fetch_and_add_64 __sync_fetch_and_add
 #endif
 
+// The per-session platform state: the connection to the display that
+// screenshots are taken from and input is sent to, and the processes launched
+// on it. The functions below that take a context are safe to call from
+// different threads with different contexts. Each platform defines the struct.
+typedef struct platform_context_t platform_context_t;
+
+// Connects to the named display, or the default display if display_name is
+// NULL. Platforms with a single display ignore the name. Returns NULL on
+// failure.
+platform_context_t *create_platform_context(const char *display_name);
+// Closes any windows and processes the context opened, closes its display
+// connection and frees it. Accepts NULL.
+void destroy_platform_context(platform_context_t *context);
+
 typedef struct {
     uint32_t width, height;    // The size of the image in pixels.
     uint32_t stride;           // The distance between rows in memory, in bytes.
@@ -55,25 +73,35 @@ typedef struct {
 // may take a long time to acquire (100+ milliseconds), but small screenshots
 // should be fast (< 16 milliseconds).
 // May return NULL if taking a screenshot fails.
-screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
-                            uint32_t height);
+screenshot *take_screenshot(platform_context_t *context, uint32_t x,
+                            uint32_t y, uint32_t width, uint32_t height);
 void free_screenshot(screenshot *screenshot);
+// Returns the name of the method take_screenshot currently uses.
+const char *get_screenshot_backend(platform_context_t *context);
+// Makes take_screenshot use a method that costs less per screenshot than the
+// current one, for when screenshots are too slow to measure latency. Returns
+// false if the platform has no cheaper method left.
+bool use_cheaper_screenshot_backend(platform_context_t *context);
 
 // Sends key down and key up events to the foreground window for the named key.
 // Returns true on success, false on failure.
-bool send_keystroke_b();
-bool send_keystroke_t();
-bool send_keystroke_w();
-bool send_keystroke_z();
+bool send_keystroke_b(platform_context_t *context);
+bool send_keystroke_t(platform_context_t *context);
+bool send_keystroke_w(platform_context_t *context);
+bool send_keystroke_z(platform_context_t *context);
 
 // Warps the mouse to the given point and sends a mousewheel scroll down event.
 // Returns true on success, false on failure.
-bool send_scroll_down(int x, int y);
+bool send_scroll_down(platform_context_t *context, int x, int y);
 
 // Returns the number of nanoseconds elapsed relative to some fixed point in the
 // past. The point to which this duration is relative does not change during the
-// lifetime of the process, but can change between different processes.
+// lifetime of the process, but can change between different processes. The
+// clock is monotonic and is not adjusted by changes to the system time. Safe to
+// call from any thread.
 int64_t get_nanoseconds();
+// Returns a description of the clock get_nanoseconds reads.
+const char *get_clock_source();
 static const int64_t nanoseconds_per_millisecond = 1000000;
 static const int64_t nanoseconds_per_second =
     nanoseconds_per_millisecond * 1000;
@@ -88,19 +116,21 @@ int usleep(unsigned int microseconds);
 
 // Opens a new window/tab in the system's default browser.
 // Returns true on success, false on failure.
-bool open_browser(const char *program, const char *args, const char *url);
-bool close_browser();
+bool open_browser(platform_context_t *context, const char *program,
+                  const char *args, const char *url);
+bool close_browser(platform_context_t *context);
 
 // Opens a test window that will respond to mouse and keyboard events in the
 // same way as a browser displaying the test page. Running the benchmark with
 // this test window will establish the best possible score achievable on a given
 // system.
 // Returns true on success, false on failure.
-bool open_native_reference_window(uint8_t *test_pattern);
-bool close_native_reference_window();
+bool open_native_reference_window(platform_context_t *context,
+                                  uint8_t *test_pattern);
+bool close_native_reference_window(platform_context_t *context);
 
 // The number of pixels in the pattern that encodes the data from the test window.
-static const int pattern_pixels = 8;
+static const int pattern_pixels = 12;
 static const int pattern_bytes = pattern_pixels * 4;
 // The "magic" part of the pattern uniquely identifies the test window on the screen.
 static const int pattern_magic_pixels = 4;
@@ -112,4 +142,34 @@ static const int data_bytes = data_pixels * 3;
 // encoded as hexadecimal digits (omitting the alpha bytes).
 static const int hex_pattern_length = pattern_magic_pixels * 3 * 2;
 
+// The positions of the data pixels in the pattern. Pixels drawn by the test
+// window's script each hold a 24-bit counter, least significant byte in the
+// blue channel, so that counters don't wrap during a test.
+static const int javascript_frames_pixel = 4;
+static const int key_down_events_pixel = 5;
+// The test mode is in the blue channel of this pixel. The green channel echoes
+// the identities of the last four keys pressed, two bits each, most recent in
+// the low bits (see key_identity_t in latency-benchmark.h).
+static const int test_mode_pixel = 6;
+// The high bits of the scroll position in device pixels, divided by 256.
+static const int scroll_position_high_pixel = 7;
+// The remaining pixels are drawn by the browser's compositor as grey levels
+// read from a gradient image, so each carries only 8 bits. The low byte of the
+// scroll position is the part of the page background visible at this pixel.
+static const int scroll_position_pixel = 8;
+// The CSS animation frame counter, split across three animated images that
+// move at 1, 1/256 and 1/65536 pixels per frame.
+static const int css_frames_pixel = 9;
+static const int css_frames_mid_pixel = 10;
+static const int css_frames_high_pixel = 11;
+// The test window may also draw up to max_probe_strips (see
+// latency-benchmark.h) probe strips further down the window, each a copy of
+// the pixels drawn by its script, from the magic pattern through the scroll
+// position high bits, starting in the same column as the pattern. They are
+// read in the same screenshot as the pattern, to see how each frame's update
+// travels down the window.
+static const int probe_strip_pixels = 8;
+// Counters encoded in the pattern wrap at this value.
+static const int pattern_counter_modulus = 1 << 24;
+
 #endif  // WLB_SCREENSCRAPER_H_
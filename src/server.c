@@ -23,6 +23,8 @@
 #include <limits.h>
 #include "screenscraper.h"
 #include "latency-benchmark.h"
+#include "results-writer.h"
+#include "header-list.h"
 #include "../third_party/mongoose/mongoose.h"
 #include "oculus.h"
 #include "clioptions.h"
@@ -35,62 +37,983 @@
 // Serve files from the ./html directory.
 char *document_root = "html";
 struct mg_context *mongoose = NULL;
+// If not NULL, each test writes a trace to a file named with this prefix and
+// the test's number. Set from the -t command line option.
+static const char *trace_file_prefix = NULL;
+// If set, each key down test is preceded by a floor calibration against the
+// native reference window.
+static bool calibrate_floor = false;
+// If not 0, the seed of every test that doesn't specify its own. Set from the
+// -s command line option.
+static uint64_t test_seed = 0;
+// The number of tests that have been traced, updated with atomic increment
+// instructions.
+static volatile long traced_tests = 0;
 
-// Runs a latency test and reports the results as JSON written to the given
-// connection.
+// The sessions of the tests that are running, so that the measurement thread
+// can step them and reports from the test pages can be routed to them. There
+// can't be more tests running than server threads. Guarded by
+// active_sessions_lock.
+enum { max_active_sessions = 32 };
+typedef struct {
+  latency_session_t *session;
+  // Set by the measurement thread once the session's test has ended, with
+  // atomic increment instructions.
+  volatile long finished;
+} active_session;
+static active_session active_sessions[max_active_sessions];
+static volatile long active_sessions_lock = 0;
+// Set to stop the measurement thread, which sets measurement_thread_stopped
+// when it has. Both are updated with atomic increment instructions.
+static volatile long stop_measurement_thread = 0;
+static volatile long measurement_thread_stopped = 0;
+// How long the measurement thread sleeps between looking for new tests when
+// none is running.
+static const int measurement_thread_idle_ms = 5;
+
+// A spin lock built on the one atomic instruction available on every platform.
+// It's only held for a few instructions at a time.
+static void lock_active_sessions() {
+  while (__sync_fetch_and_add(&active_sessions_lock, 1) != 0) {
+    __sync_fetch_and_add(&active_sessions_lock, -1);
+    usleep(0);
+  }
+}
+
+static void unlock_active_sessions() {
+  __sync_fetch_and_add(&active_sessions_lock, -1);
+}
+
+// Returns the slot the session was stored in, or -1 if all slots are taken.
+static int add_active_session(latency_session_t *session) {
+  int slot = -1;
+  lock_active_sessions();
+  for (int i = 0; i < max_active_sessions; i++) {
+    if (!active_sessions[i].session) {
+      active_sessions[i].session = session;
+      active_sessions[i].finished = 0;
+      slot = i;
+      break;
+    }
+  }
+  unlock_active_sessions();
+  return slot;
+}
+
+static void remove_active_session(int slot) {
+  if (slot < 0) {
+    return;
+  }
+  lock_active_sessions();
+  active_sessions[slot].session = NULL;
+  unlock_active_sessions();
+}
+
+// Runs the tests of all active sessions, so that a test waiting for its next
+// input event holds a timer instead of a thread. Sessions are stepped outside
+// the lock; a session's owner doesn't remove or free it until it's marked
+// finished, after which this thread no longer touches it.
+static void *measurement_thread(void *unused) {
+  latency_session_t *sessions[max_active_sessions];
+  int slots[max_active_sessions];
+  while (__sync_fetch_and_add(&stop_measurement_thread, 0) == 0) {
+    int num_sessions = 0;
+    lock_active_sessions();
+    for (int i = 0; i < max_active_sessions; i++) {
+      if (active_sessions[i].session && !active_sessions[i].finished) {
+        sessions[num_sessions] = active_sessions[i].session;
+        slots[num_sessions] = i;
+        num_sessions++;
+      }
+    }
+    unlock_active_sessions();
+    int64_t next_step_time = step_latency_tests(sessions, num_sessions);
+    for (int i = 0; i < num_sessions; i++) {
+      if (!latency_test_running(sessions[i])) {
+        __sync_fetch_and_add(&active_sessions[slots[i]].finished, 1);
+      }
+    }
+    if (next_step_time == 0) {
+      usleep(measurement_thread_idle_ms * 1000);
+    } else if (next_step_time > get_nanoseconds()) {
+      sleep_until(next_step_time);
+    } else {
+      usleep(0);
+    }
+  }
+  __sync_fetch_and_add(&measurement_thread_stopped, 1);
+  return NULL;
+}
+
+// Aggregates of every test the server has run, exposed in the Prometheus text
+// format at /metrics. They are cumulative since the server started, as
+// Prometheus expects; rate() and histogram_quantile() over a window give the
+// recent tests. Server threads update them with atomic increment instructions,
+// so neither tests nor scrapes take a lock.
+
+// Upper bounds of the histogram buckets, in milliseconds. Each histogram also
+// has a last, unbounded bucket.
+static const int latency_bucket_ms[] = {
+  5, 10, 15, 20, 30, 40, 50, 60, 80, 100, 150, 200, 300, 500, 1000,
+};
+enum { num_latency_buckets = 15 };
+static const int pause_bucket_ms[] = {
+  20, 50, 100, 200, 500, 1000, 2000, 5000,
+};
+enum { num_pause_buckets = 8 };
+static const int queue_wait_bucket_ms[] = {
+  100, 1000, 5000, 10000, 30000, 60000, 120000, 300000,
+};
+enum { num_queue_wait_buckets = 8 };
+enum { max_metric_buckets = 16 };
+
+// Each observation is counted in the first bucket whose bound it doesn't
+// exceed. The sum is kept in tenths of a millisecond, so that it too can be
+// updated with atomic increments. A long would overflow after about 60 hours
+// of summed latency where longs are 32 bits, so the sum is 64 bits.
+typedef struct {
+  volatile long buckets[max_metric_buckets + 1];
+  volatile int64_t sum_tenths_ms;
+} metric_histogram;
+
+static metric_histogram key_down_latency_metric;
+static metric_histogram scroll_latency_metric;
+static metric_histogram capture_interval_metric;
+// The longest pause of each animation in each pause time test.
+enum { PAUSE_JAVASCRIPT, PAUSE_CSS, PAUSE_SCROLL, num_pause_kinds };
+static const char *pause_kind_names[num_pause_kinds] = {
+  "javascript", "css", "scroll",
+};
+static metric_histogram pause_time_metrics[num_pause_kinds];
+// How long each test waited for the tests ahead of it to finish.
+static metric_histogram queue_wait_metric;
+
+static volatile long tests_running_metric = 0;
+static volatile long tests_queued_metric = 0;
+static volatile long tests_succeeded_metric = 0;
+static volatile long tests_failed_metric = 0;
+static volatile long samples_recorded_metric = 0;
+static volatile long samples_dropped_slow_screenshot_metric = 0;
+static volatile long samples_dropped_no_prior_screenshot_metric = 0;
+static volatile long wide_bound_samples_metric = 0;
+static volatile long key_down_events_dropped_metric = 0;
+static volatile long key_down_events_coalesced_metric = 0;
+
+static void add_to_histogram_sum(metric_histogram *metric, double sum_ms) {
+  fetch_and_add_64(&metric->sum_tenths_ms, (int64_t)(sum_ms * 10 + 0.5));
+}
+
+static void observe_metric(metric_histogram *metric, const int bounds_ms[],
+                           int num_bounds, double value_ms) {
+  int bucket = 0;
+  while (bucket < num_bounds && value_ms > bounds_ms[bucket]) {
+    bucket++;
+  }
+  __sync_fetch_and_add(&metric->buckets[bucket], 1);
+  add_to_histogram_sum(metric, value_ms);
+}
+
+// Key down and scroll latency samples are observed at the midpoint of their
+// bounds.
+static void observe_samples(metric_histogram *metric,
+                            const latency_sample_bounds_t *samples) {
+  for (int i = 0; i < samples->count; i++) {
+    observe_metric(metric, latency_bucket_ms, num_latency_buckets,
+        (samples->lower_ms[i] + samples->upper_ms[i]) / 2);
+  }
+}
+
+// Adds a test that ran to the metrics. Failed tests count their quality
+// counters, which often explain the failure, but not their partial results.
+static void record_test_metrics(const latency_results_t *results,
+                                bool succeeded) {
+  const measurement_quality_t *quality = &results->quality;
+  __sync_fetch_and_add(succeeded ? &tests_succeeded_metric :
+                       &tests_failed_metric, 1);
+  __sync_fetch_and_add(&samples_recorded_metric, quality->samples_recorded);
+  __sync_fetch_and_add(&samples_dropped_slow_screenshot_metric,
+                       quality->samples_dropped_slow_screenshot);
+  __sync_fetch_and_add(&samples_dropped_no_prior_screenshot_metric,
+                       quality->samples_dropped_no_prior_screenshot);
+  __sync_fetch_and_add(&wide_bound_samples_metric,
+                       quality->wide_bound_samples);
+  // The capture interval histogram's bins are the metric's buckets.
+  long intervals = 0;
+  for (int i = 0; i < capture_histogram_bins; i++) {
+    intervals += quality->capture_interval_histogram[i];
+  }
+  for (int i = 0; i < capture_histogram_bins; i++) {
+    __sync_fetch_and_add(&capture_interval_metric.buckets[i],
+                         quality->capture_interval_histogram[i]);
+  }
+  add_to_histogram_sum(&capture_interval_metric,
+                       results->mean_capture_interval_ms * intervals);
+  if (!succeeded) {
+    return;
+  }
+  __sync_fetch_and_add(&key_down_events_dropped_metric,
+                       results->key_down_events_dropped);
+  __sync_fetch_and_add(&key_down_events_coalesced_metric,
+                       results->key_down_events_coalesced);
+  observe_samples(&key_down_latency_metric, &results->key_down_sample_bounds);
+  observe_samples(&scroll_latency_metric, &results->scroll_sample_bounds);
+  const double pauses_ms[num_pause_kinds] = {
+    results->max_js_pause_time_ms,
+    results->max_css_pause_time_ms,
+    results->max_scroll_pause_time_ms,
+  };
+  for (int i = 0; i < num_pause_kinds; i++) {
+    if (pauses_ms[i] > 0) {
+      observe_metric(&pause_time_metrics[i], pause_bucket_ms,
+          num_pause_buckets, pauses_ms[i]);
+    }
+  }
+}
+
+// Writes the HELP and TYPE lines of a metric.
+static void print_metric_header(struct mg_connection *connection,
+    const char *name, const char *type, const char *help) {
+  mg_printf(connection, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+            type);
+}
+
+// Writes the value of a counter or gauge. labels may be empty.
+static void print_metric_value(struct mg_connection *connection,
+    const char *name, const char *labels, volatile long *value) {
+  mg_printf(connection, "%s%s%s%s %ld\n", name, *labels ? "{" : "", labels,
+            *labels ? "}" : "", __sync_fetch_and_add(value, 0));
+}
+
+// Writes the samples of a histogram in seconds. labels, if not empty, are
+// written before the bucket bound, e.g. kind="css".
+static void print_histogram_metric(struct mg_connection *connection,
+    const char *name, const char *labels, const int bounds_ms[],
+    int num_bounds, metric_histogram *metric) {
+  const char *separator = *labels ? "," : "";
+  long count = 0;
+  for (int i = 0; i <= num_bounds; i++) {
+    count += __sync_fetch_and_add(&metric->buckets[i], 0);
+    if (i < num_bounds) {
+      mg_printf(connection, "%s_bucket{%s%sle=\"%g\"} %ld\n", name, labels,
+                separator, bounds_ms[i] / 1000.0, count);
+    } else {
+      mg_printf(connection, "%s_bucket{%s%sle=\"+Inf\"} %ld\n", name, labels,
+                separator, count);
+    }
+  }
+  const char *open = *labels ? "{" : "";
+  const char *close = *labels ? "}" : "";
+  mg_printf(connection, "%s_sum%s%s%s %.4f\n", name, open, labels, close,
+            fetch_and_add_64(&metric->sum_tenths_ms, 0) / 10000.0);
+  mg_printf(connection, "%s_count%s%s%s %ld\n", name, open, labels, close,
+            count);
+}
+
+// Answers a scrape of /metrics.
+static void report_metrics(struct mg_connection *connection) {
+  mg_printf(connection, "HTTP/1.1 200 OK\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+  print_metric_header(connection, "latency_benchmark_tests_running", "gauge",
+      "Latency tests running now.");
+  print_metric_value(connection, "latency_benchmark_tests_running", "",
+      &tests_running_metric);
+  print_metric_header(connection, "latency_benchmark_tests_queued", "gauge",
+      "Latency tests waiting for their turn on the display.");
+  print_metric_value(connection, "latency_benchmark_tests_queued", "",
+      &tests_queued_metric);
+  print_metric_header(connection, "latency_benchmark_queue_wait_seconds",
+      "histogram", "Time each test waited for the tests ahead of it.");
+  print_histogram_metric(connection, "latency_benchmark_queue_wait_seconds",
+      "", queue_wait_bucket_ms, num_queue_wait_buckets, &queue_wait_metric);
+  print_metric_header(connection, "latency_benchmark_tests_total", "counter",
+      "Latency tests that ran, by result.");
+  print_metric_value(connection, "latency_benchmark_tests_total",
+      "result=\"succeeded\"", &tests_succeeded_metric);
+  print_metric_value(connection, "latency_benchmark_tests_total",
+      "result=\"failed\"", &tests_failed_metric);
+  print_metric_header(connection, "latency_benchmark_samples_recorded_total",
+      "counter", "Latency samples recorded.");
+  print_metric_value(connection, "latency_benchmark_samples_recorded_total",
+      "", &samples_recorded_metric);
+  print_metric_header(connection, "latency_benchmark_samples_dropped_total",
+      "counter", "Latency samples dropped for lack of good screenshots, by "
+      "reason.");
+  print_metric_value(connection, "latency_benchmark_samples_dropped_total",
+      "reason=\"slow_screenshot\"", &samples_dropped_slow_screenshot_metric);
+  print_metric_value(connection, "latency_benchmark_samples_dropped_total",
+      "reason=\"no_prior_screenshot\"",
+      &samples_dropped_no_prior_screenshot_metric);
+  print_metric_header(connection, "latency_benchmark_wide_bound_samples_total",
+      "counter", "Latency samples recorded with unusually wide bounds.");
+  print_metric_value(connection,
+      "latency_benchmark_wide_bound_samples_total", "",
+      &wide_bound_samples_metric);
+  print_metric_header(connection, "latency_benchmark_key_down_events_total",
+      "counter", "Key down events the page never saw or saw together, by "
+      "fate.");
+  print_metric_value(connection, "latency_benchmark_key_down_events_total",
+      "fate=\"dropped\"", &key_down_events_dropped_metric);
+  print_metric_value(connection, "latency_benchmark_key_down_events_total",
+      "fate=\"coalesced\"", &key_down_events_coalesced_metric);
+  print_metric_header(connection,
+      "latency_benchmark_capture_interval_seconds", "histogram",
+      "Time between consecutive screenshots.");
+  int capture_bounds_ms[capture_histogram_bins - 1];
+  for (int i = 0; i < capture_histogram_bins - 1; i++) {
+    capture_bounds_ms[i] = (i + 1) * capture_histogram_bin_ms;
+  }
+  print_histogram_metric(connection,
+      "latency_benchmark_capture_interval_seconds", "", capture_bounds_ms,
+      capture_histogram_bins - 1, &capture_interval_metric);
+  print_metric_header(connection, "latency_benchmark_key_down_latency_seconds",
+      "histogram", "Key down latency samples, at the midpoint of their "
+      "bounds.");
+  print_histogram_metric(connection,
+      "latency_benchmark_key_down_latency_seconds", "", latency_bucket_ms,
+      num_latency_buckets, &key_down_latency_metric);
+  print_metric_header(connection, "latency_benchmark_scroll_latency_seconds",
+      "histogram", "Scroll latency samples, at the midpoint of their bounds.");
+  print_histogram_metric(connection,
+      "latency_benchmark_scroll_latency_seconds", "", latency_bucket_ms,
+      num_latency_buckets, &scroll_latency_metric);
+  print_metric_header(connection, "latency_benchmark_max_pause_time_seconds",
+      "histogram", "The longest pause of each animation in each pause time "
+      "test, by animation.");
+  for (int i = 0; i < num_pause_kinds; i++) {
+    char labels[32];
+    snprintf(labels, sizeof(labels), "kind=\"%s\"", pause_kind_names[i]);
+    print_histogram_metric(connection,
+        "latency_benchmark_max_pause_time_seconds", labels, pause_bucket_ms,
+        num_pause_buckets, &pause_time_metrics[i]);
+  }
+}
+
+// Tests take turns on a display, in the order they were requested, since two
+// tests at once would each send input events to whichever window has focus and
+// ruin each other's results. Each test takes a ticket and waits for its number
+// to be served. Tickets are taken and served with atomic increment
+// instructions. Every test runs on the default display, so there's one queue.
+typedef struct {
+  volatile long next_ticket;
+  volatile long now_serving;
+} display_queue;
+static display_queue default_display_queue;
+
+// A test's place in a display queue.
+typedef struct {
+  display_queue *queue;
+  long ticket;
+  // The tests ahead of this one when it joined the queue, including the one
+  // running then.
+  int tests_ahead;
+  int64_t join_time;
+  // How long the test waited for its turn, once it got it.
+  double wait_ms;
+} test_job;
+
+// Returns the number of tests still ahead of the job, 0 once it's its turn.
+static int tests_ahead_of_job(const test_job *job) {
+  return (int)(job->ticket -
+      __sync_fetch_and_add(&job->queue->now_serving, 0));
+}
+
+// Ends the job's turn, letting the next test in the queue run.
+static void leave_display_queue(test_job *job) {
+  __sync_fetch_and_add(&job->queue->now_serving, 1);
+}
+
+// Writes the given latency percentiles as an object keyed by percentile, e.g.
+// { "50": 31.5, "90": 40.2, "99": 52.0 }.
+static void write_percentiles(results_writer_t *writer, const char *key,
+    const double percentiles_ms[]) {
+  results_begin_object(writer, key);
+  for (int i = 0; i < num_latency_percentiles; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", latency_percentiles[i]);
+    results_double(writer, name, percentiles_ms[i]);
+  }
+  results_end_object(writer);
+}
+
+// Writes the bounds of every sample of a latency as an object holding an
+// array of lower bounds and an array of upper bounds.
+static void write_sample_bounds(results_writer_t *writer, const char *key,
+    const latency_sample_bounds_t *samples) {
+  results_begin_object(writer, key);
+  results_double_array(writer, "lowerMs", samples->lower_ms, NULL,
+                       samples->count);
+  results_double_array(writer, "upperMs", samples->upper_ms, NULL,
+                       samples->count);
+  results_end_object(writer);
+}
+
+// Writes the results of the input throughput test as an array with one object
+// per swept rate.
+static void write_throughput(results_writer_t *writer, const char *key,
+    const latency_results_t *results) {
+  results_begin_array(writer, key);
+  for (int i = 0; i < results->num_throughput_steps; i++) {
+    const throughput_step_results_t *step = &results->throughput[i];
+    results_begin_object(writer, NULL);
+    results_int(writer, "rate", step->target_rate);
+    results_double(writer, "sentRate", step->sent_rate);
+    results_double(writer, "receivedRate", step->received_rate);
+    results_double(writer, "meanLatencyMs", step->mean_latency_ms);
+    results_double(writer, "latencyGrowthMsPerS",
+                   step->latency_growth_ms_per_s);
+    results_double(writer, "meanOutstanding", step->mean_outstanding);
+    results_int(writer, "maxOutstanding", step->max_outstanding);
+    results_int(writer, "sent", step->events_sent);
+    results_int(writer, "lost", step->events_lost);
+    results_int(writer, "dropped", step->events_dropped);
+    results_int(writer, "coalesced", step->events_coalesced);
+    results_end_object(writer);
+  }
+  results_end_array(writer);
+}
+
+// Writes the frame intervals of one animation in the pause time test.
+static void write_frame_intervals(results_writer_t *writer, const char *key,
+    const frame_intervals_t *intervals) {
+  results_begin_object(writer, key);
+  results_int(writer, "frames", intervals->frames);
+  results_double(writer, "meanIntervalMs", intervals->mean_interval_ms);
+  results_double(writer, "intervalStddevMs", intervals->interval_stddev_ms);
+  results_double(writer, "quantizationStddevMs",
+                 intervals->quantization_stddev_ms);
+  results_int(writer, "droppedFrames", intervals->dropped_frames);
+  results_int(writer, "histogramBinMs", frame_histogram_bin_ms);
+  results_int_array(writer, "histogram", intervals->histogram,
+                    frame_histogram_bins);
+  results_end_object(writer);
+}
+
+// Writes the mean scroll trajectory.
+static void write_scroll_trajectory(results_writer_t *writer,
+    const char *key, const scroll_trajectory_t *trajectory) {
+  results_begin_object(writer, key);
+  results_int(writer, "scrolls", trajectory->scrolls);
+  results_double(writer, "timeToFirstMovementMs",
+                 trajectory->time_to_first_movement_ms);
+  results_double(writer, "animationDurationMs",
+                 trajectory->animation_duration_ms);
+  results_double(writer, "frames", trajectory->frames);
+  results_double(writer, "distancePixels", trajectory->distance_pixels);
+  results_int(writer, "profileBinMs", scroll_profile_bin_ms);
+  results_double_array(writer, "velocityPixelsPerS",
+                       trajectory->velocity_pixels_per_s, NULL,
+                       scroll_profile_bins);
+  results_end_object(writer);
+}
+
+// Writes the measurement quality report.
+static void write_quality(results_writer_t *writer, const char *key,
+    const measurement_quality_t *quality) {
+  results_begin_object(writer, key);
+  results_bool(writer, "acceptable", quality->acceptable);
+  results_string(writer, "screenshotBackend",
+                 quality->screenshot_backend ? quality->screenshot_backend :
+                     "");
+  results_int(writer, "backendSwitches", quality->backend_switches);
+  results_int(writer, "samplesRecorded", quality->samples_recorded);
+  results_int(writer, "samplesDroppedSlowScreenshot",
+              quality->samples_dropped_slow_screenshot);
+  results_int(writer, "samplesDroppedNoPriorScreenshot",
+              quality->samples_dropped_no_prior_screenshot);
+  results_int(writer, "wideBoundSamples", quality->wide_bound_samples);
+  results_int(writer, "captureHistogramBinMs", capture_histogram_bin_ms);
+  results_int_array(writer, "captureIntervalHistogram",
+                    quality->capture_interval_histogram,
+                    capture_histogram_bins);
+  results_end_object(writer);
+}
+
+// Writes the results of a latency test, run with the given options after
+// waiting its turn as the given job, as one object.
+static void write_latency_results(results_writer_t *writer, const char *key,
+    const test_options_t *options, const test_job *job,
+    const latency_results_t *results) {
+  results_begin_object(writer, key);
+  results_double(writer, "keyDownLatencyMs", results->key_down_latency_ms);
+  results_double(writer, "scrollLatencyMs", results->scroll_latency_ms);
+  results_double(writer, "maxJSPauseTimeMs", results->max_js_pause_time_ms);
+  results_double(writer, "maxCssPauseTimeMs",
+                 results->max_css_pause_time_ms);
+  results_double(writer, "maxScrollPauseTimeMs",
+                 results->max_scroll_pause_time_ms);
+  results_double(writer, "refreshPeriodMs", results->refresh_period_ms);
+  results_double(writer, "meanCaptureIntervalMs",
+                 results->mean_capture_interval_ms);
+  results_double(writer, "keyDownEffectiveResolutionMs",
+                 results->key_down_effective_resolution_ms);
+  results_int(writer, "keyDownEventsDropped",
+              results->key_down_events_dropped);
+  results_int(writer, "keyDownEventsCoalesced",
+              results->key_down_events_coalesced);
+  results_int(writer, "keyDownEventsUnidentified",
+              results->key_down_events_unidentified);
+  results_double(writer, "keyDownInputToHandlerMs",
+                 results->key_down_input_to_handler_ms);
+  results_double(writer, "keyDownHandlerToPixelsMs",
+                 results->key_down_handler_to_pixels_ms);
+  results_int(writer, "keyDownHandlerSamples",
+              results->key_down_handler_samples);
+  results_double(writer, "clockSyncUncertaintyMs",
+                 results->clock_sync_uncertainty_ms);
+  results_double_array(writer, "keyDownLatencyByPhaseMs",
+                       results->key_down_latency_by_phase_ms,
+                       results->key_down_samples_by_phase,
+                       refresh_phase_bins);
+  write_percentiles(writer, "keyDownLatencyPercentilesMs",
+                    results->key_down_latency_percentiles_ms);
+  write_percentiles(writer, "scrollLatencyPercentilesMs",
+                    results->scroll_latency_percentiles_ms);
+  results_double(writer, "keyDownLatencyStddevMs",
+                 results->key_down_latency_stddev_ms);
+  results_int(writer, "keyDownSamples", results->key_down_samples);
+  if (results->key_down_during_scroll_samples > 0) {
+    results_double(writer, "keyDownDuringScrollLatencyMs",
+                   results->key_down_during_scroll_latency_ms);
+    write_percentiles(writer, "keyDownDuringScrollLatencyPercentilesMs",
+                      results->key_down_during_scroll_latency_percentiles_ms);
+    results_int(writer, "keyDownDuringScrollSamples",
+                results->key_down_during_scroll_samples);
+  }
+  // A string, since JavaScript numbers can't hold every 64-bit seed.
+  char seed[32];
+  snprintf(seed, sizeof(seed), "%llu", (unsigned long long)results->seed);
+  results_string(writer, "seed", seed);
+  if (results->floor_samples > 0) {
+    results_double(writer, "floorLatencyMs", results->floor_latency_ms);
+    results_double(writer, "floorStddevMs", results->floor_stddev_ms);
+    results_int(writer, "floorSamples", results->floor_samples);
+    results_double(writer, "keyDownLatencyAboveFloorMs",
+                   results->key_down_latency_above_floor_ms);
+    results_double(writer, "keyDownStddevAboveFloorMs",
+                   results->key_down_stddev_above_floor_ms);
+  }
+  if (results->num_probe_strips > 0) {
+    results_int(writer, "tearEvents", results->tear_events);
+    results_int(writer, "probeScreenshots", results->probe_screenshots);
+    results_int_array(writer, "probeStripRows", results->probe_strip_rows,
+                      results->num_probe_strips);
+    results_double_array(writer, "probeStripOffsetMs",
+                         results->probe_strip_offset_ms,
+                         results->probe_strip_samples,
+                         results->num_probe_strips);
+  }
+  results_int(writer, "saturationRate", results->saturation_rate);
+  write_throughput(writer, "throughput", results);
+  write_scroll_trajectory(writer, "scrollTrajectory",
+                          &results->scroll_trajectory);
+  write_frame_intervals(writer, "jsFrameIntervals",
+                        &results->js_frame_intervals);
+  write_frame_intervals(writer, "cssFrameIntervals",
+                        &results->css_frame_intervals);
+  write_frame_intervals(writer, "scrollFrameIntervals",
+                        &results->scroll_frame_intervals);
+  write_sample_bounds(writer, "keyDownSampleBounds",
+                      &results->key_down_sample_bounds);
+  write_sample_bounds(writer, "scrollSampleBounds",
+                      &results->scroll_sample_bounds);
+  write_quality(writer, "quality", &results->quality);
+  results_begin_object(writer, "metadata");
+  results_string(writer, "clockSource", get_clock_source());
+  results_int(writer, "equivalentTimePhases",
+              options->equivalent_time_phases);
+  results_bool(writer, "calibrateFloor", options->calibrate_floor);
+  results_int_array(writer, "inputRates", options->input_rates,
+                    options->num_input_rates);
+  results_begin_object(writer, "queue");
+  results_int(writer, "testsAhead", job->tests_ahead);
+  results_double(writer, "waitMs", job->wait_ms);
+  results_end_object(writer);
+  results_end_object(writer);
+  results_end_object(writer);
+}
+
+// A streamed test sends an update at least this often, even when it has no
+// new samples, so that a client that went away is noticed.
+static const int stream_update_interval_ms = 250;
+// Live samples are copied out of the session in batches this big, which must
+// fit on the stack of a server thread.
+enum { stream_sample_batch = 64 };
+
+// The last event of a stream whose results couldn't be written. It is fixed,
+// so sending it needs no memory.
+static const char stream_out_of_memory_event[] =
+    "{\"event\":\"error\",\"error\":\"Out of memory writing results.\"}";
+
+// Sends the given JSON to the connection as one chunk of a chunked response,
+// on a line of its own. Returns false if the connection was closed.
+static bool write_stream_line(struct mg_connection *connection,
+                              const char *json, size_t length) {
+  char size[32];
+  snprintf(size, sizeof(size), "%lx\r\n", (unsigned long)length + 1);
+  return mg_write(connection, size, strlen(size)) > 0 &&
+      mg_write(connection, json, length) > 0 &&
+      mg_write(connection, "\n\r\n", 3) > 0;
+}
+
+// Sends the writer's JSON as with write_stream_line. Updates that ran out of
+// memory are skipped, since a later one supersedes them. Returns false if the
+// connection was closed.
+static bool write_stream_chunk(struct mg_connection *connection,
+    const results_writer_t *writer) {
+  if (writer->failed) {
+    return true;
+  }
+  return write_stream_line(connection, writer->data, writer->length);
+}
+
+// Sends the samples the session's test recorded since *cursor and its
+// progress, if there are new samples or the last update was sent before
+// *next_update_time. Returns false if the connection was closed.
+static bool stream_test_update(struct mg_connection *connection,
+    latency_session_t *session, long *cursor, int64_t *next_update_time) {
+  live_sample_t samples[stream_sample_batch];
+  int missed;
+  int count = read_live_samples(session, cursor, samples,
+      stream_sample_batch, &missed);
+  if (count == 0 && missed == 0 && get_nanoseconds() < *next_update_time) {
+    return true;
+  }
+  latency_progress_t progress;
+  get_latency_progress(session, &progress);
+  results_writer_t writer;
+  init_results_writer(&writer, RESULTS_FORMAT_JSON);
+  results_begin_object(&writer, NULL);
+  results_string(&writer, "event", "progress");
+  results_string(&writer, "phase", progress.phase);
+  results_int(&writer, "testMode", progress.test_mode);
+  results_double(&writer, "elapsedMs", progress.elapsed_ms);
+  results_int(&writer, "screenshots", progress.screenshots);
+  results_int(&writer, "keyDownMeasurements",
+              progress.key_down_measurements);
+  results_int(&writer, "keyDownMeasurementsTarget",
+              progress.key_down_measurements_target);
+  results_int(&writer, "scrollMeasurements", progress.scroll_measurements);
+  write_quality(&writer, "quality", &progress.quality);
+  results_begin_array(&writer, "samples");
+  int total_missed = missed;
+  while (count > 0) {
+    for (int i = 0; i < count; i++) {
+      results_begin_object(&writer, NULL);
+      results_string(&writer, "statistic", samples[i].statistic);
+      results_double(&writer, "timeMs", samples[i].time_ms);
+      results_double(&writer, "lowerMs", samples[i].lower_ms);
+      results_double(&writer, "upperMs", samples[i].upper_ms);
+      results_end_object(&writer);
+    }
+    count = read_live_samples(session, cursor, samples, stream_sample_batch,
+        &missed);
+    total_missed += missed;
+  }
+  results_end_array(&writer);
+  results_int(&writer, "missedSamples", total_missed);
+  results_end_object(&writer);
+  bool written = write_stream_chunk(connection, &writer);
+  free_results_writer(&writer);
+  *next_update_time = get_nanoseconds() +
+      stream_update_interval_ms * nanoseconds_per_millisecond;
+  return written;
+}
+
+// Joins the display's queue and waits for the job's turn. A streamed test
+// reports its place in the queue while it waits. Returns false if the
+// streaming client went away meanwhile. Either way, the job has the display
+// until it leaves the queue.
+static bool wait_for_turn(struct mg_connection *connection,
+    display_queue *queue, bool stream, test_job *job) {
+  job->queue = queue;
+  job->ticket = __sync_fetch_and_add(&queue->next_ticket, 1);
+  job->join_time = get_nanoseconds();
+  job->tests_ahead = tests_ahead_of_job(job);
+  __sync_fetch_and_add(&tests_queued_metric, 1);
+  if (job->tests_ahead > 0) {
+    debug_log("Waiting for %d tests to finish before this one.",
+        job->tests_ahead);
+  }
+  bool connected = true;
+  int64_t next_update_time = 0;
+  int tests_ahead;
+  while ((tests_ahead = tests_ahead_of_job(job)) > 0) {
+    if (stream && connected && get_nanoseconds() >= next_update_time) {
+      results_writer_t writer;
+      init_results_writer(&writer, RESULTS_FORMAT_JSON);
+      results_begin_object(&writer, NULL);
+      results_string(&writer, "event", "queued");
+      results_int(&writer, "testsAhead", tests_ahead);
+      results_double(&writer, "waitedMs",
+          (get_nanoseconds() - job->join_time) /
+              (double)nanoseconds_per_millisecond);
+      results_end_object(&writer);
+      connected = write_stream_chunk(connection, &writer);
+      free_results_writer(&writer);
+      if (!connected) {
+        debug_log("Streaming client went away while its test was queued.");
+      }
+      next_update_time = get_nanoseconds() +
+          stream_update_interval_ms * nanoseconds_per_millisecond;
+    }
+    usleep(10 * 1000);
+  }
+  __sync_fetch_and_add(&tests_queued_metric, -1);
+  job->wait_ms = (get_nanoseconds() - job->join_time) /
+      (double)nanoseconds_per_millisecond;
+  observe_metric(&queue_wait_metric, queue_wait_bucket_ms,
+      num_queue_wait_buckets, job->wait_ms);
+  return connected;
+}
+
+// Runs a latency test whose turn on the display has come, streaming its
+// progress to the connection if stream is set. Returns true if the test
+// succeeded and filled in results. Otherwise fills in the error parameter and
+// returns false.
+static bool run_latency_test(struct mg_connection *connection,
+    const uint8_t magic_pattern[], const test_options_t *options, bool stream,
+    latency_results_t *results, char **error) {
+  // Each test gets its own session, so tests don't share a display connection
+  // or state with each other.
+  latency_session_t *session = create_latency_session(NULL);
+  if (!session) {
+    *error = "Failed to connect to the display.";
+    return false;
+  }
+  bool measured = begin_latency_test(session, magic_pattern, options,
+      results, error);
+  if (measured) {
+    __sync_fetch_and_add(&tests_running_metric, 1);
+    // The measurement thread runs the test. This thread only has to hold
+    // the connection until it's done.
+    int slot = add_active_session(session);
+    if (slot < 0) {
+      debug_log("Too many tests running; running this one on its own "
+          "thread and ignoring its handler time reports.");
+      run_latency_tests(&session, 1);
+    } else {
+      long cursor = 0;
+      int64_t next_update_time = 0;
+      bool connected = stream;
+      while (__sync_fetch_and_add(&active_sessions[slot].finished, 0) == 0) {
+        if (connected && !stream_test_update(connection, session, &cursor,
+                &next_update_time)) {
+          debug_log("Streaming client went away; cancelling its test.");
+          cancel_latency_test(session);
+          connected = false;
+        }
+        usleep(10 * 1000);
+      }
+      remove_active_session(slot);
+      if (connected) {
+        next_update_time = 0;
+        stream_test_update(connection, session, &cursor, &next_update_time);
+      }
+    }
+    measured = latency_test_succeeded(session, error);
+    __sync_fetch_and_add(&tests_running_metric, -1);
+  }
+  destroy_latency_session(session);
+  return measured;
+}
+
+// Runs a latency test and reports the results to the given connection, as
+// JSON or, if the request's Accept header asks for it, CBOR. The test waits
+// in the display's queue for the tests requested before it to finish. If
+// reference_window_pattern isn't NULL, a native reference window showing that
+// pattern is opened once the test's turn comes, and closed after the test.
+//
+// A streamed test instead answers at once with a chunked response of JSON
+// objects, one per line. While the test waits for its turn, "queued" events
+// carry the number of tests ahead of it. While it runs, "progress" events
+// carry its progress, quality counters and the samples recorded since the
+// last event. The last line is a "results" event holding the results, or an
+// "error" event. Closing the connection cancels the test.
 static void report_latency(struct mg_connection *connection,
-    const uint8_t magic_pattern[]) {
-  double key_down_latency_ms = 0;
-  double scroll_latency_ms = 0;
-  double max_js_pause_time_ms = 0;
-  double max_css_pause_time_ms = 0;
-  double max_scroll_pause_time_ms = 0;
+    const uint8_t magic_pattern[], const test_options_t *options,
+    bool stream, uint8_t *reference_window_pattern) {
+  test_options_t run_options = *options;
+  run_options.calibrate_floor = calibrate_floor;
+  if (run_options.seed == 0) {
+    run_options.seed = test_seed;
+  }
+  char trace_path[2048];
+  if (trace_file_prefix) {
+    long test_number = __sync_fetch_and_add(&traced_tests, 1) + 1;
+    snprintf(trace_path, sizeof(trace_path), "%s-%ld.json", trace_file_prefix,
+        test_number);
+    trace_path[sizeof(trace_path) - 1] = '\0';
+    run_options.trace_path = trace_path;
+    debug_log("writing trace to %s", trace_path);
+  }
+  if (stream) {
+    mg_printf(connection, "HTTP/1.1 200 OK\r\n"
+              "Access-Control-Allow-Origin: *\r\n"
+              "Cache-Control: no-cache\r\n"
+              "Content-Type: application/x-ndjson\r\n"
+              "Transfer-Encoding: chunked\r\n\r\n");
+  }
+  test_job job;
+  bool connected = wait_for_turn(connection, &default_display_queue, stream,
+      &job);
+  latency_results_t *results = NULL;
   char *error = "Unknown error.";
-  if (!measure_latency(magic_pattern,
-                       &key_down_latency_ms,
-                       &scroll_latency_ms,
-                       &max_js_pause_time_ms,
-                       &max_css_pause_time_ms,
-                       &max_scroll_pause_time_ms,
-                       &error)) {
+  bool measured = false;
+  if (!connected) {
+    error = "The client went away while the test was queued.";
+  } else {
+    platform_context_t *window_platform = NULL;
+    if (reference_window_pattern) {
+      window_platform = create_platform_context(NULL);
+      if (window_platform) {
+        open_native_reference_window(window_platform,
+            reference_window_pattern);
+      }
+    }
+    // Too big for the stack of a server thread.
+    results = (latency_results_t *)calloc(1, sizeof(latency_results_t));
+    if (!results) {
+      error = "Out of memory.";
+    } else {
+      measured = run_latency_test(connection, magic_pattern, &run_options,
+          stream, results, &error);
+      record_test_metrics(results, measured);
+    }
+    destroy_platform_context(window_platform);
+  }
+  leave_display_queue(&job);
+  if (stream) {
+    // The headers were sent before the test was queued.
+    results_writer_t writer;
+    init_results_writer(&writer, RESULTS_FORMAT_JSON);
+    results_begin_object(&writer, NULL);
+    if (measured) {
+      results_string(&writer, "event", "results");
+      write_latency_results(&writer, "results", &run_options, &job, results);
+    } else {
+      debug_log("latency test reported error: %s", error);
+      results_string(&writer, "event", "error");
+      results_string(&writer, "error", error);
+    }
+    results_end_object(&writer);
+    if (writer.failed) {
+      // The stream must still end with an event saying how the test ended.
+      debug_log("Out of memory writing streamed results.");
+      write_stream_line(connection, stream_out_of_memory_event,
+                        sizeof(stream_out_of_memory_event) - 1);
+    } else {
+      write_stream_chunk(connection, &writer);
+    }
+    mg_printf(connection, "0\r\n\r\n");
+    free_results_writer(&writer);
+  } else if (!measured) {
     // Report generic error.
-    debug_log("measure_latency reported error: %s", error);
+    debug_log("latency test reported error: %s", error);
     mg_printf(connection, "HTTP/1.1 500 Internal Server Error\r\n"
               "Access-Control-Allow-Origin: *\r\n"
               "Content-Type: text/plain\r\n\r\n"
               "%s", error);
   } else {
-    // Send the measured latency information back as JSON.
-    mg_printf(connection, "HTTP/1.1 200 OK\r\n"
-              "Access-Control-Allow-Origin: *\r\n"
-              "Cache-Control: no-cache\r\n"
-              "Content-Type: text/plain\r\n\r\n"
-              "{ \"keyDownLatencyMs\": %f, "
-              "\"scrollLatencyMs\": %f, "
-              "\"maxJSPauseTimeMs\": %f, "
-              "\"maxCssPauseTimeMs\": %f, "
-              "\"maxScrollPauseTimeMs\": %f}",
-              key_down_latency_ms,
-              scroll_latency_ms,
-              max_js_pause_time_ms,
-              max_css_pause_time_ms,
-              max_scroll_pause_time_ms);
+    results_writer_t writer;
+    init_results_writer(&writer,
+        negotiate_results_format(mg_get_header(connection, "Accept")));
+    write_latency_results(&writer, NULL, &run_options, &job, results);
+    if (writer.failed) {
+      mg_printf(connection, "HTTP/1.1 500 Internal Server Error\r\n"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Content-Type: text/plain\r\n\r\n"
+                "Out of memory writing results.");
+    } else {
+      mg_printf(connection, "HTTP/1.1 200 OK\r\n"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Cache-Control: no-cache\r\n"
+                "Vary: Accept\r\n"
+                "Content-Type: %s\r\n"
+                "Content-Length: %lu\r\n\r\n",
+                results_content_type(&writer), (unsigned long)writer.length);
+      mg_write(connection, writer.data, writer.length);
+    }
+    free_results_writer(&writer);
+  }
+  free(results);
+}
+
+// Parses a comma separated list of key down rates for the input throughput
+// test. Returns false if the list is malformed.
+static bool parse_input_rates(const char *list, test_options_t *options) {
+  options->num_input_rates = 0;
+  while (*list) {
+    char *end;
+    long rate = strtol(list, &end, 10);
+    if (end == list || rate <= 0 || rate > 100000 ||
+        options->num_input_rates == max_input_rates) {
+      return false;
+    }
+    options->input_rates[options->num_input_rates++] = (int)rate;
+    list = end;
+    if (*list == ',') {
+      list++;
+    } else if (*list) {
+      return false;
+    }
   }
+  return options->num_input_rates > 0;
 }
 
 // If the given request is a latency test request that specifies a valid
 // pattern, returns true and fills in the given array with the pattern specified
-// in the request's URL.
+// in the request's URL, options with any test options it specifies, and
+// *out_stream with whether it asks for the test to be streamed.
 static bool is_latency_test_request(const struct mg_request_info *request_info,
-    uint8_t magic_pattern[]) {
+    uint8_t magic_pattern[], test_options_t *options, bool *out_stream) {
   assert(magic_pattern);
+  assert(options);
+  memset(options, 0, sizeof(test_options_t));
+  *out_stream = false;
   // A valid test request will have the path /test and must specify a magic
   // pattern in the magicPattern query variable. The pattern is specified as a
   // string of hex digits and must be the exact length expected (3 bytes for
   // each pixel in the pattern).
   // Here is an example of a valid request:
   // http://localhost:5578/test?magicPattern=8a36052d02c596dfa4c80711
+  // The input throughput test optionally takes the rates to sweep, e.g.
+  // &inputRates=10,100,1000
+  // The key down test optionally uses equivalent-time sampling with the given
+  // number of offsets, e.g. &equivalentTimePhases=16
+  // Any test can be given the seed of an earlier one to repeat its schedule of
+  // input events, e.g. &seed=1234. The seed is a string in the results, since
+  // it may not fit in a JavaScript number.
+  // With &stream=1 the test's samples and progress are streamed while it runs;
+  // see report_latency.
   if (strcmp(request_info->uri, "/test") == 0) {
+    const char *query = request_info->query_string;
+    char stream[4];
+    if (query && mg_get_var(query, strlen(query), "stream", stream,
+            sizeof(stream)) > 0) {
+      *out_stream = strcmp(stream, "1") == 0;
+    }
+    char input_rates[512];
+    if (query && mg_get_var(query, strlen(query), "inputRates", input_rates,
+            sizeof(input_rates)) > 0 &&
+        !parse_input_rates(input_rates, options)) {
+      return false;
+    }
+    char phases[16];
+    if (query && mg_get_var(query, strlen(query), "equivalentTimePhases",
+            phases, sizeof(phases)) > 0) {
+      options->equivalent_time_phases = atoi(phases);
+      if (options->equivalent_time_phases < 0 ||
+          options->equivalent_time_phases > 1000) {
+        return false;
+      }
+    }
+    char seed[32];
+    if (query && mg_get_var(query, strlen(query), "seed", seed,
+            sizeof(seed)) > 0 &&
+        !parse_seed(seed, &options->seed)) {
+      return false;
+    }
     char hex_pattern[hex_pattern_length + 1];
     if (hex_pattern_length == mg_get_var(
             request_info->query_string,
@@ -104,50 +1027,154 @@ static bool is_latency_test_request(const struct mg_request_info *request_info,
   return false;
 }
 
-// This function is defined in the file generated by files-to-c-arrays.py
-const char *get_file(const char *path, size_t *out_size);
+// Handles a report of the times at which the test page's key down handler ran,
+// e.g. /handlerTimes?magicPattern=...&first=12&uncertainty=0.05&times=1.5,2.25
+// The times are in milliseconds on the server's clock, converted by the page
+// using /clockSync, and belong to consecutive key down events numbered by the
+// page's key down counter starting at first. Returns false if the request is
+// malformed.
+static bool record_handler_times_request(
+    const struct mg_request_info *request_info) {
+  const char *query = request_info->query_string;
+  if (!query) {
+    return false;
+  }
+  size_t query_length = strlen(query);
+  char hex_pattern[hex_pattern_length + 1];
+  uint8_t magic_pattern[pattern_magic_bytes];
+  char first[32];
+  char uncertainty[32];
+  char list[8192];
+  if (mg_get_var(query, query_length, "magicPattern", hex_pattern,
+          sizeof(hex_pattern)) != hex_pattern_length ||
+      !parse_hex_magic_pattern(hex_pattern, magic_pattern) ||
+      mg_get_var(query, query_length, "first", first, sizeof(first)) <= 0 ||
+      mg_get_var(query, query_length, "uncertainty", uncertainty,
+          sizeof(uncertainty)) <= 0 ||
+      mg_get_var(query, query_length, "times", list, sizeof(list)) <= 0) {
+    return false;
+  }
+  // The page's key down counter wraps like the pattern's.
+  char *first_end;
+  long first_key_down = strtol(first, &first_end, 10);
+  if (first_end == first || *first_end ||
+      first_key_down < 0 || first_key_down >= pattern_counter_modulus) {
+    return false;
+  }
+  const int max_times = 1024;
+  int64_t times[max_times];
+  int count = 0;
+  const char *next = list;
+  while (*next && count < max_times) {
+    char *end;
+    double time_ms = strtod(next, &end);
+    if (end == next) {
+      return false;
+    }
+    times[count++] = (int64_t)(time_ms * nanoseconds_per_millisecond);
+    next = *end == ',' ? end + 1 : end;
+  }
+  // Only the session running the test with this pattern accepts the report.
+  lock_active_sessions();
+  for (int i = 0; i < max_active_sessions; i++) {
+    if (active_sessions[i].session &&
+        record_page_handler_times(active_sessions[i].session, magic_pattern,
+            (int)first_key_down, times, count, atof(uncertainty))) {
+      break;
+    }
+  }
+  unlock_active_sessions();
+  return true;
+}
+
+// This function is defined in the file generated by files-to-c-arrays.py. It
+// returns the complete HTTP response, headers included, that serves the
+// embedded file at the given URI, gzip-encoded if gzip is nonzero and the file
+// has a gzip variant, and that response's ETag. Returns NULL if there is no
+// such file.
+const char *get_asset_response(const char *uri, int gzip, size_t *out_size,
+                               const char **out_etag);
+
+static const char not_found_response[] = "HTTP/1.1 404 Not Found\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Content-Type: text/plain; charset=utf-8\r\n"
+    "Content-Length: 25\r\n"
+    "Connection: close\r\n\r\n"
+    "Error 404: File not found";
+
+// Returns true if the token starting at the given position of a header list
+// ends there, at a comma, or at its parameters.
+static bool ends_header_token(const char *end) {
+  while (*end == ' ' || *end == '\t') {
+    end++;
+  }
+  return *end == '\0' || *end == ',' || *end == ';';
+}
+
+// Returns true if the given Accept-Encoding header accepts gzip, i.e. lists it
+// without q=0. Accepts NULL.
+static bool accepts_gzip(const char *accept_encoding) {
+  return header_list_quality(accept_encoding, "gzip") > 0;
+}
+
+// Returns true if the given If-None-Match header names the given ETag, which
+// includes its quotes. Weak tags match too, as If-None-Match requires. Accepts
+// NULL.
+static bool etag_matches(const char *if_none_match, const char *etag) {
+  if (!if_none_match) {
+    return false;
+  }
+  size_t etag_length = strlen(etag);
+  for (const char *tag = if_none_match; *tag;) {
+    while (*tag == ' ' || *tag == '\t' || *tag == ',') {
+      tag++;
+    }
+    if (*tag == '*' && ends_header_token(tag + 1)) {
+      return true;
+    }
+    if (strncmp(tag, "W/", 2) == 0) {
+      tag += 2;
+    }
+    if (strncmp(tag, etag, etag_length) == 0 &&
+        ends_header_token(tag + etag_length)) {
+      return true;
+    }
+    const char *next = strchr(tag, ',');
+    if (!next) {
+      break;
+    }
+    tag = next;
+  }
+  return false;
+}
 
 // Satisfies the HTTP request from memory, or returns a 404 error. The
 // filesystem is never touched.
 // Ideally we'd use Mongoose's open_file callback override to implement file
 // serving from memory instead, but that method provides no way to disable
 // caching or display directory index documents.
+// The responses are built when the server is, so serving one is a single
+// lookup and a single write. They're sent gzip-encoded to browsers that accept
+// it. Browsers revalidate them on every use, and get a 304 if they already
+// have the same response.
 static void serve_file_from_memory_or_404(struct mg_connection *connection) {
   const struct mg_request_info *request_info = mg_get_request_info(connection);
-  const char *uri = request_info->uri;
-  // If the root of the server is requested, display the index instead.
-  if (strlen(uri) < 2) {
-    uri = "/index.html";
-  }
-  // Construct the file's full path relative to the document root.
-  const int max_path = 2048;
-  char file_path[max_path];
-  size_t path_length = strlen(uri) + strlen(document_root) + 1;
-  const char *file = NULL;
-  size_t file_size = 0;
-  if (path_length < max_path) {
-    snprintf(file_path, path_length, "%s%s", document_root, uri);
-    file = get_file(file_path, &file_size);
-  }
-  if (file) {
-    // We've located the file in memory. Serve it with headers to disable
-    // caching.
-    mg_printf(connection, "HTTP/1.1 200 OK\r\n"
-              "Cache-Control: no-cache\r\n"
-              "Content-Type: %s\r\n"
-              "Content-Length: %lu\r\n"
-              "Connection: close\r\n\r\n",
-              mg_get_builtin_mime_type(file_path),
-              file_size);
-    mg_write(connection, file, file_size);
-  } else {
+  size_t response_size = 0;
+  const char *etag = NULL;
+  const char *response = get_asset_response(request_info->uri,
+      accepts_gzip(mg_get_header(connection, "Accept-Encoding")),
+      &response_size, &etag);
+  if (!response) {
     // The file doesn't exist in memory.
-    mg_printf(connection, "HTTP/1.1 404 Not Found\r\n"
+    mg_write(connection, not_found_response, sizeof(not_found_response) - 1);
+  } else if (etag_matches(mg_get_header(connection, "If-None-Match"), etag)) {
+    mg_printf(connection, "HTTP/1.1 304 Not Modified\r\n"
               "Cache-Control: no-cache\r\n"
-              "Content-Type: text/plain; charset=utf-8\r\n"
-              "Content-Length: 25\r\n"
-              "Connection: close\r\n\r\n"
-              "Error 404: File not found");
+              "ETag: %s\r\n"
+              "Vary: Accept-Encoding\r\n"
+              "Connection: close\r\n\r\n", etag);
+  } else {
+    mg_write(connection, response, response_size);
   }
 }
 
@@ -160,11 +1187,14 @@ volatile long keep_alives = 0;
 static int mongoose_begin_request_callback(struct mg_connection *connection) {
   const struct mg_request_info *request_info = mg_get_request_info(connection);
   uint8_t magic_pattern[pattern_magic_bytes];
-  if (is_latency_test_request(request_info, magic_pattern)) {
+  test_options_t options;
+  bool stream;
+  if (is_latency_test_request(request_info, magic_pattern, &options,
+          &stream)) {
     // This is an XMLHTTPRequest made by JavaScript to measure latency in a
     // browser window. magic_pattern has been filled in with a pixel pattern to
     // look for.
-    report_latency(connection, magic_pattern);
+    report_latency(connection, magic_pattern, &options, stream, NULL);
     return 1;  // Mark as processed
   } else if (strcmp(request_info->uri, "/keepServerAlive") == 0) {
     __sync_fetch_and_add(&keep_alives, 1);
@@ -188,19 +1218,51 @@ static int mongoose_begin_request_callback(struct mg_connection *connection) {
     }
     __sync_fetch_and_add(&keep_alives, -1);
     return 1;
+  } else if (strcmp(request_info->uri, "/metrics") == 0) {
+    report_metrics(connection);
+    return 1;
+  } else if (strcmp(request_info->uri, "/clockSync") == 0) {
+    // The page estimates the offset between its clock and ours from the time
+    // we report and the round trip time of the request.
+    mg_printf(connection, "HTTP/1.1 200 OK\r\n"
+              "Access-Control-Allow-Origin: *\r\n"
+              "Cache-Control: no-cache\r\n"
+              "Content-Type: text/plain\r\n\r\n"
+              "%.3f", get_nanoseconds() / (double)nanoseconds_per_millisecond);
+    return 1;
+  } else if (strcmp(request_info->uri, "/handlerTimes") == 0) {
+    if (record_handler_times_request(request_info)) {
+      mg_printf(connection, "HTTP/1.1 200 OK\r\n"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Cache-Control: no-cache\r\n"
+                "Content-Type: text/plain\r\n\r\n");
+    } else {
+      mg_printf(connection, "HTTP/1.1 400 Bad Request\r\n"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Cache-Control: no-cache\r\n"
+                "Content-Type: text/plain\r\n\r\n"
+                "Malformed handler times.");
+    }
+    return 1;
   } else if(strcmp(request_info->uri, "/runControlTest") == 0) {
     uint8_t *test_pattern = (uint8_t *)malloc(pattern_bytes);
-    memset(test_pattern, 0, pattern_bytes);
-    for (int i = 0; i < pattern_magic_bytes; i++) {
-      test_pattern[i] = rand();
-    }
-    open_native_reference_window(test_pattern);
-    report_latency(connection, test_pattern);
-    close_native_reference_window();
+    // The window's pattern comes from the test's seed, so the whole control
+    // test can be repeated from its results.
+    memset(&options, 0, sizeof(options));
+    options.seed = test_seed ? test_seed : choose_random_seed();
+    random_pattern_from_seed(options.seed, test_pattern);
+    report_latency(connection, test_pattern, &options, false, test_pattern);
+    free(test_pattern);
     return 1;
   } else if (strcmp(request_info->uri, "/oculusLatencyTester") == 0) {
+    // The hardware test sends keystrokes too, so it takes its turn on the
+    // display like any other test.
+    test_job job;
+    wait_for_turn(connection, &default_display_queue, false, &job);
     const char *result_or_error = "Unknown error";
-    if (run_hardware_latency_test(&result_or_error)) {
+    bool succeeded = run_hardware_latency_test(&result_or_error);
+    leave_display_queue(&job);
+    if (succeeded) {
       debug_log("hardware latency test succeeded");
       mg_printf(connection, "HTTP/1.1 200 OK\r\n"
                 "Access-Control-Allow-Origin: *\r\n"
@@ -234,15 +1296,26 @@ static int mongoose_begin_request_callback(struct mg_connection *connection) {
 // This is the entry point called by main().
 void run_server(clioptions *opts) {
   assert(mongoose == NULL);
-  srand((unsigned int)time(NULL));
+  if (opts->benchmark_clock) {
+    clock_benchmark_results_t results;
+    benchmark_clock(&results);
+    char report[1024];
+    format_clock_benchmark(&results, report, sizeof(report));
+    printf("%s", report);
+    return;
+  }
   init_oculus();
+  trace_file_prefix = opts->trace_file_prefix;
+  calibrate_floor = opts->calibrate_floor;
+  test_seed = opts->seed;
   const char *options[] = {
     "listening_ports", "5578",
     "document_root", document_root,
     // Forbid everyone except localhost.
     "access_control_list", "-0.0.0.0/0,+127.0.0.0/8",
     // We have a lot of concurrent long-lived requests, so start a lot of
-    // threads to make sure we can handle them all.
+    // threads to make sure we can handle them all. A thread running a test
+    // only waits for the measurement thread, which does the work.
     "num_threads", "32",
     NULL
   };
@@ -256,6 +1329,10 @@ void run_server(clioptions *opts) {
     exit(1);
   }
   usleep(0);
+  if (mg_start_thread(measurement_thread, NULL) != 0) {
+    debug_log("Failed to start measurement thread.");
+    exit(1);
+  }
 
   char url[2048];
   char *baseurl = "http://localhost:5578/";
@@ -270,7 +1347,11 @@ void run_server(clioptions *opts) {
   }
   url[sizeof(url) - 1] = '\0';
 
-  if (!open_browser(opts->browser, opts->browser_args, url)) {
+  // The browser is launched on the default display, where tests look for it.
+  platform_context_t *browser_platform = create_platform_context(NULL);
+  if (!browser_platform ||
+      !open_browser(browser_platform, opts->browser, opts->browser_args,
+          url)) {
     debug_log("Failed to open browser.");
   }
   // Wait for an initial keep-alive connection to be established.
@@ -296,11 +1377,16 @@ void run_server(clioptions *opts) {
     }
   }
   mg_stop(mongoose);
+  __sync_fetch_and_add(&stop_measurement_thread, 1);
+  while (__sync_fetch_and_add(&measurement_thread_stopped, 0) == 0) {
+    usleep(1000);
+  }
 
-  if (opts->automated) {
+  if (opts->automated && browser_platform) {
     // NOTE: this only will work in automated mode where we fork and get the pid of the child process
-    close_browser();
+    close_browser(browser_platform);
   }
+  destroy_platform_context(browser_platform);
 
   mongoose = NULL;
 }
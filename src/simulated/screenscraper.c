@@ -0,0 +1,566 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "simulated-display.h"
+#include <stdint.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WINDOWS
+// latency-benchmark.c draws the native reference window with OpenGL.
+#pragma comment(lib, "opengl32.lib")
+#endif
+
+// The simulated screen is just big enough to hold the test pattern and its
+// probe strips away from its edges, so that finding the pattern exercises the
+// search.
+static const uint32_t screen_width = 64;
+static const uint32_t screen_height = 40;
+static const uint32_t pattern_x = 17;
+static const uint32_t pattern_y = 2;
+// Probe strips are drawn this many rows apart below the pattern.
+static const uint32_t probe_strip_spacing = 8;
+static const uint8_t background_grey = 0xcc;
+// Each read of the virtual clock advances it by this much, as reading a real
+// clock takes time. This also lets code that spins on the clock make progress.
+static const int64_t clock_read_ns = 25;
+// How far the page scrolls for each scroll event.
+static const int scroll_step_pixels = 100;
+// A session waits this long after a scroll's last frame for it to settle, and
+// keeps the key downs sent until then out of its key down results.
+static const double scroll_settle_ms = 100;
+static const double pi = 3.14159265358979323846;
+
+// pattern_magic_bytes isn't a constant expression in C.
+enum { max_simulated_events = 4096, magic_pattern_capacity = 16 };
+// Missed frames are only simulated for this many refreshes after the display
+// is configured, which is over 7 minutes at 144 Hz.
+enum { max_simulated_refreshes = 65536 };
+
+// An input event the page received, and when its response is first shown.
+typedef struct {
+  int64_t send_time;
+  int64_t shown_time;
+  int identity;  // The key_identity_t of a key down event.
+  bool slowed;   // Whether contention delayed it.
+} simulated_event;
+
+typedef struct {
+  simulated_event events[max_simulated_events];
+  int count;
+} simulated_events;
+
+struct platform_context_t {
+  int unused;
+};
+
+static simulated_display_config_t config;
+static uint8_t magic_pattern[magic_pattern_capacity];
+// The virtual clock. It starts well after 0, which measurement_t uses to mean
+// no screenshot.
+static int64_t now = nanoseconds_per_second;
+// When the display was configured. Vblanks are counted from here.
+static int64_t start_time;
+static uint64_t random_state;
+// Missed frames are drawn from their own sequence, so that they don't change
+// the delays and capture times of a given seed.
+static uint64_t frame_random_state;
+// The number of frames the page has drawn by each refresh, if it misses any.
+static int drawn_frames[max_simulated_refreshes];
+static simulated_events key_downs;
+static simulated_events scrolls;
+static bool debug_log_enabled = false;
+
+// SplitMix64, as in latency-benchmark.c.
+static uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Returns a value uniformly distributed in (0, 1).
+static double random_fraction_from(uint64_t *state) {
+  return ((next_random(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double random_fraction() {
+  return random_fraction_from(&random_state);
+}
+
+static int64_t milliseconds_to_nanoseconds(double milliseconds) {
+  return (int64_t)(milliseconds * nanoseconds_per_millisecond);
+}
+
+static double nanoseconds_to_milliseconds(int64_t nanoseconds) {
+  return nanoseconds / (double)nanoseconds_per_millisecond;
+}
+
+static int64_t draw_page_delay() {
+  double delay_ms = config.delay_a_ms;
+  if (config.delay == SIMULATED_DELAY_UNIFORM) {
+    delay_ms = config.delay_a_ms +
+        (config.delay_b_ms - config.delay_a_ms) * random_fraction();
+  } else if (config.delay == SIMULATED_DELAY_LOG_NORMAL) {
+    // Box-Muller.
+    double normal = sqrt(-2 * log(random_fraction())) *
+        cos(2 * pi * random_fraction());
+    delay_ms = config.delay_a_ms * exp(config.delay_b_ms * normal);
+  }
+  return milliseconds_to_nanoseconds(delay_ms);
+}
+
+static int64_t refresh_period() {
+  return milliseconds_to_nanoseconds(config.refresh_period_ms);
+}
+
+// The number of vblanks since the display was configured, at the given time.
+static int frames_at(int64_t time) {
+  return (int)((time - start_time) / refresh_period());
+}
+
+// The number of frames the page has drawn since the display was configured,
+// at the given time.
+static int drawn_frames_at(int64_t time) {
+  int refreshes = frames_at(time);
+  if (config.missed_frame_fraction <= 0 || refreshes < 0) {
+    return refreshes;
+  }
+  if (refreshes >= max_simulated_refreshes) {
+    return drawn_frames[max_simulated_refreshes - 1] + refreshes -
+        (max_simulated_refreshes - 1);
+  }
+  return drawn_frames[refreshes];
+}
+
+static test_mode_t test_mode_at(int64_t time) {
+  if (config.test_mode == TEST_MODE_PAUSE_TIME &&
+      time - start_time >=
+          milliseconds_to_nanoseconds(config.pause_time_test_ms)) {
+    return TEST_MODE_PAUSE_TIME_TEST_FINISHED;
+  }
+  return config.test_mode;
+}
+
+// Whether the latest of the given events is still waiting for its response
+// to be shown, or is a scroll still being animated, at the given time.
+static bool busy_at(const simulated_events *events, int64_t time) {
+  if (events->count == 0) {
+    return false;
+  }
+  const simulated_event *latest = &events->events[events->count - 1];
+  int64_t end_time = latest->shown_time;
+  if (events == &scrolls && config.scroll_animation_frames > 1) {
+    end_time += (config.scroll_animation_frames - 1) * refresh_period();
+  }
+  return latest->send_time <= time && time < end_time;
+}
+
+// The page handles the event after a random delay, then draws its response,
+// which is shown at the next vblank. The page handles events in order, so
+// responses are shown in order too.
+static void send_event(simulated_events *events,
+                       const simulated_events *other_events, int identity) {
+  if (events->count >= max_simulated_events) {
+    return;
+  }
+  simulated_event *event = &events->events[events->count];
+  event->send_time = now;
+  event->identity = identity;
+  int64_t handled_time = now + draw_page_delay();
+  event->slowed = config.contention_delay_ms > 0 &&
+      busy_at(other_events, now);
+  if (event->slowed) {
+    handled_time += milliseconds_to_nanoseconds(config.contention_delay_ms);
+  }
+  event->shown_time =
+      start_time + (frames_at(handled_time) + 1) * refresh_period();
+  if (events->count > 0 &&
+      events->events[events->count - 1].shown_time > event->shown_time) {
+    event->shown_time = events->events[events->count - 1].shown_time;
+  }
+  events->count++;
+}
+
+static int events_shown_at(const simulated_events *events, int64_t time) {
+  int shown = 0;
+  while (shown < events->count && events->events[shown].shown_time <= time) {
+    shown++;
+  }
+  return shown;
+}
+
+// Each scroll starts moving at the vblank its response is shown, and moves an
+// equal share of its step each frame of its animation.
+static int scroll_position_at(int64_t time) {
+  int position = 0;
+  int shown = events_shown_at(&scrolls, time);
+  for (int i = 0; i < shown; i++) {
+    int frames = (int)((time - scrolls.events[i].shown_time) /
+        refresh_period()) + 1;
+    if (frames < config.scroll_animation_frames) {
+      position += scroll_step_pixels * frames / config.scroll_animation_frames;
+    } else {
+      position += scroll_step_pixels;
+    }
+  }
+  return position;
+}
+
+// Returns the probe strip at the given row of the screen, or -1 if there is
+// none.
+static int probe_strip_at_row(uint32_t row) {
+  if (row <= pattern_y || (row - pattern_y) % probe_strip_spacing != 0) {
+    return -1;
+  }
+  int strip = (int)((row - pattern_y) / probe_strip_spacing) - 1;
+  return strip < config.probe_strips ? strip : -1;
+}
+
+// How long after the pattern's row the given row shows each frame.
+static int64_t row_update_delay(uint32_t row) {
+  if (!config.rolling_update) {
+    return 0;
+  }
+  return refresh_period() * (int64_t)(row - pattern_y) / screen_height;
+}
+
+// Pixels are encoded the way the test page draws them. See screenscraper.h.
+static void write_value(uint8_t pixel[], int value) {
+  pixel[0] = value & 0xff;
+  pixel[1] = (value >> 8) & 0xff;
+  pixel[2] = (value >> 16) & 0xff;
+}
+
+static void write_grey(uint8_t pixel[], int value) {
+  pixel[0] = pixel[1] = pixel[2] = value & 0xff;
+}
+
+// Draws the test pattern as the page shows it at the given time.
+static void draw_pattern(int64_t time, uint8_t pattern[]) {
+  memset(pattern, 0xff, pattern_bytes);
+  memcpy(pattern, magic_pattern, pattern_magic_bytes);
+  int frames = drawn_frames_at(time) % pattern_counter_modulus;
+  int key_downs_shown = events_shown_at(&key_downs, time);
+  int identities = 0;
+  for (int i = 0; i < key_downs_shown; i++) {
+    identities = push_key_identity(identities,
+        (key_identity_t)key_downs.events[i].identity);
+  }
+  int scroll_position = scroll_position_at(time);
+  write_value(&pattern[javascript_frames_pixel * 4], frames);
+  write_value(&pattern[key_down_events_pixel * 4], key_downs_shown);
+  write_value(&pattern[test_mode_pixel * 4],
+      test_mode_at(time) | identities << 8);
+  write_value(&pattern[scroll_position_high_pixel * 4], scroll_position >> 8);
+  write_grey(&pattern[scroll_position_pixel * 4], scroll_position);
+  write_grey(&pattern[css_frames_pixel * 4], frames);
+  write_grey(&pattern[css_frames_mid_pixel * 4], frames >> 8);
+  write_grey(&pattern[css_frames_high_pixel * 4], frames >> 16);
+}
+
+void configure_simulated_display(const simulated_display_config_t *new_config,
+                                 const uint8_t new_magic_pattern[]) {
+  assert(pattern_magic_bytes <= magic_pattern_capacity);
+  assert(new_config->probe_strips <= simulated_max_probe_strips);
+  config = *new_config;
+  memcpy(magic_pattern, new_magic_pattern, pattern_magic_bytes);
+  random_state = config.seed;
+  key_downs.count = 0;
+  scrolls.count = 0;
+  // Start at a random point in the refresh interval.
+  start_time = now - (int64_t)(random_fraction() * refresh_period());
+  if (config.missed_frame_fraction > 0) {
+    frame_random_state = config.seed ^ 0x6a09e667f3bcc908ULL;
+    int drawn = 0;
+    for (int i = 0; i < max_simulated_refreshes; i++) {
+      if (i == 0 || random_fraction_from(&frame_random_state) >=
+                        config.missed_frame_fraction) {
+        drawn++;
+      }
+      // Refresh 0 is when the display was configured, so its frame isn't
+      // counted.
+      drawn_frames[i] = drawn - 1;
+    }
+  }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Whether a scroll was being handled, animated or settling at the given time.
+static bool during_scroll(int64_t time) {
+  for (int i = 0; i < scrolls.count; i++) {
+    int64_t end_time = scrolls.events[i].shown_time +
+        milliseconds_to_nanoseconds(scroll_settle_ms);
+    if (config.scroll_animation_frames > 1) {
+      end_time += (config.scroll_animation_frames - 1) * refresh_period();
+    }
+    if (scrolls.events[i].send_time <= time && time < end_time) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void compute_truth(const simulated_events *events,
+                          simulated_latency_truth_t *out) {
+  memset(out, 0, sizeof(simulated_latency_truth_t));
+  static double latencies[max_simulated_events];
+  int shown = events_shown_at(events, now);
+  int count = 0;
+  double sum = 0;
+  for (int i = 0; i < shown; i++) {
+    if (events->events[i].slowed ||
+        (events == &key_downs && during_scroll(events->events[i].send_time))) {
+      continue;
+    }
+    latencies[count] = nanoseconds_to_milliseconds(
+        events->events[i].shown_time - events->events[i].send_time);
+    sum += latencies[count];
+    count++;
+  }
+  out->samples = count;
+  if (count == 0) {
+    return;
+  }
+  out->mean_ms = sum / count;
+  double variance = 0;
+  for (int i = 0; i < count; i++) {
+    variance += (latencies[i] - out->mean_ms) * (latencies[i] - out->mean_ms);
+  }
+  out->stddev_ms = sqrt(variance / count);
+  qsort(latencies, count, sizeof(double), compare_doubles);
+  for (int i = 0; i < num_latency_percentiles; i++) {
+    // The smallest latency with at least the given fraction of latencies at or
+    // below it. This is the quantile of the empirical distribution, which the
+    // fitted distribution converges to as the capture interval shrinks.
+    // Interpolating between ranks instead would differ from it by up to the
+    // gap between two latencies, which in the tail is many milliseconds.
+    // The small offset keeps exact products like 0.9 * 50 from rounding up.
+    int rank = (int)ceil(latency_percentiles[i] / 100.0 * count - 1e-9) - 1;
+    out->percentiles_ms[i] = latencies[rank < 0 ? 0 : rank];
+  }
+}
+
+void get_simulated_ground_truth(simulated_latency_truth_t *out_key_down,
+                                simulated_latency_truth_t *out_scroll) {
+  compute_truth(&key_downs, out_key_down);
+  compute_truth(&scrolls, out_scroll);
+}
+
+void get_simulated_frame_truth(simulated_frame_truth_t *out) {
+  memset(out, 0, sizeof(simulated_frame_truth_t));
+  int64_t end_time = now;
+  if (config.test_mode == TEST_MODE_PAUSE_TIME) {
+    int64_t test_end = start_time +
+        milliseconds_to_nanoseconds(config.pause_time_test_ms);
+    if (test_end < end_time) {
+      end_time = test_end;
+    }
+  }
+  int refreshes = frames_at(end_time);
+  double sum = 0;
+  double squares_sum = 0;
+  int last_frame_refresh = 0;
+  for (int i = 1; i <= refreshes; i++) {
+    if (drawn_frames_at(start_time + i * refresh_period()) ==
+        drawn_frames_at(start_time + (i - 1) * refresh_period())) {
+      out->dropped_frames++;
+      continue;
+    }
+    double interval_ms = nanoseconds_to_milliseconds(
+        (i - last_frame_refresh) * refresh_period());
+    sum += interval_ms;
+    squares_sum += interval_ms * interval_ms;
+    out->frames++;
+    last_frame_refresh = i;
+  }
+  if (out->frames > 0) {
+    out->mean_interval_ms = sum / out->frames;
+    double variance = squares_sum / out->frames -
+        out->mean_interval_ms * out->mean_interval_ms;
+    out->interval_stddev_ms = variance > 0 ? sqrt(variance) : 0;
+  }
+}
+
+double get_simulated_probe_strip_offset_ms(int strip) {
+  return nanoseconds_to_milliseconds(row_update_delay(
+      pattern_y + (strip + 1) * probe_strip_spacing));
+}
+
+void set_simulated_debug_log(bool enabled) {
+  debug_log_enabled = enabled;
+}
+
+
+platform_context_t *create_platform_context(const char *display_name) {
+  platform_context_t *context =
+      (platform_context_t *)malloc(sizeof(platform_context_t));
+  if (context) {
+    memset(context, 0, sizeof(platform_context_t));
+  }
+  return context;
+}
+
+void destroy_platform_context(platform_context_t *context) {
+  free(context);
+}
+
+screenshot *take_screenshot(platform_context_t *context, uint32_t x,
+                            uint32_t y, uint32_t width, uint32_t height) {
+  if (x >= screen_width || y >= screen_height) {
+    return NULL;
+  }
+  if (width > screen_width - x) {
+    width = screen_width - x;
+  }
+  if (height > screen_height - y) {
+    height = screen_height - y;
+  }
+  // The screenshot shows the screen as it is when the capture finishes.
+  double capture_ms = config.capture_interval_ms +
+      config.capture_jitter_ms * (2 * random_fraction() - 1);
+  int64_t capture_time = milliseconds_to_nanoseconds(capture_ms);
+  now += capture_time > clock_read_ns ? capture_time : clock_read_ns;
+  uint8_t pattern[pattern_bytes];
+  uint8_t probe_pattern[pattern_bytes];
+  draw_pattern(now, pattern);
+  screenshot *shot = (screenshot *)malloc(sizeof(screenshot));
+  uint8_t *pixels = (uint8_t *)malloc(width * height * 4);
+  if (!shot || !pixels) {
+    free(shot);
+    free(pixels);
+    return NULL;
+  }
+  for (uint32_t row = 0; row < height; row++) {
+    int strip = probe_strip_at_row(y + row);
+    if (strip >= 0) {
+      draw_pattern(now - row_update_delay(y + row), probe_pattern);
+    }
+    for (uint32_t column = 0; column < width; column++) {
+      uint8_t *pixel = &pixels[(row * width + column) * 4];
+      uint32_t screen_x = x + column;
+      if (y + row == pattern_y && screen_x >= pattern_x &&
+          screen_x < pattern_x + pattern_pixels) {
+        memcpy(pixel, &pattern[(screen_x - pattern_x) * 4], 4);
+      } else if (strip >= 0 && screen_x >= pattern_x &&
+                 screen_x < pattern_x + probe_strip_pixels) {
+        memcpy(pixel, &probe_pattern[(screen_x - pattern_x) * 4], 4);
+      } else {
+        write_grey(pixel, background_grey);
+        pixel[3] = 0xff;
+      }
+    }
+  }
+  shot->width = width;
+  shot->height = height;
+  shot->stride = width * 4;
+  shot->pixels = pixels;
+  shot->time_nanoseconds = now;
+  shot->platform_specific_data = pixels;
+  return shot;
+}
+
+void free_screenshot(screenshot *shot) {
+  free(shot->platform_specific_data);
+  free(shot);
+}
+
+const char *get_screenshot_backend(platform_context_t *context) {
+  return "simulated";
+}
+
+bool use_cheaper_screenshot_backend(platform_context_t *context) {
+  return false;
+}
+
+bool send_keystroke_b(platform_context_t *context) {
+  send_event(&key_downs, &scrolls, KEY_IDENTITY_B);
+  return true;
+}
+
+bool send_keystroke_t(platform_context_t *context) {
+  send_event(&key_downs, &scrolls, KEY_IDENTITY_T);
+  return true;
+}
+
+bool send_keystroke_w(platform_context_t *context) {
+  send_event(&key_downs, &scrolls, KEY_IDENTITY_W);
+  return true;
+}
+
+bool send_keystroke_z(platform_context_t *context) {
+  send_event(&key_downs, &scrolls, KEY_IDENTITY_Z);
+  return true;
+}
+
+bool send_scroll_down(platform_context_t *context, int x, int y) {
+  send_event(&scrolls, &key_downs, 0);
+  return true;
+}
+
+int64_t get_nanoseconds() {
+  now += clock_read_ns;
+  return now;
+}
+
+const char *get_clock_source() {
+  return "simulated";
+}
+
+void debug_log(const char *message, ...) {
+  if (!debug_log_enabled) {
+    return;
+  }
+  va_list list;
+  va_start(list, message);
+  vprintf(message, list);
+  va_end(list);
+  putchar('\n');
+  fflush(stdout);
+}
+
+int usleep(unsigned int microseconds) {
+  now += (int64_t)microseconds * 1000;
+  return 0;
+}
+
+bool open_browser(platform_context_t *context, const char *program,
+                  const char *args, const char *url) {
+  return false;
+}
+
+bool close_browser(platform_context_t *context) {
+  return false;
+}
+
+// There is no native reference window, so floor calibration isn't simulated.
+bool open_native_reference_window(platform_context_t *context,
+                                  uint8_t *test_pattern) {
+  return false;
+}
+
+bool close_native_reference_window(platform_context_t *context) {
+  return false;
+}
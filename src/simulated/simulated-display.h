@@ -0,0 +1,112 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A simulated display for validating the latency estimators. It implements the
+// platform layer in screenscraper.h with a virtual clock and a simulated test
+// page that responds to input after a delay drawn from a known distribution,
+// so the real measurement code can be run against a known ground truth,
+// quickly and deterministically. There is one display, and it isn't thread
+// safe.
+
+#ifndef WLB_SIMULATED_DISPLAY_H_
+#define WLB_SIMULATED_DISPLAY_H_
+
+#include "../screenscraper.h"
+#include "../latency-benchmark.h"
+
+// The distributions the page's delay in handling input can be drawn from.
+typedef enum {
+  SIMULATED_DELAY_CONSTANT,    // Always delay_a_ms.
+  SIMULATED_DELAY_UNIFORM,     // Uniform between delay_a_ms and delay_b_ms.
+  SIMULATED_DELAY_LOG_NORMAL,  // Median delay_a_ms, log standard deviation
+                               // delay_b_ms.
+} simulated_delay_t;
+
+enum { simulated_max_probe_strips = 4 };
+
+typedef struct {
+  // What the page draws in the test mode pixel.
+  test_mode_t test_mode;
+  // The page handles each input event after a delay drawn from this
+  // distribution, and its response is shown at the first vblank after that.
+  simulated_delay_t delay;
+  double delay_a_ms;
+  double delay_b_ms;
+  double refresh_period_ms;
+  // Each scroll is animated over this many frames, or drawn at once if 0.
+  int scroll_animation_frames;
+  // The page handles an event this much later if it is sent while the latest
+  // event of the other kind is waiting for its response to be shown, or is a
+  // scroll still being animated, as if both competed for the page's thread.
+  double contention_delay_ms;
+  // The page draws this many probe strips below the pattern, at most
+  // simulated_max_probe_strips. If rolling_update is set, as without vsync,
+  // the screen is updated from the pattern's row down over one refresh period,
+  // so rows further down show each frame later.
+  int probe_strips;
+  bool rolling_update;
+  // Each screenshot takes capture_interval_ms, give or take up to
+  // capture_jitter_ms drawn uniformly.
+  double capture_interval_ms;
+  double capture_jitter_ms;
+  // For the pause time test, the page shows TEST_MODE_PAUSE_TIME for this
+  // long, then TEST_MODE_PAUSE_TIME_TEST_FINISHED.
+  double pause_time_test_ms;
+  // The page fails to draw each frame with this probability, so its frame
+  // counters skip that refresh.
+  double missed_frame_fraction;
+  // Seeds the delays, capture times and missed frames.
+  uint64_t seed;
+} simulated_display_config_t;
+
+// The true latency of the events sent since the display was configured, from
+// sending each event to the vblank that first showed the response.
+typedef struct {
+  int samples;
+  double mean_ms;
+  double stddev_ms;
+  double percentiles_ms[num_latency_percentiles];
+} simulated_latency_truth_t;
+
+// The true intervals between the frames the page drew during the pause time
+// test.
+typedef struct {
+  int frames;
+  double mean_interval_ms;
+  double interval_stddev_ms;
+  // Refreshes in which the page drew no frame.
+  int dropped_frames;
+} simulated_frame_truth_t;
+
+// Resets the simulated page to show the given magic pattern with all counters
+// at zero, responding to input as configured. The virtual clock keeps running.
+void configure_simulated_display(const simulated_display_config_t *config,
+                                 const uint8_t magic_pattern[]);
+// Reports the true latency of the key down and scroll events sent since the
+// display was configured whose responses have been shown, leaving out those
+// slowed by contention and, as a session does, the key downs sent while a
+// scroll was being handled, animated or settling.
+void get_simulated_ground_truth(simulated_latency_truth_t *out_key_down,
+                                simulated_latency_truth_t *out_scroll);
+// Reports the true frame intervals of the pause time test, up to now.
+void get_simulated_frame_truth(simulated_frame_truth_t *out);
+// Reports how long after the pattern the given probe strip shows each frame.
+double get_simulated_probe_strip_offset_ms(int strip);
+// Whether debug_log writes messages. Off by default, since the measurement code
+// logs every screenshot.
+void set_simulated_debug_log(bool enabled);
+
+#endif  // WLB_SIMULATED_DISPLAY_H_
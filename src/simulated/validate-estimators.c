@@ -0,0 +1,519 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the real latency tests against the simulated display over a sweep of
+// page delay distributions, capture rates and refresh rates, and reports how
+// far each estimate the tests report lies from the true latency of the events
+// they sent: its bias, the mean error, and the standard deviation of the error
+// across runs. The interval-censored fit is also checked on its own. Exits
+// with status 1 if any test fails or any estimate's bias exceeds its
+// tolerance. Run this before trusting a change to the estimators or to the way
+// screenshots are scheduled.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "simulated-display.h"
+#include "../interval-stats.h"
+
+// The kinds of test that are run against each simulated page.
+typedef struct {
+  const char *name;
+  test_mode_t test_mode;
+  int equivalent_time_phases;
+  int scroll_animation_frames;
+  int probe_strips;
+  bool rolling_update;
+  double missed_frame_fraction;
+  double contention_delay_ms;
+  // If not 0, the mean's bias must be within this many ms whatever the capture
+  // interval, in place of its usual tolerance.
+  double mean_tolerance_ms;
+} test_kind;
+static const test_kind test_kinds[] = {
+  { "key down", TEST_MODE_JAVASCRIPT_LATENCY, 0, 0, 0, false, 0, 0, 0 },
+  // Equivalent-time sampling spreads the screenshots evenly over the time
+  // after each event, so its mean should be close whatever the capture
+  // interval.
+  { "key down, equivalent-time", TEST_MODE_JAVASCRIPT_LATENCY, 8, 0, 0,
+    false, 0, 0, 0.5 },
+  { "key down, 3 probe strips, rolling update", TEST_MODE_JAVASCRIPT_LATENCY,
+    0, 0, 3, true, 0, 0, 0 },
+  { "scroll", TEST_MODE_SCROLL_LATENCY, 0, 0, 0, false, 0, 0, 0 },
+  { "scroll, animated over 8 frames", TEST_MODE_SCROLL_LATENCY, 0, 8, 0,
+    false, 0, 0, 0 },
+  { "pause time", TEST_MODE_PAUSE_TIME, 0, 0, 0, false, 0, 0, 0 },
+  { "pause time, 10% of frames missed", TEST_MODE_PAUSE_TIME, 0, 0, 0, false,
+    0.1, 0, 0 },
+  // A session's key down and scroll means are both checked. When scrolls slow
+  // the key downs sent while they animate, and key downs slow scrolls sent
+  // before they are answered, the means must still only cover events that
+  // weren't slowed.
+  { "session", TEST_MODE_SESSION, 0, 0, 0, false, 0, 0, 0 },
+  { "session, animated scrolls, 30 ms contention", TEST_MODE_SESSION, 0, 8,
+    0, false, 0, 30, 0 },
+};
+// How long the simulated page runs the pause time test.
+static const double pause_time_test_ms = 2000;
+
+typedef struct {
+  const char *name;
+  simulated_delay_t delay;
+  double delay_a_ms;
+  double delay_b_ms;
+} delay_kind;
+static const delay_kind delay_kinds[] = {
+  { "uniform 20-60 ms delay", SIMULATED_DELAY_UNIFORM, 20, 60 },
+  { "log-normal 40 ms median delay", SIMULATED_DELAY_LOG_NORMAL, 40, 0.5 },
+};
+
+static const double capture_intervals_ms[] = { 1, 4, 8, 16 };
+// Screenshot times vary by up to this fraction of the capture interval.
+static const double capture_jitter_fraction = 0.25;
+// A common refresh rate, and a fast one whose period is shorter than some of
+// the capture intervals.
+static const double refresh_rates_hz[] = { 60, 144 };
+static const int default_repetitions = 3;
+
+#define ARRAY_LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+typedef enum {
+  METRIC_MEAN,
+  METRIC_SCROLL_MEAN,
+  METRIC_P50,
+  METRIC_P90,
+  METRIC_P99,
+  METRIC_STDDEV,
+  METRIC_REFRESH_PERIOD,
+  METRIC_SCROLL_DURATION,
+  METRIC_SCROLL_FRAMES,
+  METRIC_PROBE_OFFSET,
+  METRIC_FRAME_INTERVAL,
+  METRIC_FRAME_STDDEV,
+  METRIC_DROPPED_FRAMES,
+  NUM_METRICS,
+} metric_t;
+static const char *metric_names[NUM_METRICS] = {
+  "mean", "scroll mean", "p50", "p90", "p99", "stddev", "refresh period",
+  "scroll duration", "scroll frames", "probe offset", "frame interval",
+  "frame stddev", "dropped %",
+};
+
+// How large each metric's bias may be. Samples only locate events to within a
+// capture interval, and the tail percentiles rest on a few samples, so the
+// tolerance is a fixed part plus a fraction of the capture interval.
+typedef struct {
+  double ms;
+  double capture_fraction;
+} tolerance;
+static const tolerance metric_tolerances[NUM_METRICS] = {
+  { 1, 0.2 },    // mean
+  { 1, 0.2 },    // scroll mean, of a session
+  { 2, 0.25 },   // p50
+  { 3, 0.5 },    // p90
+  { 5, 1 },      // p99
+  { 1, 0.25 },   // stddev
+  { 0.1, 0 },    // refresh period
+  { 1, 0.25 },   // scroll duration
+  { 0.5, 0 },    // scroll frames, in frames rather than ms
+  { 0.5, 0.1 },  // probe offset
+  { 0.2, 0 },    // frame interval
+  { 1, 0.1 },    // frame stddev
+  { 2, 0 },      // dropped %, of refreshes rather than ms
+};
+// The bias is only known to within its standard error, which shrinks with the
+// number of runs. A metric fails if its bias exceeds its tolerance by more than
+// this many standard errors, so that a few unlucky runs don't fail it.
+static const double allowed_standard_errors = 2;
+
+// The error of one metric over the runs of a scenario.
+typedef struct {
+  int runs;
+  double truth_sum;
+  double error_sum;
+  double error_squares_sum;
+} metric_errors;
+
+// Looks up a metric in the results of a test and the ground truth it should
+// match. Returns false if the test doesn't report the metric. A session's
+// metrics are of its key downs, except for the scroll mean.
+static bool get_metric(const test_kind *kind, metric_t metric,
+    const latency_results_t *results,
+    const simulated_latency_truth_t *key_down_truth,
+    const simulated_latency_truth_t *scroll_truth,
+    const simulated_frame_truth_t *frame_truth, double capture_interval_ms,
+    double refresh_period_ms, double *out_estimate, double *out_truth) {
+  bool scroll = kind->test_mode == TEST_MODE_SCROLL_LATENCY;
+  bool pause_time = kind->test_mode == TEST_MODE_PAUSE_TIME;
+  bool session = kind->test_mode == TEST_MODE_SESSION;
+  const simulated_latency_truth_t *truth =
+      scroll ? scroll_truth : key_down_truth;
+  const frame_intervals_t *frames = &results->js_frame_intervals;
+  int refreshes = frames->frames + frames->dropped_frames;
+  int true_refreshes = frame_truth->frames + frame_truth->dropped_frames;
+  // Frames a screenshot skips over can't be counted or timed, so these are
+  // only measured if screenshots are taken at least once a frame.
+  bool every_frame = capture_interval_ms <= refresh_period_ms;
+  // Missed frames are only told apart from a slower refresh if screenshots
+  // time single frames (see median_frame_interval_ms()), and lengthen the
+  // refresh period estimated from the page's frames.
+  bool missed_frames = kind->missed_frame_fraction > 0;
+  bool times_frames = 4 * capture_interval_ms < refresh_period_ms;
+  bool sees_every_frame = capture_interval_ms * (1 + capture_jitter_fraction) <
+      refresh_period_ms;
+  const double *percentiles = scroll ? results->scroll_latency_percentiles_ms :
+      results->key_down_latency_percentiles_ms;
+  switch (metric) {
+    case METRIC_MEAN:
+      *out_estimate = scroll ? results->scroll_latency_ms :
+          results->key_down_latency_ms;
+      *out_truth = truth->mean_ms;
+      return !pause_time;
+    case METRIC_SCROLL_MEAN:
+      *out_estimate = results->scroll_latency_ms;
+      *out_truth = scroll_truth->mean_ms;
+      return session;
+    case METRIC_P50:
+    case METRIC_P90:
+    case METRIC_P99:
+      *out_estimate = percentiles[metric - METRIC_P50];
+      *out_truth = truth->percentiles_ms[metric - METRIC_P50];
+      return !pause_time;
+    case METRIC_STDDEV:
+      *out_estimate = results->key_down_latency_stddev_ms;
+      *out_truth = truth->stddev_ms;
+      return !scroll && !pause_time;
+    case METRIC_REFRESH_PERIOD:
+      *out_estimate = results->refresh_period_ms;
+      *out_truth = refresh_period_ms;
+      return !missed_frames;
+    case METRIC_SCROLL_DURATION:
+      *out_estimate = results->scroll_trajectory.animation_duration_ms;
+      *out_truth = kind->scroll_animation_frames > 1 ?
+          (kind->scroll_animation_frames - 1) * refresh_period_ms : 0;
+      return scroll;
+    case METRIC_SCROLL_FRAMES:
+      // Not in ms, but errors are reported the same way.
+      *out_estimate = results->scroll_trajectory.frames;
+      *out_truth = kind->scroll_animation_frames > 1 ?
+          kind->scroll_animation_frames : 1;
+      return scroll && every_frame;
+    case METRIC_PROBE_OFFSET:
+      // The offset of the lowest strip, which is the largest.
+      if (kind->probe_strips == 0 || !every_frame ||
+          results->num_probe_strips != kind->probe_strips) {
+        return false;
+      }
+      *out_estimate =
+          results->probe_strip_offset_ms[kind->probe_strips - 1];
+      *out_truth = get_simulated_probe_strip_offset_ms(kind->probe_strips - 1);
+      return true;
+    case METRIC_FRAME_INTERVAL:
+      *out_estimate = frames->mean_interval_ms;
+      *out_truth = frame_truth->mean_interval_ms;
+      return pause_time;
+    case METRIC_FRAME_STDDEV:
+      *out_estimate = frames->interval_stddev_ms;
+      *out_truth = frame_truth->interval_stddev_ms;
+      return pause_time && (sees_every_frame || !missed_frames);
+    case METRIC_DROPPED_FRAMES:
+      // The test only sees part of the pause time test, so compare the
+      // fraction of refreshes dropped.
+      if (!pause_time || (missed_frames && !times_frames) ||
+          refreshes == 0 || true_refreshes == 0) {
+        return false;
+      }
+      *out_estimate = 100.0 * frames->dropped_frames / refreshes;
+      *out_truth = 100.0 * frame_truth->dropped_frames / true_refreshes;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Runs one scenario the given number of times and prints the error of each
+// metric. Seeds are taken from *seed in turn. Returns false if a run failed or
+// a metric's bias exceeded its tolerance.
+static bool run_scenario(latency_session_t *session, const test_kind *kind,
+    const delay_kind *delay, double capture_interval_ms,
+    double refresh_period_ms, int repetitions, uint64_t *seed, bool verbose) {
+  metric_errors errors[NUM_METRICS];
+  memset(errors, 0, sizeof(errors));
+  int failures = 0;
+  for (int run = 0; run < repetitions; run++) {
+    simulated_display_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.test_mode = kind->test_mode;
+    config.delay = delay->delay;
+    config.delay_a_ms = delay->delay_a_ms;
+    config.delay_b_ms = delay->delay_b_ms;
+    config.refresh_period_ms = refresh_period_ms;
+    config.scroll_animation_frames = kind->scroll_animation_frames;
+    config.contention_delay_ms = kind->contention_delay_ms;
+    config.probe_strips = kind->probe_strips;
+    config.rolling_update = kind->rolling_update;
+    config.pause_time_test_ms = pause_time_test_ms;
+    config.missed_frame_fraction = kind->missed_frame_fraction;
+    config.capture_interval_ms = capture_interval_ms;
+    config.capture_jitter_ms = capture_interval_ms * capture_jitter_fraction;
+    config.seed = (*seed)++;
+    uint8_t magic_pattern[pattern_bytes];
+    random_pattern_from_seed(config.seed, magic_pattern);
+    configure_simulated_display(&config, magic_pattern);
+
+    test_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.equivalent_time_phases = kind->equivalent_time_phases;
+    options.seed = config.seed;
+    latency_results_t results;
+    char *error = "Unknown error.";
+    if (!measure_latency(session, magic_pattern, &options, &results,
+            &error)) {
+      failures++;
+      if (verbose) {
+        printf("  run %d failed: %s\n", run, error);
+      }
+      continue;
+    }
+    simulated_latency_truth_t key_down_truth, scroll_truth;
+    get_simulated_ground_truth(&key_down_truth, &scroll_truth);
+    simulated_frame_truth_t frame_truth;
+    get_simulated_frame_truth(&frame_truth);
+    for (int i = 0; i < NUM_METRICS; i++) {
+      double estimate, true_value;
+      if (!get_metric(kind, (metric_t)i, &results, &key_down_truth,
+              &scroll_truth, &frame_truth, capture_interval_ms,
+              refresh_period_ms, &estimate, &true_value)) {
+        continue;
+      }
+      double error_ms = estimate - true_value;
+      errors[i].runs++;
+      errors[i].truth_sum += true_value;
+      errors[i].error_sum += error_ms;
+      errors[i].error_squares_sum += error_ms * error_ms;
+    }
+  }
+  printf("%s, %s, capture every %.1f +/- %.1f ms, %.0f Hz: %d runs, "
+         "%d failed\n", kind->name, delay->name, capture_interval_ms,
+         capture_interval_ms * capture_jitter_fraction,
+         1000 / refresh_period_ms, repetitions, failures);
+  printf("  %-16s %10s %10s %10s %10s\n", "metric", "truth ms", "bias ms",
+         "stddev ms", "allowed ms");
+  bool passed = failures == 0;
+  for (int i = 0; i < NUM_METRICS; i++) {
+    int runs = errors[i].runs;
+    if (runs == 0) {
+      continue;
+    }
+    double bias = errors[i].error_sum / runs;
+    double variance = errors[i].error_squares_sum / runs - bias * bias;
+    double stddev = variance > 0 ? sqrt(variance) : 0;
+    double allowed_ms = metric_tolerances[i].ms +
+        metric_tolerances[i].capture_fraction * capture_interval_ms;
+    if (i == METRIC_MEAN && kind->mean_tolerance_ms > 0) {
+      allowed_ms = kind->mean_tolerance_ms;
+    }
+    bool within_tolerance = fabs(bias) - allowed_standard_errors * stddev /
+        sqrt((double)runs) <= allowed_ms;
+    passed = passed && within_tolerance;
+    printf("  %-16s %10.2f %+10.2f %10.2f %10.2f%s\n", metric_names[i],
+           errors[i].truth_sum / runs, bias, stddev, allowed_ms,
+           within_tolerance ? "" : "  FAILED");
+  }
+  fflush(stdout);
+  return passed;
+}
+
+// The interval-censored fit is also checked on its own, where screenshots are
+// further apart than the latency is long: uniform 3-19 ms latencies seen by
+// screenshots every 16.7 ms. The percentiles of the samples' midpoints are
+// biased, and are reported alongside for comparison.
+static const double censored_latency_min_ms = 3;
+static const double censored_latency_max_ms = 19;
+static const double censored_capture_interval_ms = 1000 / 60.0;
+static const double censored_fit_allowed_ms = 1;
+static const double censored_percentiles[] = { 50, 90 };
+// A fit is much quicker than a test run and the error of one fit is large, so
+// the fit is repeated this many times per repetition.
+static const int censored_fits_per_repetition = 10;
+
+// SplitMix64, as in latency-benchmark.c.
+static double random_fraction(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return ((z >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Fits the distribution of max_censored_samples simulated samples the given
+// number of times, and prints the error of its percentiles and of the
+// midpoints' percentiles. Returns false if a fitted percentile's bias exceeds
+// censored_fit_allowed_ms.
+static bool check_censored_fit(int repetitions, uint64_t *seed) {
+  int fits = repetitions * censored_fits_per_repetition;
+  static double lower[max_censored_samples];
+  static double upper[max_censored_samples];
+  static double midpoints[max_censored_samples];
+  static censored_distribution_t distribution;
+  enum { num_percentiles = ARRAY_LENGTH(censored_percentiles) };
+  metric_errors fit_errors[num_percentiles];
+  metric_errors midpoint_errors[num_percentiles];
+  memset(fit_errors, 0, sizeof(fit_errors));
+  memset(midpoint_errors, 0, sizeof(midpoint_errors));
+  for (int run = 0; run < fits; run++) {
+    uint64_t state = (*seed)++;
+    for (int i = 0; i < max_censored_samples; i++) {
+      // The event arrives at a random phase of jittered screenshots. The
+      // sample lies between the screenshots before and after the response,
+      // or after the event if no screenshot came between.
+      double latency = censored_latency_min_ms + random_fraction(&state) *
+          (censored_latency_max_ms - censored_latency_min_ms);
+      double before = 0;
+      double after = -random_fraction(&state) * censored_capture_interval_ms;
+      while (after < latency) {
+        before = after;
+        after += censored_capture_interval_ms *
+            (1 + capture_jitter_fraction * (2 * random_fraction(&state) - 1));
+      }
+      lower[i] = before > 0 ? before : 0;
+      upper[i] = after;
+      midpoints[i] = (lower[i] + upper[i]) / 2;
+    }
+    if (!fit_censored_distribution(lower, upper, max_censored_samples,
+                                   &distribution)) {
+      return false;
+    }
+    qsort(midpoints, max_censored_samples, sizeof(double), compare_doubles);
+    for (int p = 0; p < num_percentiles; p++) {
+      double fraction = censored_percentiles[p] / 100;
+      double truth = censored_latency_min_ms + fraction *
+          (censored_latency_max_ms - censored_latency_min_ms);
+      double fit_error = censored_distribution_quantile(&distribution,
+          fraction) - truth;
+      double midpoint_error =
+          midpoints[(int)(fraction * (max_censored_samples - 1))] - truth;
+      fit_errors[p].runs++;
+      fit_errors[p].truth_sum += truth;
+      fit_errors[p].error_sum += fit_error;
+      fit_errors[p].error_squares_sum += fit_error * fit_error;
+      midpoint_errors[p].runs++;
+      midpoint_errors[p].error_sum += midpoint_error;
+    }
+  }
+  printf("interval-censored fit, uniform %.0f-%.0f ms latency, capture every "
+         "%.1f ms: %d fits\n", censored_latency_min_ms,
+         censored_latency_max_ms, censored_capture_interval_ms, fits);
+  printf("  %-16s %10s %10s %10s %10s %12s\n", "metric", "truth ms",
+         "bias ms", "stddev ms", "allowed ms", "midpoint bias");
+  bool passed = true;
+  for (int p = 0; p < num_percentiles; p++) {
+    double bias = fit_errors[p].error_sum / fits;
+    double variance = fit_errors[p].error_squares_sum / fits - bias * bias;
+    double stddev = variance > 0 ? sqrt(variance) : 0;
+    bool within_tolerance = fabs(bias) - allowed_standard_errors * stddev /
+        sqrt((double)fits) <= censored_fit_allowed_ms;
+    passed = passed && within_tolerance;
+    printf("  p%-15.0f %10.2f %+10.2f %10.2f %10.2f %+12.2f%s\n",
+           censored_percentiles[p], fit_errors[p].truth_sum / fits, bias,
+           stddev, censored_fit_allowed_ms, midpoint_errors[p].error_sum / fits,
+           within_tolerance ? "" : "  FAILED");
+  }
+  fflush(stdout);
+  return passed;
+}
+
+static void print_usage_and_exit() {
+  fprintf(stderr, "usage: validate-estimators [-n repetitions] [-s seed] [-v]\n");
+  fprintf(stderr, "                           [-o stamp_file]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Runs the latency tests against a simulated display with known latency\n");
+  fprintf(stderr, "and reports the bias and standard deviation of each estimate. Exits\n");
+  fprintf(stderr, "with status 1 if a test fails or an estimate's bias exceeds its\n");
+  fprintf(stderr, "tolerance. -n sets the number of runs of each scenario, -s the first\n");
+  fprintf(stderr, "seed and -v logs failed runs. -o writes stamp_file if every estimate\n");
+  fprintf(stderr, "is within tolerance, for build systems.\n");
+  exit(1);
+}
+
+int main(int argc, const char **argv) {
+  int repetitions = default_repetitions;
+  uint64_t seed = 1;
+  bool verbose = false;
+  const char *stamp_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      repetitions = atoi(argv[++i]);
+      if (repetitions <= 0) {
+        print_usage_and_exit();
+      }
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      if (!parse_seed(argv[++i], &seed)) {
+        print_usage_and_exit();
+      }
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      stamp_path = argv[++i];
+    } else {
+      print_usage_and_exit();
+    }
+  }
+  latency_session_t *session = create_latency_session(NULL);
+  if (!session) {
+    fprintf(stderr, "Failed to create session.\n");
+    return 1;
+  }
+  int scenarios = 1;
+  int failed_scenarios = check_censored_fit(repetitions, &seed) ? 0 : 1;
+  for (size_t k = 0; k < ARRAY_LENGTH(test_kinds); k++) {
+    for (size_t d = 0; d < ARRAY_LENGTH(delay_kinds); d++) {
+      for (size_t c = 0; c < ARRAY_LENGTH(capture_intervals_ms); c++) {
+        for (size_t r = 0; r < ARRAY_LENGTH(refresh_rates_hz); r++) {
+          scenarios++;
+          if (!run_scenario(session, &test_kinds[k], &delay_kinds[d],
+                  capture_intervals_ms[c], 1000 / refresh_rates_hz[r],
+                  repetitions, &seed, verbose)) {
+            failed_scenarios++;
+          }
+        }
+      }
+    }
+  }
+  destroy_latency_session(session);
+  printf("%d of %d scenarios failed.\n", failed_scenarios, scenarios);
+  if (failed_scenarios > 0) {
+    return 1;
+  }
+  if (stamp_path) {
+    FILE *stamp = fopen(stamp_path, "w");
+    if (!stamp) {
+      fprintf(stderr, "Failed to write %s.\n", stamp_path);
+      return 1;
+    }
+    fprintf(stamp, "%d scenarios passed.\n", scenarios);
+    fclose(stamp);
+  }
+  return 0;
+}
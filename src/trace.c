@@ -0,0 +1,139 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include "trace.h"
+
+// Every event belongs to this process ID, named after the benchmark.
+static const int trace_pid = 1;
+
+// Trace event timestamps and durations are in microseconds.
+static double to_microseconds(int64_t nanoseconds) {
+  return nanoseconds / 1000.0;
+}
+
+// Writes the fields shared by all events, leaving the event object open.
+static void begin_event(trace_t *trace, const char *phase, int track,
+                        const char *name, int64_t time) {
+  fprintf(trace->file, "%s\n{\"ph\": \"%s\", \"pid\": %d, \"tid\": %d, "
+          "\"name\": \"%s\", \"ts\": %.3f", trace->first_event ? "" : ",",
+          phase, trace_pid, track, name, to_microseconds(time));
+  trace->first_event = false;
+}
+
+// Writes the args object of an event and closes the event.
+static void end_event(trace_t *trace, const char *args, va_list list) {
+  fprintf(trace->file, ", \"args\": {");
+  vfprintf(trace->file, args, list);
+  fprintf(trace->file, "}}");
+}
+
+static void name_track(trace_t *trace, trace_track_t track, const char *name) {
+  fprintf(trace->file, "%s\n{\"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+          "\"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+          trace->first_event ? "" : ",", trace_pid, track, name);
+  trace->first_event = false;
+}
+
+trace_t *trace_open(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    debug_log("Failed to open trace file %s", path);
+    return NULL;
+  }
+  trace_t *trace = (trace_t *)malloc(sizeof(trace_t));
+  trace->file = file;
+  trace->first_event = true;
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  fprintf(file, "\n{\"ph\": \"M\", \"pid\": %d, \"name\": \"process_name\", "
+          "\"args\": {\"name\": \"latency-benchmark\"}}", trace_pid);
+  trace->first_event = false;
+  name_track(trace, TRACE_TRACK_SCREENSHOTS, "Screenshots");
+  name_track(trace, TRACE_TRACK_INPUT, "Input events");
+  name_track(trace, TRACE_TRACK_RESPONSES, "Responses");
+  name_track(trace, TRACE_TRACK_WAITS, "Waits");
+  return trace;
+}
+
+void trace_close(trace_t *trace) {
+  if (!trace) {
+    return;
+  }
+  fprintf(trace->file, "\n]}\n");
+  fclose(trace->file);
+  free(trace);
+}
+
+void trace_complete(trace_t *trace, trace_track_t track, const char *name,
+                    int64_t start_time, int64_t end_time,
+                    const char *args, ...) {
+  if (!trace) {
+    return;
+  }
+  begin_event(trace, "X", track, name, start_time);
+  fprintf(trace->file, ", \"dur\": %.3f",
+          to_microseconds(end_time - start_time));
+  va_list list;
+  va_start(list, args);
+  end_event(trace, args, list);
+  va_end(list);
+}
+
+void trace_instant(trace_t *trace, trace_track_t track, const char *name,
+                   int64_t time, const char *args, ...) {
+  if (!trace) {
+    return;
+  }
+  begin_event(trace, "i", track, name, time);
+  // Scope the instant to its track rather than the whole timeline.
+  fprintf(trace->file, ", \"s\": \"t\"");
+  va_list list;
+  va_start(list, args);
+  end_event(trace, args, list);
+  va_end(list);
+}
+
+void trace_async(trace_t *trace, const char *name, int64_t id,
+                 int64_t start_time, int64_t end_time, const char *args, ...) {
+  if (!trace) {
+    return;
+  }
+  // Async events are drawn on their own tracks, grouped by name, so they're
+  // free to overlap.
+  begin_event(trace, "b", TRACE_TRACK_INPUT, name, start_time);
+  fprintf(trace->file, ", \"cat\": \"latency\", \"id\": \"%llx\"",
+          (unsigned long long)id);
+  va_list list;
+  va_start(list, args);
+  end_event(trace, args, list);
+  va_end(list);
+  begin_event(trace, "e", TRACE_TRACK_INPUT, name, end_time);
+  fprintf(trace->file, ", \"cat\": \"latency\", \"id\": \"%llx\"}",
+          (unsigned long long)id);
+}
+
+void trace_counter(trace_t *trace, const char *name, int64_t time,
+                   int64_t value) {
+  if (!trace) {
+    return;
+  }
+  // Counters are drawn per process, so the track doesn't matter.
+  begin_event(trace, "C", TRACE_TRACK_RESPONSES, name, time);
+  fprintf(trace->file, ", \"args\": {\"value\": %lld}}", (long long)value);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Writes a timeline of a latency test in the Trace Event Format, which can be
+// loaded in chrome://tracing or Perfetto. Every function accepts a NULL trace
+// and does nothing, so callers don't need to check whether tracing is on.
+
+#ifndef WLB_TRACE_H_
+#define WLB_TRACE_H_
+
+#include <stdio.h>
+#include "screenscraper.h"
+
+// Events are grouped onto these tracks, which show up as threads in the
+// timeline.
+typedef enum {
+  TRACE_TRACK_SCREENSHOTS = 1,  // Screenshots of the test pattern.
+  TRACE_TRACK_INPUT = 2,        // Input events sent to the test window.
+  TRACE_TRACK_RESPONSES = 3,    // Changes seen in the test pattern.
+  TRACE_TRACK_WAITS = 4,        // Deliberate delays between events.
+} trace_track_t;
+
+typedef struct {
+  FILE *file;
+  bool first_event;
+} trace_t;
+
+// Creates the trace file at the given path, replacing any existing file.
+// Returns NULL on failure.
+trace_t *trace_open(const char *path);
+// Finishes writing the trace and frees it.
+void trace_close(trace_t *trace);
+
+// The args parameter of the functions below is a printf format string for the
+// members of the event's JSON args object, e.g. "\"frames\": %d", or "" for
+// none. Times are in get_nanoseconds() units.
+
+// Records something that took place between start_time and end_time.
+void trace_complete(trace_t *trace, trace_track_t track, const char *name,
+                    int64_t start_time, int64_t end_time,
+                    const char *args, ...);
+// Records something that happened at an instant.
+void trace_instant(trace_t *trace, trace_track_t track, const char *name,
+                   int64_t time, const char *args, ...);
+// Records something that took place between start_time and end_time and may
+// overlap other events, such as the time from sending an input event until its
+// response was seen. id must be unique among the events with the same name.
+void trace_async(trace_t *trace, const char *name, int64_t id,
+                 int64_t start_time, int64_t end_time, const char *args, ...);
+// Records a new value of the named counter, which is drawn as a graph.
+void trace_counter(trace_t *trace, const char *name, int64_t time,
+                   int64_t value);
+
+#endif  // WLB_TRACE_H_
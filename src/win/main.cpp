@@ -26,7 +26,9 @@ static HGLRC context = NULL;
 static uint8_t pattern[pattern_bytes];
 static int scrolls = 0;
 static int key_downs = 0;
+static int key_identities = 0;
 static int esc_presses = 0;
+static draw_timing_t timing;
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
@@ -42,6 +44,14 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
   case WM_KEYDOWN:
     if (wParam == VK_ESCAPE) {
       esc_presses++;
+    } else if (wParam == 'Z') {
+      key_identities = push_key_identity(key_identities, KEY_IDENTITY_Z);
+    } else if (wParam == 'B') {
+      key_identities = push_key_identity(key_identities, KEY_IDENTITY_B);
+    } else if (wParam == 'T') {
+      key_identities = push_key_identity(key_identities, KEY_IDENTITY_T);
+    } else if (wParam == 'W') {
+      key_identities = push_key_identity(key_identities, KEY_IDENTITY_W);
     }
     key_downs++;
     InvalidateRect(hwnd, NULL, false);
@@ -50,7 +60,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
     PAINTSTRUCT ps;
     BeginPaint(hwnd, &ps);
     wglMakeCurrent(ps.hdc, context);
-    draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+    draw_pattern_with_opengl(&timing, pattern, scrolls, key_downs,
+                             key_identities, esc_presses);
     SwapBuffers(ps.hdc);
     EndPaint(hwnd, &ps);
     break;
@@ -201,6 +212,18 @@ int APIENTRY _tWinMain(_In_ HINSTANCE hInstance,
     return 0;
   }
 
+  if (opts.benchmark_clock) {
+    // There's no console to print to unless we were started from one, so
+    // show the results in a message box too.
+    clock_benchmark_results_t results;
+    benchmark_clock(&results);
+    char report[1024];
+    format_clock_benchmark(&results, report, sizeof(report));
+    printf("%s", report);
+    MessageBox(NULL, report, "Clock benchmark", MB_ICONINFORMATION | MB_OK);
+    return 0;
+  }
+
   debug_log("running server");
   HDC desktop = GetDC(NULL);
   assert(desktop);
@@ -59,7 +59,54 @@ int64_t get_nanoseconds() {
   return get_nanoseconds_elapsed(current_time);
 }
 
+const char *get_clock_source() {
+  return "QueryPerformanceCounter";
+}
+
+
+struct platform_context_t {
+  // Set once the test has given up on DXGI. DXGI blocks until the next frame
+  // is composited, while GDI returns right away, so GDI may keep up when DXGI
+  // screenshots are too far apart.
+  bool gdi_fallback;
+  HANDLE browser_process_handle;
+  HANDLE window_process_handle;
+};
+
+
+// Windows has a single interactive desktop, so the display name is ignored.
+platform_context_t *create_platform_context(const char *display_name) {
+  platform_context_t *platform =
+      (platform_context_t *)malloc(sizeof(platform_context_t));
+  memset(platform, 0, sizeof(platform_context_t));
+  return platform;
+}
+
+
+void destroy_platform_context(platform_context_t *platform) {
+  if (!platform) {
+    return;
+  }
+  if (platform->window_process_handle) {
+    close_native_reference_window(platform);
+  }
+  if (platform->browser_process_handle) {
+    close_browser(platform);
+  }
+  free(platform);
+}
 
+
+// Screenshots remember which method took them, since a context may switch
+// methods while screenshots are outstanding.
+typedef struct {
+  screenshot shot;  // Must be first, so this can be cast to a screenshot.
+  bool from_dxgi;
+} windows_screenshot;
+
+
+// The desktop duplication interface can only be created once per output, so
+// all contexts share it.
 static INIT_ONCE directx_initialization;
 static CRITICAL_SECTION directx_critical_section;
 static ID3D11Device *device = NULL;
@@ -191,7 +238,10 @@ static screenshot *take_screenshot_with_dxgi(uint32_t x, uint32_t y,
   hr = context->Map(screenshot_texture, 0, D3D11_MAP_READ_WRITE, 0,
       &screenshot_mapped);
   assert(hr == S_OK);
-  screenshot *screen = (screenshot *)malloc(sizeof(screenshot));
+  windows_screenshot *windows_screen =
+      (windows_screenshot *)malloc(sizeof(windows_screenshot));
+  windows_screen->from_dxgi = true;
+  screenshot *screen = &windows_screen->shot;
   screen->width = width;
   screen->height = height;
   screen->stride = screenshot_mapped.RowPitch;
@@ -257,7 +307,10 @@ static screenshot *take_screenshot_with_gdi(uint32_t x, uint32_t y,
   assert(ir);
   r = DeleteObject(memory_dc);
   assert(r);
-  screenshot *shot = (screenshot *)malloc(sizeof(screenshot));
+  windows_screenshot *windows_shot =
+      (windows_screenshot *)malloc(sizeof(windows_screenshot));
+  windows_shot->from_dxgi = false;
+  screenshot *shot = &windows_shot->shot;
   shot->pixels = pixels;
   shot->width = width;
   shot->height = height;
@@ -268,7 +321,10 @@ static screenshot *take_screenshot_with_gdi(uint32_t x, uint32_t y,
 }
 
 
-static bool use_dxgi() {
+static bool use_dxgi(platform_context_t *platform) {
+  if (platform->gdi_fallback) {
+    return false;
+  }
   OSVERSIONINFO version;
   memset(&version, 0, sizeof(OSVERSIONINFO));
   version.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
@@ -280,9 +336,9 @@ static bool use_dxgi() {
 }
 
 
-screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
-    uint32_t height) {
-  if (use_dxgi()) {
+screenshot *take_screenshot(platform_context_t *platform, uint32_t x,
+    uint32_t y, uint32_t width, uint32_t height) {
+  if (use_dxgi(platform)) {
     // On Windows 8+ we use the DXGI 1.2 Desktop Duplication API.
     return take_screenshot_with_dxgi(x, y, width, height);
   } else {
@@ -292,8 +348,22 @@ screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
 }
 
 
+const char *get_screenshot_backend(platform_context_t *platform) {
+  return use_dxgi(platform) ? "DXGI Desktop Duplication" : "GDI";
+}
+
+
+bool use_cheaper_screenshot_backend(platform_context_t *platform) {
+  if (!use_dxgi(platform)) {
+    return false;
+  }
+  platform->gdi_fallback = true;
+  return true;
+}
+
+
 void free_screenshot(screenshot *shot) {
-  if (use_dxgi()) {
+  if (((windows_screenshot *)shot)->from_dxgi) {
     EnterCriticalSection(&directx_critical_section);
     ID3D11Texture2D *texture = (ID3D11Texture2D *)shot->platform_specific_data;
     context->Unmap(texture, 0);
@@ -320,12 +390,20 @@ static bool send_keystroke(WORD key_code) {
   return true;
 }
 
-bool send_keystroke_b() { return send_keystroke(0x42); }
-bool send_keystroke_t() { return send_keystroke(0x54); }
-bool send_keystroke_w() { return send_keystroke(0x57); }
-bool send_keystroke_z() { return send_keystroke(0x5A); }
+bool send_keystroke_b(platform_context_t *platform) {
+  return send_keystroke(0x42);
+}
+bool send_keystroke_t(platform_context_t *platform) {
+  return send_keystroke(0x54);
+}
+bool send_keystroke_w(platform_context_t *platform) {
+  return send_keystroke(0x57);
+}
+bool send_keystroke_z(platform_context_t *platform) {
+  return send_keystroke(0x5A);
+}
 
-bool send_scroll_down(int x, int y) {
+bool send_scroll_down(platform_context_t *platform, int x, int y) {
   SetCursorPos(x, y);
   INPUT input;
   memset(&input, 0, sizeof(INPUT));
@@ -368,9 +446,8 @@ int usleep(unsigned int microseconds) {
   return 0;
 }
 
-HANDLE browser_process_handle = NULL;
-
-bool open_browser(const char *program, const char *args, const char *url) {
+bool open_browser(platform_context_t *platform, const char *program,
+                  const char *args, const char *url) {
   // Recommended by:
   // http://msdn.microsoft.com/en-us/library/windows/desktop/bb762153(v=vs.85).aspx
 
@@ -396,27 +473,26 @@ bool open_browser(const char *program, const char *args, const char *url) {
     debug_log("Failed to start process");
     return false;
   }
-  browser_process_handle = process_info.hProcess;
+  platform->browser_process_handle = process_info.hProcess;
   return true;
 }
 
-bool close_browser() {
-  if (browser_process_handle == NULL) {
+bool close_browser(platform_context_t *platform) {
+  if (platform->browser_process_handle == NULL) {
     debug_log("browser not open");
     return false;
   }
-  if (!TerminateProcess(browser_process_handle, 0)) {
+  if (!TerminateProcess(platform->browser_process_handle, 0)) {
     debug_log("Failed to terminate process");
-    browser_process_handle = NULL;
+    platform->browser_process_handle = NULL;
     return false;
   }
-  browser_process_handle = NULL;
+  platform->browser_process_handle = NULL;
   return true;
 }
 
-HANDLE window_process_handle = NULL;
-
-bool open_native_reference_window(uint8_t *test_pattern_for_window) {
+bool open_native_reference_window(platform_context_t *platform,
+                                  uint8_t *test_pattern_for_window) {
   // The native reference window is opened in a new child process to make the
   // test more fair. Unfortunately Visual Studio can't automatically attach to
   // child processes. WinDbg can, so you can use WinDbg to debug the native
@@ -425,7 +501,7 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
   // window code in isolation. Here are some sample arguments that will work:
   // -p 2923BEE16CD6529049F1BBE9 -h 0
 
-  if (window_process_handle != NULL) {
+  if (platform->window_process_handle != NULL) {
     debug_log("native window already open");
     return false;
   }
@@ -455,22 +531,22 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
     debug_log("Failed to start process");
     return false;
   }
-  window_process_handle = process_info.hProcess;
+  platform->window_process_handle = process_info.hProcess;
   // Wait for window show animation to finish.
   usleep(1000 * 1000 * 2);
   return true;
 }
 
-bool close_native_reference_window() {
-  if (window_process_handle == NULL) {
+bool close_native_reference_window(platform_context_t *platform) {
+  if (platform->window_process_handle == NULL) {
     debug_log("native window not open");
     return false;
   }
-  if (!TerminateProcess(window_process_handle, 0)) {
+  if (!TerminateProcess(platform->window_process_handle, 0)) {
     debug_log("Failed to terminate process");
-    window_process_handle = NULL;
+    platform->window_process_handle = NULL;
     return false;
   }
-  window_process_handle = NULL;
+  platform->window_process_handle = NULL;
   return true;
 }
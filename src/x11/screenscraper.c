@@ -23,7 +23,12 @@
 #include <X11/extensions/XTest.h>
 #include <GL/glx.h>
 #include <stddef.h>
-#include <sys/time.h>   // gettimeofday
+#include <time.h>       // clock_gettime
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>  // __rdtsc
+#endif
 #include <string.h>     // memset
 #include <math.h>
 #include <assert.h>
@@ -38,9 +43,6 @@
 #include <wordexp.h>
 
 
-
-static Display *display = NULL;
-
 #define min(X, Y) ((X) < (Y) ? (X) : (Y))
 #define max(X, Y) ((X) > (Y) ? (X) : (Y))
 
@@ -50,14 +52,64 @@ static int clamp(int value, int minimum, int maximum) {
 }
 
 
-screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
-    uint32_t height) {
+struct platform_context_t {
+  Display *display;
+  // The name the display was opened with, or NULL for the default display.
+  char *display_name;
+  bool x_test_extension_queried;
+  bool x_test_extension_available;
+  pid_t browser_process_pid;
+  pid_t window_process_pid;
+};
+
+
+static pthread_once_t xlib_init_once = PTHREAD_ONCE_INIT;
+
+static void init_xlib() {
+  // Sessions on different threads each have their own display connection, but
+  // Xlib still shares some state between connections.
+  XInitThreads();
+}
+
+
+platform_context_t *create_platform_context(const char *display_name) {
+  pthread_once(&xlib_init_once, init_xlib);
+  Display *display = XOpenDisplay(display_name);
   if (!display) {
-    display = XOpenDisplay(NULL);
-    if (!display) {
-      return false;
-    }
+    debug_log("Failed to open display %s",
+        display_name ? display_name : XDisplayName(NULL));
+    return NULL;
+  }
+  platform_context_t *context =
+      (platform_context_t *)malloc(sizeof(platform_context_t));
+  memset(context, 0, sizeof(platform_context_t));
+  context->display = display;
+  if (display_name) {
+    context->display_name = strdup(display_name);
+  }
+  return context;
+}
+
+
+void destroy_platform_context(platform_context_t *context) {
+  if (!context) {
+    return;
+  }
+  if (context->window_process_pid) {
+    close_native_reference_window(context);
   }
+  if (context->browser_process_pid) {
+    close_browser(context);
+  }
+  XCloseDisplay(context->display);
+  free(context->display_name);
+  free(context);
+}
+
+
+screenshot *take_screenshot(platform_context_t *context, uint32_t x,
+    uint32_t y, uint32_t width, uint32_t height) {
+  Display *display = context->display;
   // Make sure width and height can be safely converted to signed integers.
   width = min(width, INT_MAX);
   height = min(height, INT_MAX);
@@ -104,13 +156,20 @@ void free_screenshot(screenshot *shot) {
 }
 
 
-static bool send_keystroke(int keysym) {
-  if (!display) {
-    display = XOpenDisplay(NULL);
-    if (!display) {
-      return false;
-    }
-  }
+const char *get_screenshot_backend(platform_context_t *context) {
+  return "XGetImage";
+}
+
+
+bool use_cheaper_screenshot_backend(platform_context_t *context) {
+  // The pattern is read with a single small XGetImage request, which is
+  // already as cheap as X gets.
+  return false;
+}
+
+
+static bool send_keystroke(platform_context_t *context, int keysym) {
+  Display *display = context->display;
   // Send a keydown event for the 'Z' key, followed immediately by keyup.
   XKeyEvent event;
   memset(&event, 0, sizeof(XKeyEvent));
@@ -133,29 +192,30 @@ static bool send_keystroke(int keysym) {
 }
 
 
-bool send_keystroke_b() { return send_keystroke(XK_B); }
-bool send_keystroke_t() { return send_keystroke(XK_T); }
-bool send_keystroke_w() { return send_keystroke(XK_W); }
-bool send_keystroke_z() { return send_keystroke(XK_Z); }
+bool send_keystroke_b(platform_context_t *context) {
+  return send_keystroke(context, XK_B);
+}
+bool send_keystroke_t(platform_context_t *context) {
+  return send_keystroke(context, XK_T);
+}
+bool send_keystroke_w(platform_context_t *context) {
+  return send_keystroke(context, XK_W);
+}
+bool send_keystroke_z(platform_context_t *context) {
+  return send_keystroke(context, XK_Z);
+}
 
 
-bool send_scroll_down(int x, int y) {
-  if (!display) {
-    display = XOpenDisplay(NULL);
-    if (!display) {
-      return false;
-    }
-  }
+bool send_scroll_down(platform_context_t *context, int x, int y) {
+  Display *display = context->display;
   XWarpPointer(display, None, RootWindow(display, 0), 0, 0, 0, 0, x, y);
-  static bool x_test_extension_queried = false;
-  static bool x_test_extension_available = false;
-  if (!x_test_extension_queried) {
-    x_test_extension_queried = true;
+  if (!context->x_test_extension_queried) {
+    context->x_test_extension_queried = true;
     int ignored;
-    x_test_extension_available = XTestQueryExtension(display, &ignored,
-        &ignored, &ignored, &ignored);
+    context->x_test_extension_available = XTestQueryExtension(display,
+        &ignored, &ignored, &ignored, &ignored);
   }
-  if (!x_test_extension_available) {
+  if (!context->x_test_extension_available) {
     debug_log("XTest extension not available.");
     return false;
     // TODO: figure out why XSendEvent isn't working. XTest shouldn't be
@@ -191,19 +251,96 @@ bool send_scroll_down(int x, int y) {
 }
 
 
-static bool start_time_initialized = false;
-static struct timeval start_time;
-static const int64_t nanoseconds_per_microsecond = 1000;
+// get_nanoseconds reads CLOCK_MONOTONIC_RAW, which unlike the wall clock is
+// never slewed or stepped by NTP. On x86 CPUs with an invariant TSC, where the
+// kernel itself trusts the TSC as its clocksource, we instead read the TSC
+// directly and scale it by a rate calibrated against CLOCK_MONOTONIC_RAW. That
+// avoids the cost of a vDSO call on every read.
+static pthread_once_t clock_init_once = PTHREAD_ONCE_INIT;
+static int64_t start_time;
+static bool use_tsc = false;
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t start_tsc;
+static double nanoseconds_per_tsc_tick;
+// How long to spend measuring the TSC rate. Longer is more accurate; the
+// error is at most about one clock_gettime call divided by this.
+static const int64_t tsc_calibration_ns = 20 * 1000 * 1000;
+#endif
+
+static int64_t read_monotonic_raw_clock() {
+  struct timespec time;
+  int r = clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+  assert(!r);
+  return ((int64_t)time.tv_sec) * nanoseconds_per_second + time.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Returns true if the TSC ticks at a constant rate regardless of power states
+// and the kernel is using it as its own clocksource, which means it also found
+// the TSC to be synchronized across CPUs.
+static bool tsc_is_reliable() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+      !(edx & (1 << 8))) {
+    return false;
+  }
+  FILE *file = fopen(
+      "/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+  if (!file) {
+    return false;
+  }
+  char clocksource[32] = "";
+  bool read = fgets(clocksource, sizeof(clocksource), file) != NULL;
+  fclose(file);
+  return read && strncmp(clocksource, "tsc", 3) == 0 &&
+      (clocksource[3] == '\n' || clocksource[3] == '\0');
+}
+
+static void calibrate_tsc() {
+  int64_t monotonic_start = read_monotonic_raw_clock();
+  uint64_t tsc_start = __rdtsc();
+  int64_t monotonic_end;
+  do {
+    monotonic_end = read_monotonic_raw_clock();
+  } while (monotonic_end - monotonic_start < tsc_calibration_ns);
+  uint64_t tsc_end = __rdtsc();
+  nanoseconds_per_tsc_tick =
+      (monotonic_end - monotonic_start) / (double)(tsc_end - tsc_start);
+  start_tsc = tsc_end;
+  start_time = monotonic_end;
+  debug_log("TSC calibrated at %f MHz", 1000 / nanoseconds_per_tsc_tick);
+}
+#endif
+
+static void init_clock() {
+  start_time = read_monotonic_raw_clock();
+#if defined(__x86_64__) || defined(__i386__)
+  if (tsc_is_reliable()) {
+    calibrate_tsc();
+    use_tsc = true;
+  }
+#endif
+}
+
+// Returns the number of nanoseconds elapsed since the clock was initialized by
+// the first call to get_nanoseconds in this process.
 int64_t get_nanoseconds() {
-  if (!start_time_initialized) {
-    gettimeofday(&start_time, NULL);
-    start_time_initialized = true;
+  pthread_once(&clock_init_once, init_clock);
+#if defined(__x86_64__) || defined(__i386__)
+  if (use_tsc) {
+    // TSC readings before start_tsc can come from other CPUs that read the
+    // TSC slightly earlier, so clamp to keep results monotonic.
+    int64_t ticks = (int64_t)(__rdtsc() - start_tsc);
+    return ticks > 0 ? (int64_t)(ticks * nanoseconds_per_tsc_tick) : 0;
   }
-  struct timeval current_time, difference;
-  gettimeofday(&current_time, NULL);
-  timersub(&current_time, &start_time, &difference);
-  return ((int64_t)difference.tv_sec) * nanoseconds_per_second +
-      ((int64_t)difference.tv_usec) * nanoseconds_per_microsecond;
+#endif
+  return read_monotonic_raw_clock() - start_time;
+}
+
+const char *get_clock_source() {
+  pthread_once(&clock_init_once, init_clock);
+  return use_tsc ? "TSC calibrated against CLOCK_MONOTONIC_RAW" :
+      "CLOCK_MONOTONIC_RAW";
 }
 
 
@@ -218,11 +355,10 @@ void debug_log(const char *message, ...) {
 #endif
 }
 
-static pid_t browser_process_pid = 0;
-
-bool open_browser(const char *program, const char *args, const char *url) {
+bool open_browser(platform_context_t *context, const char *program,
+                  const char *args, const char *url) {
   assert(url);
-  if (browser_process_pid) {
+  if (context->browser_process_pid) {
     debug_log("Warning: calling open_browser, but browser already open.");
   }
   if (program == NULL) {
@@ -242,9 +378,12 @@ bool open_browser(const char *program, const char *args, const char *url) {
     debug_log("Failed to parse command line: %s", command_line);
     return false;
   }
-  browser_process_pid = fork();
-  if (!browser_process_pid) {
-    // child process, launch the browser!
+  context->browser_process_pid = fork();
+  if (!context->browser_process_pid) {
+    // child process, launch the browser on the context's display!
+    if (context->display_name) {
+      setenv("DISPLAY", context->display_name, 1);
+    }
     execvp(expanded_args.we_wordv[0], expanded_args.we_wordv);
     debug_log("Failed to execute browser!");
     exit(1);
@@ -253,13 +392,13 @@ bool open_browser(const char *program, const char *args, const char *url) {
   return true;
 }
 
-bool close_browser() {
-  if (browser_process_pid == 0) {
+bool close_browser(platform_context_t *context) {
+  if (context->browser_process_pid == 0) {
     debug_log("Browser not open");
     return false;
   }
-  int r = kill(browser_process_pid, SIGKILL);
-  browser_process_pid = 0;
+  int r = kill(context->browser_process_pid, SIGKILL);
+  context->browser_process_pid = 0;
   if (r) {
     debug_log("Failed to close browser window");
     return false;
@@ -267,7 +406,7 @@ bool close_browser() {
   return true;
 }
 
-static bool extension_supported(const char *name) {
+static bool extension_supported(Display *display, const char *name) {
   const char *extensions = glXQueryExtensionsString(display, DefaultScreen(display));
   debug_log(extensions);
   const char *found = strstr(extensions, name);
@@ -288,23 +427,23 @@ typedef void (*glXSwapIntervalEXT_t)(Display *, GLXDrawable, int);
 static glXSwapIntervalEXT_t p_glXSwapIntervalEXT = NULL;
 
 
-static void initialize_gl_extensions() {
-  if (extension_supported("GLX_MESA_swap_control")) {
+static void initialize_gl_extensions(Display *display) {
+  if (extension_supported(display, "GLX_MESA_swap_control")) {
     // Intel and AMD and MESA support this one, but not NVIDIA
     p_glXSwapIntervalMESA = (glXSwapIntervalMESA_t)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalMESA");
   }
-  if (extension_supported("GLX_EXT_swap_control")) {
+  if (extension_supported(display, "GLX_EXT_swap_control")) {
     // This one is supported by NVIDIA, but not Intel or AMD
     p_glXSwapIntervalEXT = (glXSwapIntervalEXT_t)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalEXT");
   }
 }
 
 
-static void native_reference_window_event_loop(uint8_t pattern[]) {
-  // This function should only be called from a child process that isn't yet
-  // connected to the X server.
-  assert(!display);
-  display = XOpenDisplay(NULL);
+static void native_reference_window_event_loop(const char *display_name,
+                                               uint8_t pattern[]) {
+  // This function should only be called from a child process, which makes its
+  // own connection to the X server rather than sharing the parent's.
+  Display *display = XOpenDisplay(display_name);
   assert(display);
   // Initialize GLX.
   int visual_attributes[] = { GLX_RGBA,
@@ -346,7 +485,7 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
   // Initialize GL and extensions.
   bool success = glXMakeCurrent(display, window, context);
   assert(success);
-  initialize_gl_extensions();
+  initialize_gl_extensions(display);
 
   // Disable vsync to avoid blocking on swaps. Ideally we would sync to the
   // display's refresh rate and render at the best possible time to achieve low
@@ -373,10 +512,14 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
   }
 
   // Draw the pattern on the window before showing it.
+  draw_timing_t timing;
+  memset(&timing, 0, sizeof(draw_timing_t));
   int scrolls = 0;
   int key_downs = 0;
+  int key_identities = 0;
   int esc_presses = 0;
-  draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+  draw_pattern_with_opengl(&timing, pattern, scrolls, key_downs,
+                           key_identities, esc_presses);
   glXSwapBuffers(display, window);
  
   // Show the window.
@@ -394,14 +537,23 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
         // This is probably a mousewheel event.
         scrolls++;
       } else if (event.type == KeyPress) {
-        if (XkbKeycodeToKeysym(display, event.xkey.keycode, 0, 0) ==
-            XK_Escape) {
+        KeySym key = XkbKeycodeToKeysym(display, event.xkey.keycode, 0, 0);
+        if (key == XK_Escape) {
           esc_presses++;
+        } else if (key == XK_z) {
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_Z);
+        } else if (key == XK_b) {
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_B);
+        } else if (key == XK_t) {
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_T);
+        } else if (key == XK_w) {
+          key_identities = push_key_identity(key_identities, KEY_IDENTITY_W);
         }
         key_downs++;
       }
     }
-    draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+    draw_pattern_with_opengl(&timing, pattern, scrolls, key_downs,
+                             key_identities, esc_presses);
     glXSwapBuffers(display, window);
     usleep(1000 * 5);
   }
@@ -409,20 +561,18 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
 }
 
 
-static pid_t window_process_pid = 0;
-
-
-bool open_native_reference_window(uint8_t *test_pattern_for_window) {
-  if (window_process_pid != 0) {
+bool open_native_reference_window(platform_context_t *context,
+                                  uint8_t *test_pattern_for_window) {
+  if (context->window_process_pid != 0) {
     debug_log("Native reference window already open");
     return false;
   }
-  window_process_pid = fork();
-  if (!window_process_pid) {
-    // Child process. Throw away the X11 display connection from the parent
-    // process; we will create a new one for the child.
-    display = NULL;
-    native_reference_window_event_loop(test_pattern_for_window);
+  context->window_process_pid = fork();
+  if (!context->window_process_pid) {
+    // Child process. Ignore the X11 display connection from the parent
+    // process; the child creates a new one on the same display.
+    native_reference_window_event_loop(context->display_name,
+                                       test_pattern_for_window);
     exit(0);
   }
   // Parent process. Wait for the child to launch and show its window before
@@ -431,13 +581,13 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
   return true;
 }
 
-bool close_native_reference_window() {
-  if (window_process_pid == 0) {
+bool close_native_reference_window(platform_context_t *context) {
+  if (context->window_process_pid == 0) {
     debug_log("Native reference window not open");
     return false;
   }
-  int r = kill(window_process_pid, SIGKILL);
-  window_process_pid = 0;
+  int r = kill(context->window_process_pid, SIGKILL);
+  context->window_process_pid = 0;
   if (r) {
     debug_log("Failed to close native reference window");
     return false;